@@ -0,0 +1,167 @@
+#ifndef TWIG_CACHE_HPP
+#define TWIG_CACHE_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <set>
+#include <map>
+#include <unordered_map>
+
+#include <twig/loader.hpp>
+
+namespace twig {
+namespace detail {
+    class DocumentNode ;
+    typedef std::shared_ptr<DocumentNode> DocumentNodePtr ;
+}
+
+// Cache of compiled templates shared by renderers and threads.
+// Keys are hashed to a number of shards, each holding its table under a reader/writer lock: lookups share it, so
+// concurrent readers only contend on the lock word of their own shard, while inserts and removals take it exclusively
+// and update the table in place.
+// The cache may be bounded by number of entries and/or by the total source size of the stored templates, in which
+// case entries are evicted in least recently used order. Every shard keeps its entries in a list ordered by insertion;
+// an entry at the head that was used since it was queued is moved to the tail instead of being evicted, so eviction
+// costs constant amortized time and lookups never modify the list.
+// Entries store the version of their template source. When a check interval is set, an entry older than the interval
+// is revalidated on access, together with the cached templates it depends on, and recompiled if a source has changed.
+// Entries also store the versions of the templates linked into them, which are checked even when those are no
+// longer cached.
+// The cache keeps the reverse dependency graph of its entries, so that invalidating or replacing a template also
+// evicts the templates that extend, include, import or embed it.
+
+class Cache {
+public:
+
+    using Entry = detail::DocumentNodePtr ;
+
+    struct Stats {
+        size_t hits_ = 0, misses_ = 0, evictions_ = 0, invalidations_ = 0 ;
+        size_t entries_ = 0, size_ = 0 ;
+    };
+
+    // zero means no limit; max_size counts the bytes of template source, an estimate of the compiled size rather
+    // than a measure of it
+    Cache(size_t max_entries = 0, size_t max_size = 0, size_t num_shards = 16) ;
+
+    // how often cached entries are checked for modifications of their source, zero (default) disables checks
+    void setCheckInterval(std::chrono::milliseconds interval) {
+        check_interval_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval).count() ;
+    }
+
+    struct EntryInfo {
+        size_t size_ = 0 ; // estimated memory footprint of the compiled template (the renderer uses the source length)
+        TemplateVersion version_ ;
+        std::set<std::string> dependencies_ ; // keys of the templates it references
+        std::map<std::string, TemplateVersion> linked_ ; // versions of the templates compiled into it
+    };
+
+    void add(const std::string &key, const Entry &val, const EntryInfo &info) ;
+    void add(const std::string &key, const Entry &val) { add(key, val, EntryInfo()) ; }
+
+    // returns nullptr if not found
+    Entry fetch(const std::string &key) ;
+
+    // returns the cached entry or calls compiler to create and add it. Concurrent requests for the same key
+    // wait for a single compilation and share its result (or exception). The compiler fills in the entry info.
+    // The validator tells whether the version of a cached template is still current.
+    using Compiler = std::function<Entry (EntryInfo &info)> ;
+    using Validator = std::function<bool (const std::string &key, const TemplateVersion &version)> ;
+
+    Entry fetchOrAdd(const std::string &key, const Compiler &compiler, const Validator &validator = nullptr) ;
+
+    // remove a single entry
+    void remove(const std::string &key) ;
+
+    // remove an entry and all cached entries that depend on it directly or indirectly, returns the number removed
+    size_t invalidate(const std::string &key) ;
+
+    // keys of the cached entries that depend on key directly or indirectly
+    std::set<std::string> dependents(const std::string &key) const ;
+
+    void clear() ;
+
+    Stats stats() const ;
+
+private:
+
+    struct Item {
+        Item(const std::string &key, const Entry &val, const EntryInfo &info, uint64_t tick, int64_t now):
+            key_(key), val_(val), size_(info.size_), version_(info.version_), dependencies_(info.dependencies_),
+            linked_(info.linked_), last_used_(tick), queued_(tick), checked_(now) {}
+
+        std::string key_ ;
+        Entry val_ ;
+        size_t size_ ;
+        TemplateVersion version_ ;
+        std::set<std::string> dependencies_ ;
+        std::map<std::string, TemplateVersion> linked_ ;
+        std::atomic<uint64_t> last_used_ ;
+        uint64_t queued_ ; // tick when it was put at the tail of the recency list
+        std::atomic<int64_t> checked_ ; // steady clock ticks
+
+        // recency list of the shard, from the oldest entry to the newest
+        Item *older_ = nullptr, *newer_ = nullptr ;
+    };
+
+    using ItemPtr = std::shared_ptr<Item> ;
+    using Table = std::unordered_map<std::string, ItemPtr> ;
+
+    // compilation in progress
+    struct Flight {
+        std::thread::id owner_ ;
+        std::shared_future<Entry> result_ ;
+    };
+
+    struct Shard {
+        Table table_ ;
+        Item *oldest_ = nullptr, *newest_ = nullptr ;
+        mutable std::shared_mutex guard_ ;
+        std::mutex flight_guard_ ;
+        std::unordered_map<std::string, Flight> in_flight_ ;
+        std::atomic<uint64_t> clock_{0} ;
+        std::atomic<size_t> size_{0} ;
+    };
+
+    Shard &shard(const std::string &key) ;
+    ItemPtr lookup(Shard &s, const std::string &key) ;
+    ItemPtr peek(const std::string &key) ;
+    bool needsCheck(Item &item) ;
+    void revalidate(const std::string &key, const ItemPtr &item, const Validator &validator, std::set<std::string> &visited) ;
+    bool remove(Shard &s, const std::string &key, const ItemPtr &item) ;
+    void erase(Shard &s, Table::iterator it) ;
+    void evict(Shard &s, const Item *added) ;
+    static void enqueue(Shard &s, Item *item) ;
+    static void dequeue(Shard &s, Item *item) ;
+    void endFlight(Shard &s, const std::string &key) ;
+    size_t removeDependents(const std::string &key) ;
+    void link(const std::string &key, const Item &item) ;
+    void unlink(const std::string &key, const Item &item) ;
+
+    std::vector<std::unique_ptr<Shard>> shards_ ;
+    size_t max_entries_, max_size_ ; // per shard
+    std::atomic<int64_t> check_interval_{0} ;
+
+    // reverse dependency graph: key -> keys of the entries referencing it
+    std::unordered_map<std::string, std::set<std::string>> dependents_ ;
+    mutable std::mutex graph_guard_ ;
+
+    // wait-for graph of the compilations in progress, used to detect templates that reference each other from
+    // different threads before blocking
+    std::unordered_map<std::string, std::thread::id> flight_owners_ ;
+    std::unordered_map<std::thread::id, std::string> waiting_ ;
+    std::mutex wait_guard_ ;
+
+    std::atomic<size_t> hits_{0}, misses_{0}, evictions_{0}, invalidations_{0} ;
+};
+
+}
+#endif
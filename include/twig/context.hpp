@@ -3,8 +3,13 @@
 
 #include <memory>
 #include <set>
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <cstdint>
 
 #include <variant/variant.hpp>
+#include <twig/output.hpp>
 
 namespace twig {
 namespace detail {
@@ -14,42 +19,196 @@ typedef std::shared_ptr<NamedBlockNode> NamedBlockNodePtr ;
 
 class DocumentNode ;
 typedef std::shared_ptr<DocumentNode> DocumentNodePtr ;
+
+// inheritance chain of the template being rendered, starting from the most derived template
+typedef std::vector<const DocumentNode *> TemplateChain ;
+
+// variable names are interned to integer symbols when templates are compiled
+typedef uint32_t Symbol ;
+
+Symbol intern(const std::string &name) ;
+
+// variables declared by a scope (loop variables, macro and lambda arguments, set targets) are stored in an array
+// of slots of the frame opened by the scope, with a layout fixed at compile time
+struct SlotLayout {
+    SlotLayout() = default ;
+    SlotLayout(const std::vector<std::string> &names) ;
+
+    size_t size() const { return names_.size() ; }
+
+    std::vector<std::string> names_ ;
+    std::vector<Symbol> symbols_ ;
+};
 }
 
 class TemplateRenderer ;
 class TranslationManager ;
 
+// The evaluation context is a chain of variable frames. The root frame refers to the data passed by the caller
+// and every nested scope (loop iteration, with, include etc.) pushes a new frame on top of its parent.
+// Lookups walk up the chain while assignments always go to the local frame, so opening a scope is O(1).
+// Variables declared by the template are held in slots of the frame and found by their interned symbol, while the
+// root frame resolves the symbols of the caller's data once per render. Variables assigned at run time are kept by
+// name in the frame and indexed by symbol on first lookup.
+
 class Context {
 public:
     Context(TemplateRenderer &rdr, const Variant::Object &data, TranslationManager *mgr, const std::string &locale):
-      rdr_(rdr), data_(data), mgr_(mgr), locale_(locale) {}
+      rdr_(rdr), globals_(&data), mgr_(mgr), locale_(locale) {}
+
+    // open a nested scope on top of parent; an isolated scope hides the variables of the enclosing frames
+    // but keeps the render state (renderer, locale and template chain)
+    Context(Context &parent, bool isolated = false):
+      parent_(isolated ? nullptr : &parent), rdr_(parent.rdr_), mgr_(parent.mgr_),
+      locale_(parent.locale_),
+      chain_(parent.chain_), active_block_(parent.active_block_), active_layer_(parent.active_layer_),
+      sink_(parent.sink_), sink_buffer_(parent.sink_buffer_), flush_threshold_(parent.flush_threshold_) {}
+
     Context() = delete ;
-    
-    Variant::Object &data() {
-        return data_ ;
-    }
 
+    // variables of the local frame
     const Variant::Object &data() const {
         return data_ ;
     }
 
-    const Variant &get(const std::string &key) {
-        Variant a ;
+    // assign a variable of the local frame
+    void set(const std::string &name, Variant value) {
+        if ( data_.insert_or_assign(name, std::move(value)).second ) locals_.clear() ;
+    }
+
+    // add variables to the local frame, keeping those already defined
+    void extend(const Variant::Object &vars) {
+        size_t n = data_.size() ;
+        data_.insert(vars.begin(), vars.end()) ;
+        if ( data_.size() != n ) locals_.clear() ;
+    }
+
+    // attach the slots of the local frame, values must have layout.size() elements
+    void bindSlots(const detail::SlotLayout &layout, Variant *values) {
+        layout_ = &layout ;
+        slots_ = values ;
+    }
+
+    // search the frame chain for a variable, returns nullptr if not found
+    const Variant *find(const std::string &name) const {
+        for( const Context *c = this ; c != nullptr ; c = c->parent_ ) {
+            auto it = c->data_.find(name) ;
+            if ( it != c->data_.end() ) return &it->second ;
+            if ( c->layout_ ) {
+                // later declarations of the same name win
+                for( size_t k = c->layout_->size() ; k-- > 0 ; )
+                    if ( c->layout_->names_[k] == name ) return &c->slots_[k] ;
+            }
+            if ( c->globals_ ) {
+                auto git = c->globals_->find(name) ;
+                if ( git != c->globals_->end() ) return &git->second ;
+            }
+        }
+        return nullptr ;
+    }
+
+    // same as above for a variable interned at compile time; name is the name of the symbol
+    const Variant *find(detail::Symbol sym, const std::string &name) const {
+        for( const Context *c = this ; c != nullptr ; c = c->parent_ ) {
+            if ( !c->data_.empty() ) {
+                if ( const Variant *v = c->local(sym, name) ) return v ;
+            }
+            if ( c->layout_ ) {
+                for( size_t k = c->layout_->size() ; k-- > 0 ; )
+                    if ( c->layout_->symbols_[k] == sym ) return &c->slots_[k] ;
+            }
+            if ( c->globals_ ) {
+                if ( const Variant *v = c->global(sym, name) ) return v ;
+            }
+        }
+        return nullptr ;
+    }
+
+    Variant get(const std::string &key) const {
         size_t pos = key.find('.') ;
-        if ( pos == std::string::npos )
-            return data_[key] ;
-        else
-            return data_[key.substr(0, pos)].at(key.substr(pos+1));
+        if ( pos == std::string::npos ) {
+            const Variant *v = find(key) ;
+            return v ? *v : Variant::undefined() ;
+        } else {
+            const Variant *v = find(key.substr(0, pos)) ;
+            return v ? v->at(key.substr(pos+1)) : Variant::undefined() ;
+        }
+    }
+
+    // all visible variables merged into a single object, inner frames shadowing outer ones
+    Variant::Object variables() const {
+        Variant::Object res ;
+        for( const Context *c = this ; c != nullptr ; c = c->parent_ ) {
+            res.insert(c->data_.begin(), c->data_.end()) ;
+            if ( c->layout_ ) {
+                for( size_t k = c->layout_->size() ; k-- > 0 ; )
+                    res.emplace(c->layout_->names_[k], c->slots_[k]) ;
+            }
+            if ( c->globals_ ) res.insert(c->globals_->begin(), c->globals_->end()) ;
+        }
+        return res ;
     }
 
     void addBlock(detail::NamedBlockNodePtr node) ;
 
-    Variant::Object data_ ;
+    // pass the output accumulated so far to the sink, once it exceeds the threshold. Only the top level buffer
+    // is flushed, output captured into temporaries (filters, set blocks etc.) is left alone.
+    void flush(std::string &res) {
+        if ( sink_ && &res == sink_buffer_ && res.size() >= flush_threshold_ ) {
+            sink_->write(res.data(), res.size()) ;
+            res.clear() ;
+        }
+    }
+
+    Context *parent_ = nullptr ;
+    const detail::SlotLayout *layout_ = nullptr ;
+    Variant *slots_ = nullptr ;
     TemplateRenderer &rdr_ ;
+    const Variant::Object *globals_ = nullptr ;
     TranslationManager *mgr_ = nullptr;
-    std::string escape_mode_ = "no", locale_ = "en_US";
-    detail::DocumentNode *root_tmpl_ = nullptr ;
-    detail::NamedBlockNode *active_block_  = nullptr;
+    std::string locale_ = "en_US";
+
+    // per-render template state; compiled templates are shared and never modified while rendering
+
+    const detail::TemplateChain *chain_ = nullptr ;
+    const detail::NamedBlockNode *active_block_  = nullptr;
+    size_t active_layer_ = 0 ; // position in chain_ of the template defining active_block_
+
+    // streaming output
+    OutputSink *sink_ = nullptr ;
+    std::string *sink_buffer_ = nullptr ;
+    size_t flush_threshold_ = 0 ;
+
+private:
+
+    // variables assigned at run time (set tags, imports, include and embed arguments); those that are found by symbol
+    // are indexed, the index is reset when a variable is added, since it also records the symbols that were not found
+    const Variant *local(detail::Symbol sym, const std::string &name) const {
+        auto iit = locals_.find(sym) ;
+        if ( iit != locals_.end() ) return iit->second ;
+
+        auto it = data_.find(name) ;
+        const Variant *v = ( it == data_.end() ) ? nullptr : &it->second ;
+        locals_.emplace(sym, v) ;
+        return v ;
+    }
+
+    Variant::Object data_ ;
+    mutable std::unordered_map<detail::Symbol, const Variant *> locals_ ;
+
+    // the caller's data does not change while rendering, so each symbol is looked up at most once. Symbols are
+    // numbered process-wide, so the resolved ones are kept in a map holding only those used by this render.
+    const Variant *global(detail::Symbol sym, const std::string &name) const {
+        auto iit = interned_.find(sym) ;
+        if ( iit != interned_.end() ) return iit->second ;
+
+        auto it = globals_->find(name) ;
+        const Variant *v = ( it == globals_->end() ) ? nullptr : &it->second ;
+        interned_.emplace(sym, v) ;
+        return v ;
+    }
+
+    mutable std::unordered_map<detail::Symbol, const Variant *> interned_ ;
 };
 } // twig
 #endif
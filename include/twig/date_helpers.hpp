@@ -13,7 +13,8 @@ std::string php_date_format_to_strftime(const std::string &format) ;
 
 bool parse_fixed_date_formats(const std::string &src, std::tm &tm) ;
 
-bool apply_relative_offset(int64_t &base_s, int64_t amount, const std::string &unit) ;
+// months and years are added in the local time of the zone (empty for local time, an offset or an IANA name)
+bool apply_relative_offset(int64_t &base_s, int64_t amount, const std::string &unit, const std::string &tz = "") ;
 
 int64_t strtotime(const std::string &src, const std::string &tz = "") ;
 
@@ -6,6 +6,7 @@
 #include <map>
 
 #include <twig/forms/form_builder.hpp>
+#include <twig/regex.hpp>
 
 namespace twig {
 
@@ -18,6 +19,7 @@ public:
     static FormFieldValidator atLeastNChars(size_t min_len, const twig::Translatable &msg = {}) ;
     static FormFieldValidator atMostNChars(size_t max_len, const twig::Translatable &msg = {}) ;
     static FormFieldValidator matches(const std::regex &rx, const twig::Translatable &msg = {}) ;
+    static FormFieldValidator matches(const Regex &rx, const twig::Translatable &msg = {}) ;
     static FormFieldValidator isOneOf(const std::vector<std::string> &choices, const twig::Translatable &msg = {}) ;
     static FormFieldValidator isNoneOf(const std::vector<std::string> &choices, const twig::Translatable &msg = {}) ;
     static FormFieldValidator inRange(int min_val, int max_val, const twig::Translatable &msg = {}) ;
@@ -3,16 +3,108 @@
 
 #include <string>
 #include <functional>
+#include <map>
+#include <vector>
 
 #include <variant/variant.hpp>
 #include <twig/context.hpp>
 
 namespace twig {
 
+// Read only view of the arguments of a call. The values are stored by the caller (see ArgumentList) and are valid
+// only for the duration of the call. Parameters are bound by position or, if not passed positionally, by name.
+
+class Arguments {
+public:
+    struct Keyword {
+        const std::string *name_ ;
+        Variant value_ ;
+    };
+
+    Arguments() = default ;
+    Arguments(const Variant *positional, size_t n_positional, const Keyword *keywords, size_t n_keywords):
+        positional_(positional), n_positional_(n_positional), keywords_(keywords), n_keywords_(n_keywords) {}
+
+    // number of positional arguments
+    size_t size() const { return n_positional_ ; }
+    size_t keywords() const { return n_keywords_ ; }
+
+    // positional argument, undefined if not passed
+    const Variant &operator[](size_t pos) const ;
+
+    // keyword argument, undefined if not passed
+    const Variant &keyword(const std::string &name) const ;
+
+    // value of the parameter at position pos named name, undefined if not passed
+    const Variant &get(size_t pos, const char *name) const ;
+
+    // same as above but throws if the argument is missing
+    const Variant &required(size_t pos, const char *name) const ;
+
+    bool has(size_t pos, const char *name) const { return !get(pos, name).isUndefined() ; }
+
+    Variant::Array positional() const ;
+
+    // the arguments as an object {"args": [...], "kw": {...}}, as passed to generic callables (macros, lambdas)
+    Variant pack() const ;
+
+private:
+    const Variant *positional_ = nullptr ;
+    size_t n_positional_ = 0 ;
+    const Keyword *keywords_ = nullptr ;
+    size_t n_keywords_ = 0 ;
+};
+
+// Storage of call arguments. The first few positional arguments are kept inline so that the typical call does not
+// allocate. Keyword names are not copied and must outlive the list.
+
+class ArgumentList {
+public:
+    ArgumentList() = default ;
+    ArgumentList(const ArgumentList &) = delete ;
+    ArgumentList &operator = (const ArgumentList &) = delete ;
+
+    // from packed arguments {"args": [...], "kw": {...}}
+    explicit ArgumentList(const Variant &packed) ;
+
+    void add(Variant &&v) ;
+    void add(const std::string &name, Variant &&v) ;
+
+    Arguments view() const {
+        return Arguments(heap_.empty() ? local_ : heap_.data(), n_, keywords_.data(), keywords_.size()) ;
+    }
+
+private:
+    static const size_t InlineCapacity = 4 ;
+
+    Variant local_[InlineCapacity] ;
+    std::vector<Variant> heap_ ;
+    size_t n_ = 0 ;
+    std::vector<Arguments::Keyword> keywords_ ;
+    std::vector<std::string> names_ ; // keyword names of unpacked arguments
+};
+
+// calling conventions of registered callables
+using FunctionCall = std::function<Variant(const Arguments &, Context &ctx)>;
+using FilterCall = std::function<Variant(const Variant &, const Arguments &, Context &ctx)>;
+using TestCall = std::function<bool(const Variant &, const Arguments &, Context &ctx)>;
+
+// generic callables receiving packed arguments, adapted to the above when registered
 using TemplateFunction = std::function<Variant(const Variant &, Context &ctx)>;
 using TestFunction = std::function<bool(const Variant &, const Variant &, Context &ctx)>;
 using FilterFunction = std::function<Variant(const Variant &, const Variant &, Context &ctx)>;
 
+// properties declared when registering a function, filter or test, callables registered without flags get none.
+// The optimizer evaluates pure calls with constant arguments at compile time.
+
+enum FunctionFlags : unsigned {
+    NoFlags = 0,
+    Deterministic = 1,          // the same arguments and context give the same result (no clock, randomness or I/O)
+    ContextDependent = 2,       // reads the render context (variables, locale, translator, renderer)
+    Pure = 4 | Deterministic,   // no side effects and the result depends on the arguments only
+    OutputSafe = 8              // returns safe strings that are not escaped again on output
+};
+
 void unpack_args(const Variant &args, const std::vector<std::string> &spec, Variant::Array &res) ;
 
 class FunctionFactory {
@@ -33,15 +125,47 @@ public:
     Variant invokeFilter(const std::string &name, const Variant &target, const Variant &args, Context &ctx) ;
     Variant invokeTest(const std::string &name, const Variant &target, const Variant &args, Context &ctx) ;
 
-    void registerFunction(const std::string &name, const TemplateFunction &f);
-    void registerFilter(const std::string &name, const FilterFunction &f);
-    void registerTest(const std::string &name, const TestFunction &f);
+    Variant invokeFunction(const std::string &name, const Arguments &args, Context &ctx) ;
+    Variant invokeFilter(const std::string &name, const Variant &target, const Arguments &args, Context &ctx) ;
+    bool invokeTest(const std::string &name, const Variant &target, const Arguments &args, Context &ctx) ;
+
+    void registerFunction(const std::string &name, const FunctionCall &f, unsigned flags = NoFlags);
+    void registerFilter(const std::string &name, const FilterCall &f, unsigned flags = NoFlags);
+    void registerTest(const std::string &name, const TestCall &f, unsigned flags = NoFlags);
+
+    void registerFunction(const std::string &name, const TemplateFunction &f, unsigned flags = NoFlags);
+    void registerFilter(const std::string &name, const FilterFunction &f, unsigned flags = NoFlags);
+    void registerTest(const std::string &name, const TestFunction &f, unsigned flags = NoFlags);
+
+    // flags of the registered callable, NoFlags if unknown
+    unsigned functionFlags(const std::string &name) const ;
+    unsigned filterFlags(const std::string &name) const ;
+    unsigned testFlags(const std::string &name) const ;
+
+    static bool hasFlags(unsigned flags, unsigned required) { return ( flags & required ) == required ; }
+
+    template<class F>
+    struct Entry {
+        F f_ ;
+        unsigned flags_ ;
+    };
+
+    // handles bound to templates when they are compiled. They stay valid for the lifetime of the factory and
+    // registering a name again replaces the callable behind its handle.
+    using FunctionHandle = const Entry<FunctionCall> * ;
+    using FilterHandle = const Entry<FilterCall> * ;
+    using TestHandle = const Entry<TestCall> * ;
+
+    // nullptr if not registered
+    FunctionHandle findFunction(const std::string &name) const ;
+    FilterHandle findFilter(const std::string &name) const ;
+    TestHandle findTest(const std::string &name) const ;
 
 private:
 
-    std::map<std::string, TemplateFunction> functions_ ;
-    std::map<std::string, FilterFunction> filters_ ;
-    std::map<std::string, TestFunction> tests_ ;
+    std::map<std::string, Entry<FunctionCall>> functions_ ;
+    std::map<std::string, Entry<FilterCall>> filters_ ;
+    std::map<std::string, Entry<TestCall>> tests_ ;
 };
 
 }
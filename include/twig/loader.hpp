@@ -5,14 +5,42 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <cstdint>
 
 namespace twig {
+
+// fingerprint of a template source used to detect modifications, all zero if the loader cannot tell
+
+struct TemplateVersion {
+    int64_t mtime_ = 0 ; // nanoseconds
+    uint64_t size_ = 0, inode_ = 0 ;
+
+    bool operator == (const TemplateVersion &other) const {
+        return mtime_ == other.mtime_ && size_ == other.size_ && inode_ == other.inode_ ;
+    }
+    bool operator != (const TemplateVersion &other) const { return !(*this == other) ; }
+};
+
 // abstract template loader
 
 class TemplateLoader {
 public:
     // override to return a template string from a key
     virtual std::string load(const std::string &src) =0 ;
+
+    // return the template string and its current version
+    virtual std::string load(const std::string &src, TemplateVersion &version) {
+        version = TemplateVersion() ;
+        return load(src) ;
+    }
+
+    // current version of the template, throws TemplateLoadException if it does not exist. Override to find it
+    // without loading the template, the default loads it.
+    virtual TemplateVersion version(const std::string &src) {
+        TemplateVersion v ;
+        load(src, v) ;
+        return v ;
+    }
 };
 
 // loads templates from file system relative to root folders.
@@ -23,8 +51,12 @@ public:
     FileSystemTemplateLoader(const std::initializer_list<std::string> &root_folders, const std::string &suffix = ".twig") ;
 
     virtual std::string load(const std::string &src) override ;
+    virtual std::string load(const std::string &src, TemplateVersion &version) override ;
+    virtual TemplateVersion version(const std::string &src) override ;
 
 private:
+    bool resolve(const std::string &key, std::string &path, TemplateVersion &version) ;
+
     std::vector<std::string> root_folders_ ;
     std::string suffix_ ;
 };
@@ -34,7 +66,9 @@ class DictTemplateLoader: public TemplateLoader {
 public:
     DictTemplateLoader(const std::map<std::string, std::string> &templates) ;
 
+    using TemplateLoader::load ;
     virtual std::string load(const std::string &src) override ;
+    virtual TemplateVersion version(const std::string &src) override ;
 
 private:
     std::map<std::string, std::string> templates_ ;
@@ -46,6 +80,8 @@ public:
     ChoiceTemplateLoader(const std::vector<std::shared_ptr<TemplateLoader>> &loaders): loaders_(loaders) {}
 
     virtual std::string load(const std::string &src) override ;
+    virtual std::string load(const std::string &src, TemplateVersion &version) override ;
+    virtual TemplateVersion version(const std::string &src) override ;
 
 private:
     std::vector<std::shared_ptr<TemplateLoader>> loaders_ ;
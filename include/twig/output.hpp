@@ -0,0 +1,58 @@
+#ifndef TWIG_OUTPUT_HPP
+#define TWIG_OUTPUT_HPP
+
+#include <string>
+#include <ostream>
+#include <functional>
+
+namespace twig {
+
+// destination of rendered output; the renderer writes chunks as soon as they exceed the flush threshold
+
+class OutputSink {
+public:
+    virtual ~OutputSink() = default ;
+
+    virtual void write(const char *data, size_t len) = 0 ;
+
+    // called once when rendering is complete
+    virtual void flush() {}
+};
+
+// writes to a stream (file, string stream etc.)
+
+class StreamSink: public OutputSink {
+public:
+    StreamSink(std::ostream &strm): strm_(strm) {}
+
+    void write(const char *data, size_t len) override {
+        strm_.write(data, len) ;
+    }
+
+    void flush() override {
+        strm_.flush() ;
+    }
+
+private:
+    std::ostream &strm_ ;
+};
+
+// passes each chunk to a user supplied function e.g. a socket writer
+
+class CallbackSink: public OutputSink {
+public:
+    using Callback = std::function<void (const char *data, size_t len)> ;
+
+    CallbackSink(const Callback &cb): cb_(cb) {}
+
+    void write(const char *data, size_t len) override {
+        cb_(data, len) ;
+    }
+
+private:
+    Callback cb_ ;
+};
+
+}
+
+#endif
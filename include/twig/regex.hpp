@@ -0,0 +1,68 @@
+#ifndef TWIG_REGEX_HPP
+#define TWIG_REGEX_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace twig {
+
+// A compiled pattern. Implementations must be safe to use from several threads at once.
+
+class RegexMatcher {
+public:
+    virtual ~RegexMatcher() = default ;
+
+    // true if the pattern matches a substring of s
+    virtual bool search(std::string_view s) const = 0 ;
+
+    // true if the pattern matches the whole of s
+    virtual bool match(std::string_view s) const = 0 ;
+};
+
+// Compiles ECMAScript patterns. Returns null for patterns the engine does not support so that the next one is tried.
+
+class RegexEngine {
+public:
+    virtual ~RegexEngine() = default ;
+
+    virtual std::shared_ptr<const RegexMatcher> compile(const std::string &pattern, bool icase) const = 0 ;
+};
+
+// Finite automaton without backtracking: literals, classes, escapes (\d \w \s ...), groups, alternation, greedy and
+// lazy repetition, ^ and $. Matching is linear in the length of the input. Back references, lookaround, word
+// boundaries and non ASCII characters in classes are not supported.
+
+class AutomatonRegexEngine: public RegexEngine {
+public:
+    std::shared_ptr<const RegexMatcher> compile(const std::string &pattern, bool icase) const override ;
+};
+
+// std::regex with ECMAScript grammar, supports everything and throws std::regex_error on invalid patterns
+
+class StdRegexEngine: public RegexEngine {
+public:
+    std::shared_ptr<const RegexMatcher> compile(const std::string &pattern, bool icase) const override ;
+};
+
+// Regular expression used by the 'matches' operator and the form validators. The pattern is compiled by the engine
+// installed with setEngine if any, otherwise (or if it declines) by the automaton and, for unsupported features,
+// by std::regex.
+
+class Regex {
+public:
+    explicit Regex(const std::string &pattern, bool icase = false) ;
+
+    bool search(std::string_view s) const { return matcher_->search(s) ; }
+    bool match(std::string_view s) const { return matcher_->match(s) ; }
+
+    // engine tried first for patterns compiled afterwards, e.g. a wrapper of RE2 or PCRE2; null to remove it
+    static void setEngine(std::shared_ptr<const RegexEngine> engine) ;
+
+private:
+    std::shared_ptr<const RegexMatcher> matcher_ ;
+};
+
+}
+
+#endif
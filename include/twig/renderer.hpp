@@ -6,9 +6,10 @@
 #include <twig/loader.hpp>
 #include <twig/exceptions.hpp>
 #include <twig/functions.hpp>
+#include <twig/cache.hpp>
+#include <twig/output.hpp>
 
 #include <variant/variant.hpp>
-#include <mutex>
 
 namespace twig {
 namespace detail {
@@ -23,7 +24,6 @@ namespace detail {
 }
 
 class FunctionFactory ;
-class Cache ;
 
 class TemplateRenderer {
 public:
@@ -32,10 +32,23 @@ public:
     std::string render(const std::string &resource, const Variant::Object &ctx, bool ignore_missing = false) ;
     std::string renderString(const std::string &str, const Variant::Object &ctx) ;
 
+    // stream the output to sink in chunks of about the flush threshold instead of returning it
+    void render(const std::string &resource, const Variant::Object &ctx, OutputSink &sink, bool ignore_missing = false) ;
+
+    void setFlushThreshold(size_t bytes) {
+        flush_threshold_ = bytes ;
+    }
+
     void setDebug(bool debug = true) {
         debug_ = debug ;
     }
 
+    // lower the expressions of compiled templates to bytecode; experimental, it does not render measurably faster
+    // than the tree walker yet (see tests/bench_bytecode.cpp) and is off by default
+    void setBytecode(bool enable = true) {
+        bytecode_ = enable ;
+    }
+
     void setCache(const std::shared_ptr<Cache> &cache) {
         cache_ = cache ;
     }
@@ -50,6 +63,17 @@ public:
 
     std::shared_ptr<TemplateLoader> getLoader() { return loader_ ; } 
 
+    // names of the templates that resource references through static extends, include, import or embed tags
+    std::set<std::string> getDependencies(const std::string &resource) ;
+
+    // expected output size of resource, estimated from its recent renders
+    size_t getOutputEstimate(const std::string &resource) ;
+
+    // drop resource and every cached template that depends on it, so they are compiled again on next use
+    void invalidate(const std::string &resource) {
+        if ( cache_ ) cache_->invalidate(resource) ;
+    }
+
 protected:
 
     friend class detail::ExtensionBlockNode ;
@@ -60,36 +84,17 @@ protected:
     friend class detail::DocumentNode ;
 
     detail::DocumentNodePtr compile(const std::string &resource) ;
+    detail::DocumentNodePtr compileResource(const std::string &resource, Cache::EntryInfo &info) ;
     detail::DocumentNodePtr compileString(const std::string &resource) ;
+    void lowerExpressions(const detail::DocumentNodePtr &root) ;
 
-    bool debug_ = false, ignore_missing_ = false ;
+    bool debug_ = false, ignore_missing_ = false, bytecode_ = false ;
     std::shared_ptr<TemplateLoader> loader_ ;
     std::shared_ptr<Cache> cache_ ;
     std::string locale_ = "en_US";
     TranslationManager *translation_mgr_ = nullptr;
+    size_t flush_threshold_ = 8192 ;
 } ;
 
-class Cache {
-public:
-
-using Entry = detail::DocumentNodePtr ;
-
-void add(const std::string &key, const Entry &val) {
-    std::lock_guard<std::mutex> lock(guard_);
-    compiled_.insert({key, val}) ;
-}
-
-Entry fetch(const std::string &key) {
-    std::lock_guard<std::mutex> lock(guard_);
-    auto it = compiled_.find(key) ;
-    if ( it != compiled_.end() ) return it->second ;
-    else return nullptr ;
-}
-
-private:
-    std::map<std::string, Entry> compiled_ ;
-    std::mutex guard_ ;
-};
-
 }
 #endif
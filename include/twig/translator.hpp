@@ -5,6 +5,10 @@
 #include <fstream>
 #include <mutex>
 #include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <vector>
 #include <filesystem>
 #include <variant/variant.hpp>
 
@@ -38,6 +42,7 @@ private:
 public:
     // Pass the locale string during construction
     Translator(const std::string& target_locale) ;
+    ~Translator() ;
 
     std::string getLocale() const ;
 
@@ -50,13 +55,24 @@ public:
 
 class TranslationManager {
 private:
-    std::unordered_map<std::string, std::shared_ptr<Translator>> translators_;
+    // Translators loaded so far with the fallback of every language resolved. A snapshot is immutable once
+    // published, so lookups need no lock. Replaced snapshots are kept until the manager is destroyed since readers
+    // may still hold them.
+    struct Snapshot {
+        std::unordered_map<std::string, std::shared_ptr<Translator>> translators_;   // by locale
+        std::unordered_map<std::string_view, std::shared_ptr<Translator>> languages_; // views into the keys above
+        std::shared_ptr<Translator> default_;
+    };
+
+    std::shared_ptr<Snapshot> makeSnapshot(std::unordered_map<std::string, std::shared_ptr<Translator>> translators) const ;
+
     std::string default_locale_;
-    std::shared_mutex mutex_; 
+    std::atomic<const Snapshot *> snapshot_ ;
+    std::vector<std::shared_ptr<const Snapshot>> snapshots_ ; // owns the current and all replaced snapshots
+    std::mutex update_mutex_ ; // serializes loading
 
 public:
-    TranslationManager(const std::string& default_locale = "en_US") 
-        : default_locale_(default_locale) {}
+    TranslationManager(const std::string& default_locale = "en_US") ;
 
     TranslationManager(const TranslationManager&) = delete;
     TranslationManager& operator=(const TranslationManager&) = delete;
@@ -66,8 +82,9 @@ public:
 
     std::vector<std::string> getSupportedLocales() const ;
 
-    // Thread-safe lookup for a specific translator
-    std::shared_ptr<Translator> getTranslator(const std::string& requested_locale) ;
+    // Translator of the locale, falling back to its language (en_GB -> en or another en_XX) and then to the default
+    // locale. Never fails; if nothing matches an empty translator of the default locale is returned. Thread-safe.
+    std::shared_ptr<Translator> getTranslator(const std::string& requested_locale) const ;
 
     std::string translate(const std::string &msg, const std::string &locale, const Variant::Object &params = {}) {
         auto translator = getTranslator(locale);
@@ -1,4 +1,5 @@
 #include "ast.hpp"
+#include "escape.hpp"
 
 #include <twig/functions.hpp>
 #include <twig/exceptions.hpp>
@@ -9,19 +10,16 @@
 using namespace std ;
 
 namespace twig {
-
-extern Variant escape(const Variant &src, const string &escape_mode) ;
-
 namespace detail {
 
-void ContainerNode::throwException(const std::string &msg) {
+void ContainerNode::throwException(const std::string &msg) const {
     stringstream strm ;
 
     strm << msg << " while evaluating {% " << tagName() << " %} at " << root()->resource_ << '@' << line_ << '(' << column_ << ')' ;
     throw TemplateRuntimeException(strm.str()) ;
 }
 
-void ContentNode::throwException(const std::string &msg) {
+void ContentNode::throwException(const std::string &msg) const {
     stringstream strm ;
 
     strm << msg << " while evaluating substitution tag at " << root()->resource_ << '@' << line_ << '(' << column_ << ')' ;
@@ -154,85 +152,153 @@ Variant ComparisonPredicate::eval(Context &ctx)
     Variant lhs = lhs_->eval(ctx) ;
     Variant rhs = rhs_->eval(ctx) ;
 
+    return apply(op_, lhs, rhs) ;
+}
+
+Variant ComparisonPredicate::apply(Type op, const Variant &lhs, const Variant &rhs) {
     if ( lhs.isNull() || rhs.isNull() ) return false ;
 
-    return variant_compare(lhs, rhs, op_);
+    return variant_compare(lhs, rhs, op);
 }
 
-Variant IdentifierNode::eval(Context &ctx) {
-    return ctx.get(name_);
+IdentifierNode::IdentifierNode(const string &name): name_(name) {
+    size_t pos = name.find('.') ;
+    if ( pos == string::npos ) {
+        var_ = name ;
+    } else {
+        var_ = name.substr(0, pos) ;
+        path_ = name.substr(pos+1) ;
+    }
+    sym_ = intern(var_) ;
 }
 
-static int64_t arithmetic(int64_t lhs, int64_t rhs, const std::string &op) {
-    if  ( op == "+"  )
-        return lhs + rhs ;
-    else if ( op == "-" )
-        return lhs - rhs ;
-    else if ( op == "*" )
-        return lhs * rhs ;
-    else if ( op == "/" )
-        return ( rhs ) ? (lhs / rhs) : 0 ;
-    else if ( op == "%" )
-        return ( rhs ) ? (lhs % rhs) : 0 ;
-    else if ( op == "**" )
-            return (int64_t)pow(lhs, rhs) ;
-    else
-        throw TemplateRuntimeException("Unknown operator: " + op) ;
+// integers (booleans and null count as 0 or 1) stay integers unless the result overflows or is fractional,
+// other operands are computed in floating point
+
+static bool is_integral(const Variant &v) {
+    switch ( v.type() ) {
+    case Variant::Type::Undefined:
+    case Variant::Type::Null:
+    case Variant::Type::Boolean:
+    case Variant::Type::Integer:
+        return true ;
+    default:
+        return false ;
+    }
 }
 
-static double arithmetic(double lhs, double rhs, const std::string &op) {
-   if ( op == "+" )
+static Variant arithmetic(double lhs, double rhs, BinaryOperator::Type op) {
+    switch ( op ) {
+    case BinaryOperator::Add:
         return lhs + rhs ;
-    else if ( op == "-" )
+    case BinaryOperator::Subtract:
         return lhs - rhs ;
-    else if ( op == "*" )
+    case BinaryOperator::Multiply:
         return lhs * rhs ;
-    else if ( op == "/" )
+    case BinaryOperator::Divide:
         return ( rhs != 0.0 ) ? (lhs / rhs) : 0.0 ;
-    else if ( op == "**" )
-        return pow(lhs, rhs) ;
-    else if ( op == "//" )
+    case BinaryOperator::FloorDivide:
         return ( rhs != 0.0 ) ? (int64_t)floor(lhs / rhs) : 0 ;
-    else if ( op == "%" )
+    case BinaryOperator::Modulo:
         return ( rhs != 0.0 ) ? (int64_t)fmod(lhs, rhs) : 0 ;
-    else
-        throw TemplateRuntimeException("Unknown operator: " + op) ;
+    case BinaryOperator::Power:
+        return pow(lhs, rhs) ;
+    default:
+        throw TemplateRuntimeException("Unknown arithmetic operator") ;
+    }
 }
 
+static Variant arithmetic(int64_t lhs, int64_t rhs, BinaryOperator::Type op) {
+    int64_t res ;
 
-static Variant arithmetic(const Variant &lhs, const Variant &rhs, const std::string &op) {
-    if ( ( lhs.type() == Variant::Type::Integer || lhs.type() == Variant::Type::Boolean) && rhs.type() == Variant::Type::Float ) {
-        return arithmetic(lhs.toFloat(), rhs.toFloat(), op) ;
-    } else if ( lhs.type() == Variant::Type::Float && ( rhs.type() == Variant::Type::Integer || rhs.type() == Variant::Type::Boolean ) ) {
-        return arithmetic(lhs.toFloat(), rhs.toFloat(), op) ;
-    } else
+    switch ( op ) {
+    case BinaryOperator::Add:
+        if ( !__builtin_add_overflow(lhs, rhs, &res) ) return res ;
+        break ;
+    case BinaryOperator::Subtract:
+        if ( !__builtin_sub_overflow(lhs, rhs, &res) ) return res ;
+        break ;
+    case BinaryOperator::Multiply:
+        if ( !__builtin_mul_overflow(lhs, rhs, &res) ) return res ;
+        break ;
+    case BinaryOperator::Divide:
+        if ( rhs == 0 ) return 0 ;
+        if ( rhs == -1 ) {
+            if ( !__builtin_sub_overflow((int64_t)0, lhs, &res) ) return res ;
+        } else if ( lhs % rhs == 0 ) return lhs / rhs ;
+        break ;
+    case BinaryOperator::FloorDivide:
+        if ( rhs == 0 ) return 0 ;
+        if ( rhs == -1 ) {
+            if ( !__builtin_sub_overflow((int64_t)0, lhs, &res) ) return res ;
+            break ;
+        }
+        res = lhs / rhs ;
+        if ( lhs % rhs != 0 && ( lhs < 0 ) != ( rhs < 0 ) ) --res ;
+        return res ;
+    case BinaryOperator::Modulo:
+        return ( rhs == 0 || rhs == -1 ) ? 0 : lhs % rhs ;
+    case BinaryOperator::Power:
+        if ( rhs >= 0 ) {
+            // exponentiation by squaring
+            int64_t base = lhs ;
+            bool overflow = false ;
+            res = 1 ;
+            for( int64_t e = rhs ; e > 0 && !overflow ; e >>= 1 ) {
+                if ( e & 1 ) overflow = __builtin_mul_overflow(res, base, &res) ;
+                if ( e > 1 && !overflow ) overflow = __builtin_mul_overflow(base, base, &base) ;
+            }
+            if ( !overflow ) return res ;
+        }
+        break ;
+    default:
+        break ;
+    }
+
+    return arithmetic((double)lhs, (double)rhs, op) ;
+}
+
+static Variant arithmetic(const Variant &lhs, const Variant &rhs, BinaryOperator::Type op) {
+    if ( is_integral(lhs) && is_integral(rhs) )
         return arithmetic(lhs.toInteger(), rhs.toInteger(), op) ;
+    else
+        return arithmetic(lhs.toFloat(), rhs.toFloat(), op) ;
 }
 
 Variant BinaryOperator::eval(Context &ctx) {
     Variant op1 = lhs_->eval(ctx) ;
     Variant op2 = rhs_->eval(ctx) ;
 
-    if ( op_ == "??" ) {
+    return apply(op_, op1, op2) ;
+}
+
+Variant BinaryOperator::apply(Type op, const Variant &op1, const Variant &op2) {
+    switch ( op ) {
+    case Coalesce:
         if (op1.isUndefined() || op1.isNull()) return op2 ;
         else return op1 ;
-    } else if ( op_ == "+" || op_ == "-" || op_ == "*" || op_ == "/" || op_ == "**" || op_ == "//"  || op_ == "%" )
-        return arithmetic(op1.toFloat(), op2.toFloat(), op_) ;
-    else if ( op_ == "~" )
+    case Concat:
         return op1.toString() + op2.toString() ;
-    else
-        throw TemplateRuntimeException("Unknown binary operator: " + op_) ;
+    default:
+        return arithmetic(op1, op2, op) ;
+    }
 }
 
 Variant UnaryOperator::eval(Context &ctx) {
     Variant val = rhs_->eval(ctx) ;
 
-    if ( op_ == '-' ) {
-        return arithmetic(0, val, "-") ;
-    } else if ( op_ == '!' ) {
+    return apply(op_, val) ;
+}
+
+Variant UnaryOperator::apply(Type op, const Variant &val) {
+    switch ( op ) {
+    case Negate:
+        return arithmetic(0, val, BinaryOperator::Subtract) ;
+    case Not:
         return !val.toBoolean() ;
+    default:
+        return val ;
     }
-    else return val ;
 }
 
 Variant SpreadOperator::eval(Context &ctx) {
@@ -279,6 +345,13 @@ Variant SubscriptIndexingNode::eval(Context &ctx) {
     
     Variant a = array_->eval(ctx) ;
 
+    return apply(a, index) ;
+}
+
+Variant SubscriptIndexingNode::apply(const Variant &a, const Variant &index) {
+    if ( index.isUndefined() || index.isNull() )
+        throw TemplateRuntimeException("Undefined or null index in subscript indexing") ;
+
     if ( a.isUndefined() || a.isNull() || ( !a.isArray() && !a.isObject() ) ) {
         return Variant::undefined() ;
     }
@@ -291,175 +364,256 @@ Variant SubscriptIndexingNode::eval(Context &ctx) {
 
 Variant AttributeIndexingNode::eval(Context &ctx) {
     Variant o = dict_->eval(ctx) ;
+    return apply(o, key_, except_on_null_) ;
+}
+
+Variant AttributeIndexingNode::apply(const Variant &o, const std::string &key, bool except_on_null) {
     if ( !o.isObject()) {
-        if ( except_on_null_ )
+        if ( except_on_null )
             throw TemplateRuntimeException("Subscript operand applied to non-object") ;
         else
             return Variant::undefined() ;
     } 
 
-    return o.at(key_) ;
+    return o.at(key) ;
 }
 
 
-static void evalArgs(const arg_list_t &input_args, Variant &packed_args, Context &ctx) {
-    Variant::Array positional ;
-    Variant::Object kw ;
+static void evalSpread(const NodePtr &node, ArgumentList &args, Context &ctx) {
+    Variant s = node->eval(ctx) ;
 
-    for ( auto &&e: input_args ) {
-        if ( e.name_.empty() ) {
-            if ( SpreadOperator *so = dynamic_cast<SpreadOperator *>(e.value_.get()) ) {
-                Variant s = so->eval(ctx) ;
-
-                if ( s.isArray() ) {
-                    for( auto &se: s ) {
-                        positional.push_back(se) ;
-                    }
-                }
-                else if ( !s.isUndefined() && !s.isNull() ) {
-                    throw TemplateRuntimeException("spread operator needs array variable");
-                }  
-            }
-            else {
-                auto v = e.value_->eval(ctx) ;
-                positional.push_back(v) ;
-            }
-        } else {
-            kw.emplace(e.name_, e.value_->eval(ctx));
+    if ( s.isArray() ) {
+        for( auto &se: s ) {
+            args.add(Variant(se)) ;
         }
     }
-
-    Variant::Object packed ;
-
-    packed.emplace("args", positional);
-    packed.emplace("kw", kw) ;
-
-    packed_args = Variant(packed) ;
-}
-
-static Variant evalFilter(const string &name, const arg_list_t &args, const Variant &target, Context &ctx) {
-    Variant evargs ;
-    evalArgs(args, evargs, ctx) ;
-    return FunctionFactory::instance().invokeFilter(name, target, evargs, ctx) ;
+    else if ( !s.isUndefined() && !s.isNull() ) {
+        throw TemplateRuntimeException("spread operator needs array variable");
+    }
 }
 
-static Variant evalTest(const string &name, const arg_list_t &args, const Variant &target, Context &ctx) {
-
-    Variant evargs ;
-    evalArgs(args, evargs, ctx) ;
-    return FunctionFactory::instance().invokeTest(name, target, evargs, ctx) ;
+// keyword names refer to the argument list of the node
+static void evalArgs(const arg_list_t &input_args, ArgumentList &args, Context &ctx) {
+    for ( auto &&e: input_args ) {
+        if ( e.spread_ )
+            evalSpread(e.value_, args, ctx) ;
+        else if ( e.name_.empty() )
+            args.add(e.value_->eval(ctx)) ;
+        else
+            args.add(e.name_, e.value_->eval(ctx)) ;
+    }
 }
 
 static Variant applyFilter(const Variant &target, const std::vector<FilterNodePtr> &filters, Context &ctx) {
     Variant res = target ;
-    for( FilterNodePtr filter: filters ) {
-        res = evalFilter(filter->name_, filter->args_, res, ctx ) ;
+    for( const FilterNodePtr &filter: filters ) {
+        ArgumentList evargs ;
+        evalArgs(filter->args_, evargs, ctx) ;
+        res = filter->handle_->f_(res, evargs.view(), ctx) ;
     }
     return res ;
 }
 
 Variant InvokeFilterNode::eval(Context &ctx)
 {
-    Variant target = target_->eval(ctx) ;
-    return applyFilter(target, filters_, ctx) ;
+    Range r ;
+    if ( !eval_range(target_.get(), ctx, r) ) {
+        Variant target = target_->eval(ctx) ;
+        return applyFilter(target, filters_, ctx) ;
+    }
+
+    // filters of a range are applied to its bounds as long as they can
+    Variant res ;
+    size_t i = 0 ;
+    for( ; i < filters_.size() ; i++ ) {
+        const FilterNodePtr &filter = filters_[i] ;
+        ArgumentList evargs ;
+        evalArgs(filter->args_, evargs, ctx) ;
+
+        RangeFilter rf = apply_range_filter(filter->handle_, r, evargs.view(), res) ;
+        if ( rf == RangeFilter::Range ) continue ;
+        if ( rf == RangeFilter::Unsupported )
+            res = filter->handle_->f_(r.toArray(), evargs.view(), ctx) ;
+        break ;
+    }
+
+    if ( i == filters_.size() ) return r.toArray() ;
+
+    for( ++i ; i < filters_.size() ; i++ ) {
+        ArgumentList evargs ;
+        evalArgs(filters_[i]->args_, evargs, ctx) ;
+        res = filters_[i]->handle_->f_(res, evargs.view(), ctx) ;
+    }
+    return res ;
 }
 
 Variant TestExpressionNode::eval(Context &ctx)
 {
     Variant target = lhs_->eval(ctx) ;
-    arg_list_t args ;
-    if ( args_ ) {
-        args.emplace_back(std::string(), args_) ;
-    } 
-    return evalTest(name_, args, target, ctx) ;
+    ArgumentList evargs ;
+    if ( args_ ) evargs.add(args_->eval(ctx)) ;
+    return handle_->f_(target, evargs.view(), ctx) ;
 }
 
-Variant RangeOperatorNode::eval(Context &ctx)
+void RangeOperatorNode::evalRange(Context &ctx, Range &r)
 {
     Variant lhs = lhs_->eval(ctx) ;
     Variant rhs = rhs_->eval(ctx) ;
 
+    int64_t start, end ;
     if ( lhs.isString() && rhs.isString() ) {
-        string start= lhs.toString() ;
-        string end = rhs.toString() ;
-
-        if ( start.size() >= 1 && end.size() >= 1 ) {
-            int s = (int)start[0], e = (int)end[0] ;
-            Variant::Array res ;
-            for ( int i = s ; i <= e ; i++ ) {
-                res.push_back(string(1, (char)i)) ;
-            }
-            return res ;
-        }
+        string s = lhs.toString(), e = rhs.toString() ;
+        // an empty bound gives an empty range
+        if ( s.empty() || e.empty() ) return ;
+        start = s[0] ;
+        end = e[0] ;
+        r.chars_ = true ;
     } else if ( lhs.isNumber() || rhs.isNumber() ) {
-        int start = lhs.toInteger(), end = rhs.toInteger() ;
-        Variant::Array res ;
-        for ( int i = start ; i <= end ; i++ ) {
-            res.push_back(i) ;
-        }
-        return res ;
-    } else 
+        start = static_cast<int>(lhs.toInteger()) ;
+        end = static_cast<int>(rhs.toInteger()) ;
+    } else
         throw TemplateRuntimeException("Invalid operands for range operator") ;
 
-    return string() ;
+    r.start_ = start ;
+    r.size_ = ( end >= start ) ? end - start + 1 : 0 ;
 }
 
-Variant InvokeTestNode::eval(Context &ctx) {
-    Variant target = target_->eval(ctx) ;
+Variant RangeOperatorNode::eval(Context &ctx)
+{
+    Range r ;
+    evalRange(ctx, r) ;
+    return r.toArray() ;
+}
+
+bool eval_range(Node *e, Context &ctx, Range &r) {
+    if ( RangeOperatorNode *n = dynamic_cast<RangeOperatorNode *>(e) ) {
+        n->evalRange(ctx, r) ;
+        return true ;
+    } else if ( InvokeFunctionNode *n = dynamic_cast<InvokeFunctionNode *>(e) )
+        return n->evalRange(ctx, r) ;
+    return false ;
+}
+
+ForLoopBlockNode::ForLoopBlockNode(identifier_list_t &&ids, NodePtr target, NodePtr cond):
+    ids_(ids), target_(target), condition_(cond) {
+    vector<string> names{"loop"} ;
+    names.insert(names.end(), ids_.begin(), ids_.end()) ;
+    layout_ = SlotLayout(names) ;
+}
+
+bool LoopAttributeNode::parse(const string &name, Attribute &attr) {
+    static const map<string, Attribute> s_attributes{
+        {"index0", Index0}, {"index", Index}, {"revindex0", RevIndex0}, {"revindex", RevIndex},
+        {"first", First}, {"last", Last}, {"length", Length}
+    } ;
+    auto it = s_attributes.find(name) ;
+    if ( it == s_attributes.end() ) return false ;
+    attr = it->second ;
+    return true ;
+}
+
+Variant LoopAttributeNode::eval(Context &ctx) {
+    // the innermost iteration of the loop, nested scopes may be opened in between
+    const Context *c = &ctx ;
+    while ( c && c->layout_ != layout_ ) c = c->parent_ ;
+    if ( !c ) return Variant::undefined() ;
+
+    int64_t index = c->slots_[ForLoopBlockNode::counter_slot].toInteger() ;
+    int64_t length = c->slots_[ForLoopBlockNode::counter_slot + 1].toInteger() ;
+
+    switch ( attr_ ) {
+    case Index0: return index ;
+    case Index: return index + 1 ;
+    case RevIndex0: return length - index - 1 ;
+    case RevIndex: return length - index ;
+    case First: return index == 0 ;
+    case Last: return index == length - 1 ;
+    case Length: return length ;
+    }
+    return Variant::undefined() ;
+}
+
+void ForLoopBlockNode::evalIteration(Context &ctx, string &res, Variant *slots, size_t counter, size_t size,
+                                     const Variant &key, const Variant &value)
+{
+    size_t child_count = ( else_child_start_ < 0 ) ? children_.size() : else_child_start_ ;
+
+    // each iteration gets its own frame holding the loop variables
+
+    Context cctx(ctx) ;
+    cctx.bindSlots(layout_, slots) ;
+
+    int64_t index = counter, length = size ;
+    if ( loop_mode_ == LoopCounters ) {
+        slots[counter_slot] = index ;
+        slots[counter_slot + 1] = length ;
+    } else if ( loop_mode_ == LoopObject ) {
+        Variant::Object loop{ {"index0", index},
+                              {"index", index+1},
+                              {"revindex0", length - index - 1},
+                              {"revindex", length - index},
+                              {"first", index == 0},
+                              {"last", index == length-1},
+                              {"length", length}
+                            } ;
+        slots[0] = loop ;
+    }
+
+    if ( ids_.size() == 1 ) {
+        slots[1] = value ;
+    } else if ( ids_.size() == 2 ) {
+        slots[1] = key ;
+        slots[2] = value ;
+    } else return ;
+
+    if ( condition_ && !condition_->eval(cctx).toBoolean() ) return ;
+
+    size_t i = 0 ;
+    for( auto &&c: children_ ) {
+        if ( ++i > child_count ) break ;
+        c->eval(cctx, res) ;
+    }
 
-    Variant v = evalFilter(name_, args_, target, ctx) ;
+    cctx.flush(res) ;
+}
 
-    bool res = v.toBoolean() ;
+void ForLoopBlockNode::evalElse(Context &ctx, string &res)
+{
+    if ( else_child_start_ < 0 ) return ;
 
-    return ( positive_ ) ? res : !res ;
+    for( size_t count = else_child_start_ ; count < children_.size() ; count ++ ) {
+        children_[count]->eval(ctx, res) ;
+    }
 }
 
 void ForLoopBlockNode::eval(Context &ctx, string &res)
 {
-    uint counter = 0 ;
+    // the slots are reused by all iterations
+    Variant slots[counter_slot + 2] ;
+
+    // a range is iterated without building the array
+    Range range ;
+    if ( eval_range(target_.get(), ctx, range) ) {
+        if ( range.size_ == 0 ) evalElse(ctx, res) ;
+        for( size_t counter = 0 ; counter < range.size_ ; counter++ )
+            evalIteration(ctx, res, slots, counter, range.size_, static_cast<int64_t>(counter), range.at(counter)) ;
+        return ;
+    }
+
     Variant target = target_->eval(ctx) ;
-    int asize = target.length() ;
-
-    if ( asize > 0 ) {
-
-        int child_count = ( else_child_start_ < 0 ) ? children_.size() : else_child_start_ ;
-        for ( auto it = target.begin() ; it != target.end() ; ++it, counter++  ) {
-
-            Context tctx(ctx) ;
-
-            Variant::Object loop{ {"index0", counter},
-                                  {"index", counter+1},
-                                  {"revindex0", asize - counter - 1},
-                                  {"revindex", asize - counter},
-                                  {"first", counter == 0},
-                                  {"last", counter == asize-1},
-                                  {"length", asize}
-                                } ;
-            tctx.data()["loop"] = loop ;
-
-            uint i = 0 ;
-            for( auto &&c: children_ ) {
-                if ( ++i > child_count ) break ;
-                if ( ids_.size() == 1 ) {
-                    Context cctx(tctx) ;
-                    cctx.data()[ids_[0]] = *it ;
-                    if ( condition_ && !condition_->eval(cctx).toBoolean() ) continue ;
-
-                    c->eval(cctx, res) ;
-                } else if ( ids_.size() == 2 ) {
-                    Context cctx(tctx) ;
-                    cctx.data()[ids_[0]] =  it.key() ;
-                    cctx.data()[ids_[1]] =  it.value() ;
-                    if ( condition_ && !condition_->eval(cctx).toBoolean() ) continue ;
-                    c->eval(cctx, res) ;
-                }
-            }
-        }
-    } else if ( else_child_start_ >= 0 ) {
+    size_t asize = target.length() ;
 
-        for( uint count = else_child_start_ ; count < children_.size() ; count ++ ) {
-            children_[count]->eval(ctx, res) ;
-        }
+    if ( asize == 0 ) {
+        evalElse(ctx, res) ;
+        return ;
+    }
+
+    size_t counter = 0 ;
+    for ( auto it = target.begin() ; it != target.end() ; ++it, counter++  ) {
+        if ( ids_.size() == 2 )
+            evalIteration(ctx, res, slots, counter, asize, it.key(), it.value()) ;
+        else
+            evalIteration(ctx, res, slots, counter, asize, Variant(), *it) ;
     }
 }
 
@@ -484,14 +638,14 @@ void AssignmentBlockNode::eval(Context &ctx, string &res) {
         for( auto &&c: children_ ) {
             c->eval(ctx, subres) ;  
         }
-        ctx.data_.insert_or_assign(names_[0], subres) ;
+        ctx.set(names_[0], subres) ;
     } else {
-        Context cctx(ctx) ;
+        vector<Variant> slots(names_.size()) ;
         for( size_t i = 0 ; i< names_.size() ; i++ ) {
-            const auto &key = names_[i] ;
-            Variant val = values_[i]->eval(ctx) ;
-            cctx.data_.insert_or_assign(key, val) ;
+            slots[i] = values_[i]->eval(ctx) ;
         }
+        Context cctx(ctx) ;
+        cctx.bindSlots(layout_, slots.data()) ;
         for( auto &&c: children_ ) {
             c->eval(cctx, res) ;  
         }
@@ -514,7 +668,9 @@ void FilterBlockNode::eval(Context &ctx, string &res) {
         c->eval(ctx, block_res) ;
 
     try {
-        string result = evalFilter(name_, args_, block_res, ctx).toString() ;
+        ArgumentList evargs ;
+        evalArgs(filter_->args_, evargs, ctx) ;
+        string result = filter_->handle_->f_(block_res, evargs.view(), ctx).toString() ;
         res.append(result)  ;
     } catch ( TemplateRuntimeException &e ) {
         throwException(e.what()) ;
@@ -523,67 +679,74 @@ void FilterBlockNode::eval(Context &ctx, string &res) {
 }
 
 
+InvokeFunctionNode::InvokeFunctionNode(NodePtr callable, const arg_list_t &&args): callable_(callable), args_(args) {
+    // registered functions take precedence over variables of the same name
+    if ( IdentifierNode *node = dynamic_cast<IdentifierNode *>(callable_.get()) )
+        function_ = FunctionFactory::instance().findFunction(node->name()) ;
+}
+
+bool InvokeFunctionNode::evalRange(Context &ctx, Range &r)
+{
+    if ( !function_ || !is_range_function(function_) ) return false ;
+
+    ArgumentList args ;
+    evalArgs(args_, args, ctx) ;
+    range_bounds(args.view(), r) ;
+    return true ;
+}
+
 Variant InvokeFunctionNode::eval(Context &ctx)
 {
-    Variant args ;
+    ArgumentList args ;
     evalArgs(args_, args, ctx) ;
 
-    if (IdentifierNode *node = dynamic_cast<IdentifierNode *>(callable_.get()) ) {
-        string fn_name = node->name() ;
+    if ( function_ ) return function_->f_(args.view(), ctx) ;
 
-        FunctionFactory &ff = FunctionFactory::instance() ;
-        if ( ff.hasFunction(fn_name) ) {
-            return ff.invokeFunction(fn_name, args, ctx) ; 
-        }
-        
-    }
     Variant callable = callable_->eval(ctx) ;
 
+    // macros and lambdas take packed arguments
     if ( callable.type() == Variant::Type::Function )
-        return callable.invoke(args) ;
+        return callable.invoke(args.view().pack()) ;
     else
         throw TemplateRuntimeException("function invocation of non-callable variable") ;
 }
 
- NamedBlockNode *DocumentNode::findBlock(const std::string &name) {
+ NamedBlockNode *DocumentNode::findBlock(const std::string &name) const {
     auto it = blocks_.find(name) ;
     if ( it == blocks_.end() ) return nullptr ;
     else return it->second ;
  }
 
-std::string resolve_and_render_block(const std::string &name, DocumentNode *doc, Context &ctx) {
-    NamedBlockNode* target_block = nullptr;
-    DocumentNode *root = doc ;
+void resolve_and_render_block(const std::string &name, const TemplateChain &chain, size_t start, Context &ctx, string &res) {
+    for ( size_t layer = start ; layer < chain.size() ; layer++ ) {
+        const NamedBlockNode *target_block = chain[layer]->findBlock(name) ;
+        if ( target_block == nullptr ) continue ;
 
-    while ( root ) {
-        target_block = root->findBlock(name) ;
-        if ( target_block != nullptr ) break ;
-        root = root->parent_.get() ;
-    }
-        
-    if ( target_block == nullptr ) 
-        throw TemplateRuntimeException("Block '" + name + "' is not defined in the template inheritance chain starting from file:" + doc->resource_ );
+        Context bctx(ctx) ;
+        bctx.active_block_ = target_block ;
+        bctx.active_layer_ = layer ;
 
-    ctx.active_block_ = target_block;
-        
-    string res ;
-    for( auto &&c: target_block->children_ ) {
-        c->eval(ctx, res) ;
+        for( auto &&c: target_block->children_ ) {
+            c->eval(bctx, res) ;
+            bctx.flush(res) ;
+        }
+        return ;
     }
-    return res ;
+
+    throw TemplateRuntimeException("Block '" + name + "' is not defined in the template inheritance chain starting from file:" + chain[start]->resource_ );
  }
 
 void NamedBlockNode::eval(Context &ctx, string &res) {
 
-    DocumentNode *doc = ctx.root_tmpl_ ;
+    const TemplateChain *chain = ctx.chain_ ;
 
-    if ( !doc->isChild() ) {
+    if ( chain == nullptr || chain->size() == 1 ) {
         for( auto &&c: children_ ) {
             c->eval(ctx, res) ;
         }
     } else {
         try {
-            res.append(resolve_and_render_block(name_, ctx.root_tmpl_, ctx));
+            resolve_and_render_block(name_, *chain, 0, ctx, res);
         } catch ( TemplateRuntimeException &e ) {
             throwException(e.what()) ;
         }
@@ -614,6 +777,11 @@ void DocumentNode::populateBlocks() {
 
 void ContainerNode::getAllBlocks(std::vector<NamedBlockNode *> &blocks) {
     for( auto &c: children_ ) {
+        // blocks inside an embed override the embedded template and do not belong to this document
+        if ( EmbedBlockNode *en = dynamic_cast<EmbedBlockNode *>(c.get()) ) {
+            en->populateBlocks() ;
+            continue ;
+        }
         NamedBlockNode *n = dynamic_cast<NamedBlockNode *>(c.get()) ;
         if ( n != nullptr ) blocks.push_back(n) ;
         ContainerNode *cn = dynamic_cast<ContainerNode *>(c.get()) ;
@@ -621,28 +789,83 @@ void ContainerNode::getAllBlocks(std::vector<NamedBlockNode *> &blocks) {
     }
 }
 
-void DocumentNode::eval(Context &ctx, string &res) {
+void ContainerNode::getAllDependencies(std::set<std::string> &deps) {
+    for( auto &c: children_ ) {
+        NodePtr src ;
+        if ( ExtensionBlockNode *en = dynamic_cast<ExtensionBlockNode *>(c.get()) ) src = en->parent_resource_ ;
+        else if ( IncludeBlockNode *in = dynamic_cast<IncludeBlockNode *>(c.get()) ) src = in->source_ ;
+        else if ( ImportBlockNode *mn = dynamic_cast<ImportBlockNode *>(c.get()) ) src = mn->source_ ;
+        else if ( EmbedBlockNode *bn = dynamic_cast<EmbedBlockNode *>(c.get()) ) src = bn->source_ ;
+
+        // only names known at compile time
+        if ( LiteralNode *lit = dynamic_cast<LiteralNode *>(src.get()) )
+            deps.insert(lit->val_.toString()) ;
+
+        ContainerNode *cn = dynamic_cast<ContainerNode *>(c.get()) ;
+        if ( cn ) cn->getAllDependencies(deps) ;
+    }
+}
+
+void DocumentNode::populateDependencies() {
+    getAllDependencies(dependencies_) ;
+}
 
-    // Build hierachy tree
+void DocumentNode::linkParent(TemplateRenderer &rdr) {
     ExtensionBlockNode *pen = findExtensionNode() ;
-    DocumentNode *tmpl = this, *root_template = this ;
-    TemplateRenderer &rdr = ctx.rdr_ ;
-
-    while ( pen != nullptr ) {    
-        string resource = pen->parent_resource_->eval(ctx).toString() ;
-        auto parent = rdr.compile(resource) ;
-        tmpl->setParentTemplate(parent) ;
-        pen = parent->findExtensionNode() ;
+    if ( pen == nullptr ) return ;
+
+    if ( LiteralNode *lit = dynamic_cast<LiteralNode *>(pen->parent_resource_.get()) )
+        parent_tmpl_ = rdr.compile(lit->val_.toString()) ;
+}
+
+DocumentNodePtr DocumentNode::resolveParent(Context &ctx) const {
+    if ( parent_tmpl_ ) return parent_tmpl_ ;
+
+    ExtensionBlockNode *pen = findExtensionNode() ;
+    if ( pen == nullptr ) return nullptr ;
+
+    string resource = pen->parent_resource_->eval(ctx).toString() ;
+    return ctx.rdr_.compile(resource) ;
+}
+
+void DocumentNode::updateOutputEstimate(size_t size) {
+    // exponential moving average with weight 1/8 for the new sample, concurrent updates may overwrite each other
+    size_t est = output_estimate_.load(std::memory_order_relaxed) ;
+    est = ( est == 0 ) ? size : est - est/8 + size/8 ;
+    output_estimate_.store(est, std::memory_order_relaxed) ;
+}
+
+void DocumentNode::eval(Context &ctx, string &res) {
+    render(ctx, res, nullptr) ;
+}
+
+void DocumentNode::render(Context &ctx, string &res, const DocumentNode *overrides) {
+
+    // Build the hierarchy for this render only, the compiled documents are left untouched
+
+    TemplateChain chain ;
+    vector<DocumentNodePtr> parents ; // keeps dynamically compiled parents alive
+
+    if ( overrides ) chain.push_back(overrides) ;
+
+    for( const DocumentNode *tmpl = this ; tmpl != nullptr ; ) {
+        chain.push_back(tmpl) ;
+        DocumentNodePtr parent = tmpl->resolveParent(ctx) ;
         tmpl = parent.get() ;
+        if ( parent ) parents.emplace_back(std::move(parent)) ;
     }
 
-    // run the children
-
-    ctx.root_tmpl_ = ctx.root_tmpl_ ? ctx.root_tmpl_ : this ;
+    // run the children of the topmost template
 
-    for( auto &&e: tmpl->children_ )
-        e->eval(ctx, res) ;
+    Context cctx(ctx) ;
+    cctx.chain_ = &chain ;
+    cctx.active_block_ = nullptr ;
+    cctx.active_layer_ = 0 ;
 
+    for( auto &&e: chain.back()->children_ ) {
+        e->eval(cctx, res) ;
+        cctx.flush(res) ;
+    }
 }
 
 void ExtensionBlockNode::eval(Context &ctx, string &res) {
@@ -651,7 +874,14 @@ void ExtensionBlockNode::eval(Context &ctx, string &res) {
 void MacroBlockNode::eval(Context &ctx, string &str) {
 }
 
-void MacroBlockNode::mapArguments(const Variant &args, Context &ctx) {
+MacroBlockNode::MacroBlockNode(const string &name, key_val_list_t &&args): name_(name), args_(args) {
+    vector<string> names ;
+    for( const auto &a: args_ ) names.push_back(a.first) ;
+    layout_ = SlotLayout(names) ;
+}
+
+// the arguments are stored in the slots of the macro frame in the order of declaration
+void MacroBlockNode::mapArguments(const Variant &args, Context &ctx, Variant *slots) {
     Variant pos_args = args["args"];
     Variant kw_args = args["kw"];
 
@@ -672,19 +902,21 @@ void MacroBlockNode::mapArguments(const Variant &args, Context &ctx) {
         } else {
             throw TemplateRuntimeException("missing require parameter:" + arg_name);
         }
-        ctx.data()[arg_name] = std::move(v) ;
+        slots[pos] = std::move(v) ;
     }
 }
 
 Variant MacroBlockNode::call(Context &ctx, const Variant &args) {
 // macros should start from the empty context
 // we only add the _self key
-    Context mctx(ctx) ;
-    mctx.data_.clear() ;
-    mctx.data_["_self"] = ctx.data_["_self"] ; 
+    Context mctx(ctx, true) ;
+    mctx.set("_self", ctx.get("_self")) ;
+
+    vector<Variant> slots(layout_.size()) ;
+    mctx.bindSlots(layout_, slots.data()) ;
 
     try {
-        mapArguments(args, mctx) ;
+        mapArguments(args, mctx, slots.data()) ;
     } catch ( TemplateRuntimeException &e ) {
         throwException(e.what()) ;
     }
@@ -741,14 +973,14 @@ void ImportBlockNode::eval(Context &ctx, string &res) {
         }
     }
 
-    if ( !ns_.empty() ) pctx.data()[ns_] = Variant(closures) ;
+    if ( !ns_.empty() ) pctx.set(ns_, Variant(closures)) ;
     else {
         for( auto &e: closures ) {
-            pctx.data()[e.first] = e.second ;
+            pctx.set(e.first, e.second) ;
         }
     }
 
-    pctx.data_["_self"] = all_macros ;
+    pctx.set("_self", all_macros) ;
 
     for( auto &&c: children_ ) {
         c->eval(pctx, res) ;
@@ -829,17 +1061,9 @@ void IncludeBlockNode::eval(Context &ctx, string &res)
 
     // create new context either inheriting parent one or empty and extend with key/values if any
 
-    if ( only_flag_ ) {
-        Context cctx(ctx) ;
-        cctx.data_.clear() ;
-        cctx.data().insert(ctx_extension.begin(), ctx_extension.end()) ;
-        doc->eval(cctx, res) ;
-    } else {
-        Context cctx(ctx) ;
-        for( auto &&e: ctx_extension )
-            cctx.data()[e.first] = e.second ;
-        doc->eval(cctx, res) ;
-    }
+    Context cctx(ctx, only_flag_) ;
+    cctx.extend(ctx_extension) ;
+    doc->eval(cctx, res) ;
 }
 
 void WithBlockNode::eval(Context &ctx, string &res)
@@ -859,19 +1083,10 @@ void WithBlockNode::eval(Context &ctx, string &res)
 
     // create new context either inheriting parent one or empty and extend with key/values if any
 
-    if ( only_flag_ ) {
-        Context cctx(ctx) ;
-        cctx.data_.clear() ;
-        cctx.data().insert(ctx_extension.begin(), ctx_extension.end()) ;
-        for( auto &&c: children_ )
-            c->eval(cctx, res) ;
-    } else {
-        Context cctx(ctx) ;
-        for( auto &&e: ctx_extension )
-            cctx.data()[e.first] = e.second ;
-        for( auto &&c: children_ )
-            c->eval(cctx, res) ;
-    }
+    Context cctx(ctx, only_flag_) ;
+    cctx.extend(ctx_extension) ;
+    for( auto &&c: children_ )
+        c->eval(cctx, res) ;
 }
 
 static bool compare_numbers(double lhs, double rhs, ComparisonPredicate::Type op) {
@@ -915,10 +1130,12 @@ Variant LambdaNode::eval(Context &ctx) {
         if ( pos_args.length() != args_.size() )
             throw TemplateRuntimeException("wrong number of arguments passed to lambda") ;
         
-        Context cctx(ctx) ;
+        vector<Variant> slots(args_.size()) ;
         for( uint i = 0 ; i < args_.size() ; i++ ) {
-            cctx.data()[args_[i]] = pos_args.at(i) ;
+            slots[i] = pos_args.at(i) ;
         }
+        Context cctx(ctx) ;
+        cctx.bindSlots(layout_, slots.data()) ;
         Variant res = body_->eval(cctx);
         return res ;
     });
@@ -927,14 +1144,14 @@ Variant LambdaNode::eval(Context &ctx) {
 Variant AssignmentNode::eval(Context &ctx) {
     Variant val = rhs_->eval(ctx) ;
     if ( args_.size() == 1 ) {
-        ctx.data()[args_.front()] = val ;
+        ctx.set(args_.front(), val) ;
         return val ;
     } else if ( type_ == ArrayDestructring && val.isArray()  ) {
         Variant::Array arr ; 
         for( uint i = 0 ; i < args_.size() ; i++ ) {
             if ( args_[i].empty() ) continue ;
             Variant v = val.at(i) ;
-            ctx.data()[args_[i]] = v;
+            ctx.set(args_[i], v) ;
             arr.push_back(v) ;
         }
         return arr ;
@@ -946,10 +1163,10 @@ Variant AssignmentNode::eval(Context &ctx) {
             Variant res = val.at(kv.key_) ;
     
             if ( !kv.alias_.empty() ) {
-                ctx.data()[kv.alias_] = res;
+                ctx.set(kv.alias_, res) ;
                  obj[kv.key_] = res ;
             } else {
-                ctx.data()[kv.key_] = res;
+                ctx.set(kv.key_, res) ;
                 obj[kv.key_] = res ;
             }
         }
@@ -965,7 +1182,8 @@ Variant TernaryOperatorNode::eval(Context &ctx) {
 }
 
 
-MatchesNode::MatchesNode(NodePtr lhs, const string &rx, bool positive): lhs_(lhs), positive_(positive) {
+// split /pattern/flags, the delimiter is the first character
+static Regex parse_regex_literal(const string &rx) {
 
     if ( rx.size() < 2 ) throw TemplateRuntimeException("empty regex string") ;
 
@@ -980,24 +1198,23 @@ MatchesNode::MatchesNode(NodePtr lhs, const string &rx, bool positive): lhs_(lhs
     std::string pattern = rx.substr(1, end_delim_pos - 1);
     std::string flagsStr = rx.substr(end_delim_pos + 1);
 
-    std::regex_constants::syntax_option_type regex_flags = std::regex_constants::ECMAScript;
+    bool icase = false ;
     for (char flag : flagsStr) {
         if (flag == 'i') {
-            regex_flags |= std::regex_constants::icase; // Case-insensitive
+            icase = true ; // Case-insensitive
         }
         // Note: PCRE flags like 'm', 's', 'x' lack direct, identical ECMAScript flag mappings.
     }
 
-    rx_.assign(pattern, regex_flags) ;
+    return Regex(pattern, icase) ;
+}
+
+MatchesNode::MatchesNode(NodePtr lhs, const string &rx, bool positive): lhs_(lhs), rx_(parse_regex_literal(rx)), positive_(positive) {
 }
 
 Variant MatchesNode::eval(Context &ctx)
 {
-    string val = lhs_->eval(ctx).toString() ;
-
-    bool res = std::regex_search(val, rx_)  ;
-
-    return (bool)res ;
+    return rx_.search(lhs_->eval(ctx).toString()) ;
 }
 
 void ltrim(std::string &s) {
@@ -1015,18 +1232,16 @@ void rtrim(std::string &s) {
 void SubstitutionBlockNode::eval(Context &ctx, string &res) {
 
     try {
-        string content = escape(expr_->eval(ctx), ctx.escape_mode_).toString() ;
-        res.append(content) ;
+        escape(expr_->eval(ctx), mode_, res) ;
     } catch ( TemplateRuntimeException &e ) {
         throwException(e.what());
     }
 }
 
+// the strategy is applied by the substitutions themselves
 void AutoEscapeBlockNode::eval(Context &ctx, string &res) {
-    Context cctx(ctx) ;
-    cctx.escape_mode_ = mode_ ;
     for( auto &&c: children_ )
-        c->eval(cctx, res) ;
+        c->eval(ctx, res) ;
 }
 
 void EmbedBlockNode::eval(Context &ctx, string &res)
@@ -1084,32 +1299,20 @@ void EmbedBlockNode::eval(Context &ctx, string &res)
 
     // create new context either inheriting parent one or empty and extend with key/values if any
 
-    Context cctx(ctx);
-   
-    if ( only_flag_ ) {
-        cctx.data_.clear() ;
-        cctx.data().insert(ctx_extension.begin(), ctx_extension.end()) ;   
-    } else {
-        for( auto &&e: ctx_extension )
-            cctx.data()[e.first] = e.second ;
-    }
+    Context cctx(ctx, only_flag_) ;
+    cctx.extend(ctx_extension) ;
 
-    DocumentNode * this_doc = root() ;
-    vector<NamedBlockNode *> this_doc_blocks ;
-    getAllBlocks(this_doc_blocks) ;
-
-    DocumentNodePtr virtual_child(new DocumentNode()) ;
-    virtual_child->resource_ = root()->resource_ ;
-    virtual_child->setParentTemplate(target_doc);
-   
-    for( auto block_node: this_doc_blocks ) {
-        virtual_child->blocks_.emplace(block_node->name_, block_node ) ;
-        block_node->parent_ = virtual_child.get() ;
-    }
+    target_doc->render(cctx, res, overrides_.get());
+}
+
+void EmbedBlockNode::populateBlocks() {
+    overrides_.reset(new DocumentNode(root()->resource_)) ;
 
-    cctx.root_tmpl_ = virtual_child.get() ;
-    target_doc->eval(cctx, res);
+    vector<NamedBlockNode *> blocks ;
+    getAllBlocks(blocks) ;
 
+    for( auto block_node: blocks )
+        overrides_->blocks_.emplace(block_node->name_, block_node) ;
 }
 
 } // detail
@@ -3,25 +3,40 @@
 
 #include <variant/variant.hpp>
 #include <twig/context.hpp>
+#include <twig/functions.hpp>
+#include <twig/regex.hpp>
+#include <twig/loader.hpp>
+
+#include "escape.hpp"
 
 #include <memory>
 #include <deque>
-#include <regex>
+#include <set>
+#include <atomic>
+#include <functional>
 
 class Context ;
 
 namespace twig {
 namespace detail {
 
+class Node ;
+using NodePtr = std::shared_ptr<Node> ;
+
+// called with a reference to each sub-expression, so that compile passes can replace it
+using NodeVisitor = std::function<void (NodePtr &)> ;
+
+class ExpressionCompiler ;
+
 class Node {
 public:
     Node() = default ;
     virtual ~Node() = default ;
 
     virtual Variant eval(Context &ctx) = 0 ;
-};
 
-using NodePtr = std::shared_ptr<Node> ;
+    virtual void visitOperands(const NodeVisitor &v) {}
+};
 
 class LiteralNode: public Node {
 public:
@@ -39,6 +54,7 @@ struct FuncArg {
         name_(name), value_(value) {}
     std::string name_ ;
     NodePtr value_ ;
+    bool spread_ = false ; // ...value_, expanded into positional arguments
 };
 
 using key_val_t = std::pair<std::string, NodePtr> ;
@@ -55,19 +71,37 @@ public:
 
     Variant eval(Context &ctx) { return val_->eval(ctx) ; }
 
+    void visitOperands(const NodeVisitor &v) override { v(val_) ; }
+
     NodePtr val_ ;
 };
 
+// the name is split at compile time into the variable (interned) and the path of attributes following it
+
 class IdentifierNode: public Node {
 public:
-    IdentifierNode(const std::string name): name_(name) {}
+    IdentifierNode(const std::string &name) ;
 
-    Variant eval(Context &ctx) ;
+    Variant eval(Context &ctx) { return value(ctx) ; }
+
+    Variant value(const Context &ctx) const {
+        const Variant *v = ctx.find(sym_, var_) ;
+        if ( !v ) return Variant::undefined() ;
+        return path_.empty() ? *v : v->at(path_) ;
+    }
+
+    // address of the value in the context, nullptr if the variable is undefined
+    const Variant *address(const Context &ctx) const {
+        const Variant *v = ctx.find(sym_, var_) ;
+        if ( !v || path_.empty() ) return v ;
+        return &v->at(path_) ;
+    }
 
-    const std::string name() const { return name_ ; }
+    const std::string &name() const { return name_ ; }
 
 private:
-    std::string name_ ;
+    std::string name_, var_, path_ ;
+    Symbol sym_ ;
 };
 
 class SpreadOperator: public Node {
@@ -75,6 +109,8 @@ public:
     SpreadOperator(NodePtr rhs): rhs_(rhs) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(rhs_) ; }
 public:
    NodePtr rhs_ ;
 };
@@ -86,6 +122,10 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override {
+        for( auto &e: elements_ ) v(e) ;
+    }
+
 private:
 
     std::vector<NodePtr> elements_ ;
@@ -98,6 +138,8 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; v(rhs_) ; }
+
 private:
     NodePtr lhs_, rhs_ ;
     bool positive_ ;
@@ -110,9 +152,11 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; }
+
 private:
     NodePtr lhs_ ;
-    std::regex rx_ ;
+    Regex rx_ ;
     bool positive_ ;
 };
 
@@ -124,6 +168,10 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override {
+        for( auto &e: elements_ ) v(e.second) ;
+    }
+
 private:
     std::map<std::string, NodePtr> elements_ ;
 };
@@ -135,7 +183,13 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override { v(array_) ; v(index_) ; }
+
+    static Variant apply(const Variant &a, const Variant &index) ;
+
 private:
+    friend class ExpressionCompiler ;
+
     NodePtr array_ ;
     NodePtr index_ ;
 };
@@ -148,7 +202,16 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override {
+        v(dict_) ;
+        if ( key_node_ ) v(key_node_) ;
+    }
+
+    static Variant apply(const Variant &o, const std::string &key, bool except_on_null) ;
+
 private:
+    friend class ExpressionCompiler ;
+
     NodePtr dict_ ;
     std::string  key_ ;
     NodePtr key_node_ ;
@@ -157,12 +220,20 @@ private:
 
 class BinaryOperator: public Node {
 public:
-    BinaryOperator(const std::string &op, NodePtr lhs, NodePtr rhs): op_(op), lhs_(lhs), rhs_(rhs) {}
+    enum Type { Coalesce, Add, Subtract, Multiply, Divide, FloorDivide, Modulo, Power, Concat } ;
+
+    BinaryOperator(Type op, NodePtr lhs, NodePtr rhs): op_(op), lhs_(lhs), rhs_(rhs) {}
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; v(rhs_) ; }
+
+    static Variant apply(Type op, const Variant &op1, const Variant &op2) ;
+
 private:
-    std::string op_ ;
+    friend class ExpressionCompiler ;
+
+    Type op_ ;
     NodePtr lhs_, rhs_ ;
 };
 
@@ -174,17 +245,62 @@ public:
     BooleanOperator(Type op, NodePtr lhs, NodePtr rhs): op_(op), lhs_(lhs), rhs_(rhs) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; v(rhs_) ; }
 private:
+    friend class ExpressionCompiler ;
+
     Type op_ ;
     NodePtr lhs_, rhs_ ;
 };
 
+// Arithmetic sequence produced by '..' or range(). For loops and the length, first, last and slice filters work on it
+// directly, any other use of the value builds the array. Character ranges hold character codes.
+
+struct Range {
+    int64_t start_ = 0, step_ = 1 ;
+    size_t size_ = 0 ;
+    bool chars_ = false ;
+
+    Variant at(size_t i) const {
+        int64_t v = start_ + static_cast<int64_t>(i) * step_ ;
+        if ( chars_ ) return std::string(1, static_cast<char>(v)) ;
+        return v ;
+    }
+
+    Variant toArray() const {
+        Variant::Array res ;
+        for( size_t i = 0 ; i < size_ ; i++ )
+            res.push_back(at(i)) ;
+        return res ;
+    }
+};
+
+// sequence of range(low, high, step), throws on invalid arguments
+void range_bounds(const Arguments &args, Range &r) ;
+
+// true if the handle calls the built-in range function
+bool is_range_function(FunctionFactory::FunctionHandle h) ;
+
+// Applies the built-in length, first, last and slice filters to a range without building the array. A slice leaves
+// its result in r, the others in res. Other filters (or arguments) are not handled and need the array.
+enum class RangeFilter { Range, Value, Unsupported } ;
+RangeFilter apply_range_filter(FunctionFactory::FilterHandle f, Range &r, const Arguments &args, Variant &res) ;
+
+// if e is a range operator or a call of range(), evaluates its bounds into r; otherwise returns false without
+// evaluating anything
+bool eval_range(Node *e, Context &ctx, Range &r) ;
+
 class RangeOperatorNode: public Node {
 public:
     RangeOperatorNode(NodePtr lhs, NodePtr rhs): lhs_(lhs), rhs_(rhs) {}
 
     Variant eval(Context &ctx) ;
 
+    void evalRange(Context &ctx, Range &r) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; v(rhs_) ; }
+
 private:
     NodePtr lhs_, rhs_ ;
 };
@@ -195,18 +311,30 @@ public:
     BooleanNegationOperator(NodePtr node): node_(node) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(node_) ; }
 private:
+    friend class ExpressionCompiler ;
+
     NodePtr node_ ;
 };
 
 class UnaryOperator: public Node {
 public:
 
-    UnaryOperator(char op, NodePtr rhs): op_(op), rhs_(rhs) {}
+    enum Type { Negate, Not } ;
+
+    UnaryOperator(Type op, NodePtr rhs): op_(op), rhs_(rhs) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(rhs_) ; }
+
+    static Variant apply(Type op, const Variant &val) ;
 private:
-    char op_ ;
+    friend class ExpressionCompiler ;
+
+    Type op_ ;
     NodePtr rhs_ ;
 };
 
@@ -225,7 +353,11 @@ public:
     AssignmentNode(const std::vector<KeyAlias> &args, NodePtr rhs): dict_args_(args), rhs_(rhs), type_(DictionaryDestructuring) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(rhs_) ; }
 private:
+    friend class Optimizer ;
+
     identifier_list_t args_ ;
     std::vector<KeyAlias> dict_args_ ;
     NodePtr rhs_ ;
@@ -242,7 +374,13 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override { v(lhs_) ; v(rhs_) ; }
+
+    static Variant apply(Type op, const Variant &lhs, const Variant &rhs) ;
+
 private:
+    friend class ExpressionCompiler ;
+
     Type op_ ;
     NodePtr lhs_, rhs_ ;
 };
@@ -250,13 +388,21 @@ private:
 class TestExpressionNode: public Node {
 public:
   
-    TestExpressionNode(NodePtr lhs, const std::string &name, NodePtr args, bool positive): 
-        lhs_(lhs), name_(name), args_(args),  positive_(positive) {}
+    TestExpressionNode(NodePtr lhs, const std::string &name, FunctionFactory::TestHandle handle, NodePtr args, bool positive):
+        name_(name), handle_(handle), lhs_(lhs), args_(args),  positive_(positive) {}
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override {
+        v(lhs_) ;
+        if ( args_ ) v(args_) ;
+    }
+
 private:
+    friend class Optimizer ;
+
     std::string name_ ;
+    FunctionFactory::TestHandle handle_ ;
     NodePtr lhs_, args_ ;
     bool positive_ ;
 };
@@ -282,12 +428,15 @@ public:
 };
 */
 
+// the filter is bound when the template is parsed
+
 class FilterNode {
 public:
-    FilterNode(const std::string &name, arg_list_t &&args ={}): name_(name),
-        args_(args) {}
+    FilterNode(const std::string &name, FunctionFactory::FilterHandle handle, arg_list_t &&args ={}): name_(name),
+        handle_(handle), args_(args) {}
 
     std::string name_ ;
+    FunctionFactory::FilterHandle handle_ ;
     arg_list_t args_ ;
 };
 
@@ -300,38 +449,40 @@ public:
 
     Variant eval(Context &ctx) ;
 
+    void visitOperands(const NodeVisitor &v) override {
+        v(target_) ;
+        for( auto &f: filters_ )
+            for( auto &a: f->args_ ) v(a.value_) ;
+    }
+
 private:
+    friend class Optimizer ;
+
     NodePtr target_ ;
     std::vector<FilterNodePtr> filters_ ;
 };
 
-class InvokeTestNode: public Node {
+class InvokeFunctionNode: public Node {
 public:
-    InvokeTestNode(NodePtr target, const std::string &name,
-                   arg_list_t &&args, bool positive):
-        target_(target), name_(name), args_(args), positive_(positive) {}
+    InvokeFunctionNode(NodePtr callable, const arg_list_t &&args = {}) ;
 
     Variant eval(Context &ctx) ;
 
-private:
-    NodePtr target_ ;
-    std::string name_ ;
-    arg_list_t args_ ;
-    bool positive_ ;
-};
+    // false if this is not a call of the built-in range function
+    bool evalRange(Context &ctx, Range &r) ;
 
-
-class InvokeFunctionNode: public Node {
-public:
-    InvokeFunctionNode(NodePtr callable, const arg_list_t &&args = {}):
-        callable_(callable), args_(args) {}
-
-    Variant eval(Context &ctx) ;
+    void visitOperands(const NodeVisitor &v) override {
+        v(callable_) ;
+        for( auto &a: args_ ) v(a.value_) ;
+    }
 
 
 private:
+    friend class Optimizer ;
+
     NodePtr callable_ ;
     arg_list_t args_ ;
+    FunctionFactory::FunctionHandle function_ = nullptr ; // registered function named by callable_
 };
 
 class DocumentNode ;
@@ -352,6 +503,15 @@ public:
         return reinterpret_cast<DocumentNode *>(node) ;
     }
 
+    const DocumentNode *root() const {
+        const ContentNode *node = this ;
+        while ( node->parent_ ) {
+            node = node->parent_ ;
+        }
+
+        return reinterpret_cast<const DocumentNode *>(node) ;
+    }
+
     void setLineAndColumn(int line, int col) {
         line_ = line ;
         column_ = col ;
@@ -360,7 +520,10 @@ public:
     void setTrimLeft(bool s) { trim_left_ = s ; }
     void setTrimRight(bool s) { trim_right_ = s ; }
 
-    virtual void throwException(const std::string &msg) ;
+    [[noreturn]] virtual void throwException(const std::string &msg) const ;
+
+    // call v on each expression evaluated by the node (and its children)
+    virtual void visitExpressions(const NodeVisitor &v) {}
 
     ContentNode *parent_ = nullptr ;
     bool trim_left_ = false, trim_right_ = false ;
@@ -378,10 +541,15 @@ public:
     }
 
     void getAllBlocks(std::vector<NamedBlockNode *> &blocks) ;
+    void getAllDependencies(std::set<std::string> &deps) ;
 
     NamedBlockNode *findBlock(const std::string &name) ;
 
-    void throwException(const std::string &msg) override ;
+    [[noreturn]] void throwException(const std::string &msg) const override ;
+
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &c: children_ ) c->visitExpressions(v) ;
+    }
 
     virtual std::string tagName() const { return {} ; }
     virtual bool shouldClose() const { return true ; }
@@ -393,12 +561,17 @@ typedef std::shared_ptr<ContainerNode> ContainerNodePtr ;
 class LambdaNode: public Node {
 public:
 
-    LambdaNode(const identifier_list_t &args, NodePtr body): args_(args), body_(body) {}
+    LambdaNode(const identifier_list_t &args, NodePtr body): args_(args), body_(body), layout_({args.begin(), args.end()}) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override { v(body_) ; }
 private:
+    friend class Optimizer ;
+
     identifier_list_t args_ ;
     NodePtr body_ ;
+    SlotLayout layout_ ;
 };
 
 class TernaryOperatorNode: public Node {
@@ -408,30 +581,76 @@ public:
         condition_(condition), true_expr_(true_expr), false_expr_(false_expr) {}
 
     Variant eval(Context &ctx) ;
+
+    void visitOperands(const NodeVisitor &v) override {
+        v(condition_) ; v(true_expr_) ;
+        if ( false_expr_ ) v(false_expr_) ;
+    }
 private:
+    friend class ExpressionCompiler ;
+    friend class Optimizer ;
+
     NodePtr condition_, true_expr_, false_expr_ ;
 };
 
 typedef std::shared_ptr<LambdaNode> LambdaNodePtr ;
 
+// attribute of the loop variable of a for loop, computed on access from the counters of the current iteration
+
+class LoopAttributeNode: public Node {
+public:
+    enum Attribute { Index0, Index, RevIndex0, RevIndex, First, Last, Length } ;
+
+    LoopAttributeNode(const SlotLayout *layout, Attribute attr): layout_(layout), attr_(attr) {}
+
+    Variant eval(Context &ctx) ;
+
+    // attribute from its name, false if unknown
+    static bool parse(const std::string &name, Attribute &attr) ;
+
+private:
+    const SlotLayout *layout_ ; // identifies the frames of the loop
+    Attribute attr_ ;
+};
+
 class ForLoopBlockNode: public ContainerNode {
 public:
 
-    ForLoopBlockNode(identifier_list_t &&ids, NodePtr target, NodePtr cond = nullptr):
-        ids_(ids), target_(target), condition_(cond) {}
+    // How the loop variable is provided, decided by the optimizer from its uses in the body. By default it is an
+    // object built for every iteration. If the body only reads known attributes (loop.index etc.) these become
+    // LoopAttributeNode's reading the iteration counters, and if loop is not used at all nothing is stored.
+    enum LoopMode { LoopObject, LoopCounters, NoLoop } ;
+
+    // the counters follow the slots of the layout: index0 and length
+    static const size_t counter_slot = 3 ;
+
+    ForLoopBlockNode(identifier_list_t &&ids, NodePtr target, NodePtr cond = nullptr) ;
 
     void eval(Context &ctx, std::string &res) override ;
 
     std::string tagName() const override { return "for" ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        v(target_) ;
+        if ( condition_ ) v(condition_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     void startElseBlock() {
         else_child_start_ = children_.size() ;
     }
 
+    // runs the body for one element, counter counts from 0 up to size
+    void evalIteration(Context &ctx, std::string &res, Variant *slots, size_t counter, size_t size,
+                       const Variant &key, const Variant &value) ;
+    void evalElse(Context &ctx, std::string &res) ;
+
     int else_child_start_ = -1 ;
+    LoopMode loop_mode_ = LoopObject ;
 
     identifier_list_t ids_ ;
     NodePtr target_, condition_ ;
+    SlotLayout layout_ ; // loop followed by the loop variables
 };
 
 
@@ -468,6 +687,11 @@ public:
 
     void eval(Context &ctx, std::string &res) override ;
 
+    void visitExpressions(const NodeVisitor &v) override {
+        v(parent_resource_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     std::string tagName() const override { return "extends" ; }
     bool shouldClose() const override { return false ; }
 
@@ -482,6 +706,11 @@ public:
 
     void eval(Context &ctx, std::string &res) override ;
 
+    void visitExpressions(const NodeVisitor &v) override {
+        v(source_) ;
+        if ( with_ ) v(with_) ;
+    }
+
     NodePtr source_, with_ ;
     bool ignore_missing_, only_flag_ ;
 };
@@ -496,8 +725,18 @@ public:
     void eval(Context &ctx, std::string &res) override ;
     std::string tagName() const override { return "embed" ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        v(source_) ;
+        if ( with_ ) v(with_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
+    // collect the overriding blocks into a virtual child document of the embedded template
+    void populateBlocks() ;
+
     NodePtr source_, with_ ;
     bool ignore_missing_, only_flag_ ;
+    DocumentNodePtr overrides_ ;
 };
 
 class WithBlockNode: public ContainerNode {
@@ -510,6 +749,11 @@ public:
 
     std::string tagName() const override { return "with" ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        if ( with_ ) v(with_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     NodePtr with_ ;
     bool only_flag_ ;
 };
@@ -517,13 +761,14 @@ public:
 class AutoEscapeBlockNode: public ContainerNode {
 public:
 
-    AutoEscapeBlockNode(const std::string &mode): mode_(mode) {}
+    AutoEscapeBlockNode(EscapeMode mode): mode_(mode) {}
 
     void eval(Context &ctx, std::string &res) override ;
 
     std::string tagName() const override { return "autoescape" ; }
 
-    std::string mode_ ;
+    // applies to the substitutions parsed inside the block
+    EscapeMode mode_ ;
 };
 
 class VerbatimBlockNode: public ContainerNode {
@@ -547,6 +792,12 @@ public:
 
     std::string tagName() const override { return "if" ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &b: blocks_ )
+            if ( b.condition_ ) v(b.condition_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     void addBlock(NodePtr ptr) {
         if ( !blocks_.empty() ) {
             blocks_.back().cstop_ = children_.size() ;
@@ -568,15 +819,21 @@ class AssignmentBlockNode: public ContainerNode {
 public:
 
     AssignmentBlockNode(const identifier_list_t &names, const std::vector<NodePtr> &values): 
-    names_(names), values_(values) { }
+    values_(values), names_(names), layout_({names.begin(), names.end()}) { }
 
     void eval(Context &ctx, std::string &res) override ;
 
     std::string tagName() const override { return "set" ; }
     bool shouldClose() const override { return false ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &e: values_ ) v(e) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     std::vector<NodePtr> values_ ;
     identifier_list_t names_ ;
+    SlotLayout layout_ ;
 };
 
 class ApplyBlockNode: public ContainerNode {
@@ -589,37 +846,54 @@ public:
     std::string tagName() const override { return "apply" ; }
     bool shouldClose() const override { return true ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &f: filters_ )
+            for( auto &a: f->args_ ) v(a.value_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     std::vector<FilterNodePtr> filters_ ;
 };
 
 class FilterBlockNode: public ContainerNode {
 public:
 
-    FilterBlockNode(const std::string &name, arg_list_t &&args = {}): name_(name), args_(args) { }
+    FilterBlockNode(FilterNodePtr filter): filter_(filter) { }
 
     void eval(Context &ctx, std::string &res) override ;
 
     std::string tagName() const override { return "filter" ; }
 
-    std::string name_ ;
-    arg_list_t args_ ;
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &a: filter_->args_ ) v(a.value_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
+    FilterNodePtr filter_ ;
 };
 
 class MacroBlockNode: public ContainerNode {
 public:
 
-    MacroBlockNode(const std::string &name, key_val_list_t &&args): name_(name), args_(args) { }
+    MacroBlockNode(const std::string &name, key_val_list_t &&args) ;
 
     void eval(Context &ctx, std::string &res) override ;
 
     Variant call(Context &ctx, const Variant &args) ;
 
-    void mapArguments(const Variant &args, Context &ctx) ;
+    void mapArguments(const Variant &args, Context &ctx, Variant *slots) ;
 
     std::string tagName() const override { return "macro" ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        for( auto &a: args_ )
+            if ( a.second ) v(a.second) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     std::string name_ ;
     key_val_list_t args_ ;
+    SlotLayout layout_ ;
 };
 
 class ImportBlockNode: public ContainerNode {
@@ -634,6 +908,11 @@ public:
     std::string tagName() const override { return "import" ; }
     bool shouldClose() const override { return false ; }
 
+    void visitExpressions(const NodeVisitor &v) override {
+        if ( source_ ) v(source_) ;
+        ContainerNode::visitExpressions(v) ;
+    }
+
     bool mapMacro(MacroBlockNode &n, std::string &name) const ;
 
 
@@ -657,14 +936,15 @@ class SubstitutionBlockNode: public ContentNode {
 public:
     using Ptr = std::shared_ptr<SubstitutionBlockNode> ;
 
-    SubstitutionBlockNode(NodePtr expr):
-        expr_(expr) {}
+    SubstitutionBlockNode(NodePtr expr, EscapeMode mode):
+        expr_(expr), mode_(mode) {}
 
     void eval(Context &ctx, std::string &res) override;
 
-   
+    void visitExpressions(const NodeVisitor &v) override { v(expr_) ; }
 
     NodePtr expr_ ;
+    EscapeMode mode_ ;
 
 };
 
@@ -677,6 +957,9 @@ public:
 
     void eval(Context &ctx, std::string &res) override ;
 
+    // render the template with an optional document whose blocks override those of the inheritance chain (embed)
+    void render(Context &ctx, std::string &res, const DocumentNode *overrides) ;
+
      ExtensionBlockNode* findExtensionNode() const {
         for (const auto& node : children_) {
             if (auto extends_node = dynamic_cast<ExtensionBlockNode *>(node.get())) {
@@ -686,20 +969,31 @@ public:
         return nullptr; // This template doesn't inherit from anything
     }
 
-    NamedBlockNode *findBlock(const std::string &name) ;
+    NamedBlockNode *findBlock(const std::string &name) const ;
 
     void populateBlocks() ;
 
-    bool isChild() const { return parent_ != nullptr ; }
-    void setParentTemplate(DocumentNodePtr parent) {
-        parent_ = parent ;
-    }
-   
+    // collect the names of templates referenced by static extends, include, import and embed tags
+    void populateDependencies() ;
+
+    // compile the parent template when extended by a literal name; called once before the document is shared
+    void linkParent(TemplateRenderer &rdr) ;
+
+    // parent template of this document, either linked at compile time or evaluated from the extends expression
+    DocumentNodePtr resolveParent(Context &ctx) const ;
+
+    // moving average of the output size of recent renders, used to reserve the output buffer
+    size_t outputEstimate() const { return output_estimate_.load(std::memory_order_relaxed) ; }
+    void updateOutputEstimate(size_t size) ;
+
     std::map<std::string, ContentNodePtr> macro_blocks_ ;
     std::string resource_ ;
-    DocumentNodePtr parent_ ;
+    TemplateVersion version_ ; // of the source it was compiled from
+    DocumentNodePtr parent_tmpl_ ;
     std::vector<DocumentNode *> child_docs_ ;
     std::map<std::string, NamedBlockNode *> blocks_ ;
+    std::set<std::string> dependencies_ ;
+    std::atomic<size_t> output_estimate_{0} ;
 };
 
 typedef std::shared_ptr<DocumentNode> DocumentNodePtr ;
@@ -0,0 +1,256 @@
+#include "bytecode.hpp"
+
+#include <twig/exceptions.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+namespace {
+
+// registers of a running program; a register is only constructed when a value is computed into it, and the storage
+// is on the stack when the program uses few registers
+class Registers {
+public:
+    Registers(size_t n): n_(n) {
+        Storage *storage = local_ ;
+        refs_ = local_refs_ ;
+        live_ = local_live_ ;
+        if ( n > local_size ) {
+            heap_.reset(new Storage[n]) ;
+            heap_refs_.reset(new const Variant *[n]) ;
+            heap_live_.reset(new bool[n]) ;
+            storage = heap_.get() ;
+            refs_ = heap_refs_.get() ;
+            live_ = heap_live_.get() ;
+        }
+
+        vals_ = reinterpret_cast<Variant *>(storage) ;
+        std::fill(live_, live_ + n_, false) ;
+    }
+
+    ~Registers() {
+        for( size_t r = 0 ; r < n_ ; r++ )
+            if ( live_[r] ) vals_[r].~Variant() ;
+    }
+
+    const Variant &operator [] (uint16_t r) const { return *refs_[r] ; }
+
+    // the register may be an operand of the value, so it is only replaced once the value is computed
+    void set(uint16_t r, Variant &&v) {
+        if ( live_[r] ) vals_[r].~Variant() ;
+        new (&vals_[r]) Variant(std::move(v)) ;
+        live_[r] = true ;
+        refs_[r] = &vals_[r] ;
+    }
+
+    void refer(uint16_t r, const Variant *v) { refs_[r] = v ; }
+
+    Variant take(uint16_t r) {
+        return ( refs_[r] == &vals_[r] ) ? std::move(vals_[r]) : *refs_[r] ;
+    }
+
+private:
+    static const size_t local_size = 8 ;
+    using Storage = std::aligned_storage<sizeof(Variant), alignof(Variant)>::type ;
+
+    size_t n_ ;
+    Variant *vals_ ;
+    const Variant **refs_ ;
+    bool *live_ ;
+    Storage local_[local_size] ;
+    const Variant *local_refs_[local_size] ;
+    bool local_live_[local_size] ;
+    std::unique_ptr<Storage[]> heap_ ;
+    std::unique_ptr<const Variant *[]> heap_refs_ ;
+    std::unique_ptr<bool[]> heap_live_ ;
+};
+
+}
+
+Variant Program::run(Context &ctx) const {
+    static const Variant undefined, true_value(true), false_value(false) ;
+
+    Registers regs(registers_) ;
+
+    const Instruction *code = code_.data() ;
+
+    for( size_t pc = 0 ; ; ) {
+        const Instruction &i = code[pc++] ;
+
+        switch ( i.code_ ) {
+        case Instruction::LoadConst:
+            regs.refer(i.dst_, &constants_[i.index_]) ;
+            break ;
+        case Instruction::LoadVar:
+            regs.set(i.dst_, variables_[i.index_]->value(ctx)) ;
+            break ;
+        case Instruction::RefVar: {
+            const Variant *v = variables_[i.index_]->address(ctx) ;
+            regs.refer(i.dst_, v ? v : &undefined) ;
+            break ;
+        }
+        case Instruction::GetAttr:
+            regs.set(i.dst_, AttributeIndexingNode::apply(regs[i.lhs_], names_[i.index_], i.flag_)) ;
+            break ;
+        case Instruction::GetIndex:
+            regs.set(i.dst_, SubscriptIndexingNode::apply(regs[i.lhs_], regs[i.rhs_])) ;
+            break ;
+        case Instruction::Binary:
+            regs.set(i.dst_, BinaryOperator::apply((BinaryOperator::Type)i.flag_, regs[i.lhs_], regs[i.rhs_])) ;
+            break ;
+        case Instruction::Compare:
+            regs.set(i.dst_, ComparisonPredicate::apply((ComparisonPredicate::Type)i.flag_, regs[i.lhs_], regs[i.rhs_])) ;
+            break ;
+        case Instruction::Unary:
+            regs.set(i.dst_, UnaryOperator::apply((UnaryOperator::Type)i.flag_, regs[i.lhs_])) ;
+            break ;
+        case Instruction::Not:
+            regs.refer(i.dst_, regs[i.lhs_].toBoolean() ? &false_value : &true_value) ;
+            break ;
+        case Instruction::ToBool:
+            regs.refer(i.dst_, regs[i.lhs_].toBoolean() ? &true_value : &false_value) ;
+            break ;
+        case Instruction::Move:
+            regs.set(i.dst_, Variant(regs[i.lhs_])) ;
+            break ;
+        case Instruction::Jump:
+            pc = i.index_ ;
+            break ;
+        case Instruction::JumpIfFalse:
+            if ( !regs[i.lhs_].toBoolean() ) pc = i.index_ ;
+            break ;
+        case Instruction::JumpIfTrue:
+            if ( regs[i.lhs_].toBoolean() ) pc = i.index_ ;
+            break ;
+        case Instruction::Eval:
+            regs.set(i.dst_, nodes_[i.index_]->eval(ctx)) ;
+            break ;
+        case Instruction::Return:
+            return regs.take(i.lhs_) ;
+        }
+    }
+}
+
+void ExpressionCompiler::compile(NodePtr &expr) {
+    if ( !expr || dynamic_cast<CompiledExpressionNode *>(expr.get()) ) return ;
+
+    auto compiled = std::make_shared<CompiledExpressionNode>(expr) ;
+    Program &prog = compiled->program_ ;
+
+    ExpressionCompiler c(prog) ;
+    uint16_t r = c.allocate() ;
+    c.emit(expr.get(), r) ;
+    c.append(Instruction::Return, 0, r) ;
+
+    // nothing to gain for a single load or fallback; also keeps literals and plain identifiers visible to passes
+    // that inspect the tree (template names, function lookup)
+    if ( prog.code_.size() == 2 ) {
+        Instruction::Code code = prog.code_[0].code_ ;
+        if ( code == Instruction::LoadConst || code == Instruction::LoadVar || code == Instruction::Eval ) return ;
+    }
+
+    // without fallbacks nothing can assign to a variable while the program runs, so plain variables are referred to
+    if ( prog.nodes_.empty() ) {
+        for( Instruction &i: prog.code_ )
+            if ( i.code_ == Instruction::LoadVar ) i.code_ = Instruction::RefVar ;
+    }
+
+    expr = compiled ;
+}
+
+size_t ExpressionCompiler::append(Instruction::Code code, uint16_t dst, uint16_t lhs, uint16_t rhs, uint32_t index, uint8_t flag) {
+    prog_.code_.push_back(Instruction{code, flag, dst, lhs, rhs, index}) ;
+    return prog_.code_.size() - 1 ;
+}
+
+uint16_t ExpressionCompiler::allocate() {
+    if ( next_reg_ == UINT16_MAX ) throw TemplateCompileException("expression too complex") ;
+    uint16_t r = next_reg_++ ;
+    if ( next_reg_ > prog_.registers_ ) prog_.registers_ = next_reg_ ;
+    return r ;
+}
+
+uint32_t ExpressionCompiler::addName(const string &name) {
+    for( uint32_t i = 0 ; i < prog_.names_.size() ; i++ )
+        if ( prog_.names_[i] == name ) return i ;
+    prog_.names_.push_back(name) ;
+    return prog_.names_.size() - 1 ;
+}
+
+uint32_t ExpressionCompiler::addConstant(const Variant &v) {
+    prog_.constants_.push_back(v) ;
+    return prog_.constants_.size() - 1 ;
+}
+
+// generate code leaving the value of node in register dst; registers above dst are free to use
+void ExpressionCompiler::emit(Node *node, uint16_t dst) {
+
+    if ( LiteralNode *n = dynamic_cast<LiteralNode *>(node) ) {
+        append(Instruction::LoadConst, dst, 0, 0, addConstant(n->val_)) ;
+    } else if ( IdentifierNode *n = dynamic_cast<IdentifierNode *>(node) ) {
+        prog_.variables_.push_back(n) ;
+        append(Instruction::LoadVar, dst, 0, 0, prog_.variables_.size() - 1) ;
+    } else if ( AttributeIndexingNode *n = dynamic_cast<AttributeIndexingNode *>(node) ; n && !n->key_node_ ) {
+        emit(n->dict_.get(), dst) ;
+        append(Instruction::GetAttr, dst, dst, 0, addName(n->key_), n->except_on_null_) ;
+    } else if ( SubscriptIndexingNode *n = dynamic_cast<SubscriptIndexingNode *>(node) ) {
+        // the index is evaluated first as in the tree walker
+        emit(n->index_.get(), dst) ;
+        uint16_t r = allocate() ;
+        emit(n->array_.get(), r) ;
+        append(Instruction::GetIndex, dst, r, dst) ;
+        release(r) ;
+    } else if ( BinaryOperator *n = dynamic_cast<BinaryOperator *>(node) ) {
+        emit(n->lhs_.get(), dst) ;
+        uint16_t r = allocate() ;
+        emit(n->rhs_.get(), r) ;
+        append(Instruction::Binary, dst, dst, r, 0, n->op_) ;
+        release(r) ;
+    } else if ( ComparisonPredicate *n = dynamic_cast<ComparisonPredicate *>(node) ) {
+        emit(n->lhs_.get(), dst) ;
+        uint16_t r = allocate() ;
+        emit(n->rhs_.get(), r) ;
+        append(Instruction::Compare, dst, dst, r, 0, n->op_) ;
+        release(r) ;
+    } else if ( UnaryOperator *n = dynamic_cast<UnaryOperator *>(node) ) {
+        emit(n->rhs_.get(), dst) ;
+        append(Instruction::Unary, dst, dst, 0, 0, n->op_) ;
+    } else if ( BooleanNegationOperator *n = dynamic_cast<BooleanNegationOperator *>(node) ) {
+        emit(n->node_.get(), dst) ;
+        append(Instruction::Not, dst, dst) ;
+    } else if ( BooleanOperator *n = dynamic_cast<BooleanOperator *>(node) ) {
+        // short circuit: the result of the left operand decides unless it is true (and) or false (or)
+        emit(n->lhs_.get(), dst) ;
+        append(Instruction::ToBool, dst, dst) ;
+        size_t skip = append(n->op_ == BooleanOperator::And ? Instruction::JumpIfFalse : Instruction::JumpIfTrue, 0, dst) ;
+        emit(n->rhs_.get(), dst) ;
+        append(Instruction::ToBool, dst, dst) ;
+        prog_.code_[skip].index_ = prog_.code_.size() ;
+    } else if ( TernaryOperatorNode *n = dynamic_cast<TernaryOperatorNode *>(node) ) {
+        emit(n->condition_.get(), dst) ;
+        size_t to_false = append(Instruction::JumpIfFalse, 0, dst) ;
+        emit(n->true_expr_.get(), dst) ;
+        size_t to_end = append(Instruction::Jump, 0) ;
+        prog_.code_[to_false].index_ = prog_.code_.size() ;
+        if ( n->false_expr_ )
+            emit(n->false_expr_.get(), dst) ;
+        else
+            append(Instruction::LoadConst, dst, 0, 0, addConstant(Variant::null())) ;
+        prog_.code_[to_end].index_ = prog_.code_.size() ;
+    } else {
+        // evaluated by the tree walker, but its own operands may still be lowered
+        prog_.nodes_.push_back(node) ;
+        append(Instruction::Eval, dst, 0, 0, prog_.nodes_.size() - 1) ;
+        node->visitOperands([](NodePtr &e) { compile(e) ; }) ;
+    }
+}
+
+}
+}
@@ -0,0 +1,96 @@
+#ifndef TWIG_BYTECODE_HPP
+#define TWIG_BYTECODE_HPP
+
+#include "ast.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace twig {
+namespace detail {
+
+// Expressions lowered into a linear program for a register machine. Operators share their implementation with the
+// corresponding tree nodes so results are identical. Nodes that the compiler does not lower (filters, function
+// calls, lambdas etc.) are kept and evaluated by the tree walker from an Eval instruction.
+// A register either holds a value computed by the program or refers to a constant (booleans included) or a variable
+// of the context, so loading them does not copy. Variables are only referred to by programs without Eval instructions, which could
+// assign to them while the program runs.
+
+struct Instruction {
+    enum Code : uint8_t {
+        LoadConst,      // r[dst] refers to constants[index]
+        LoadVar,        // r[dst] = value of variables[index]
+        RefVar,         // r[dst] refers to the value of variables[index] in the context
+        GetAttr,        // r[dst] = r[lhs].names[index], flag = throw on non object
+        GetIndex,       // r[dst] = r[lhs][r[rhs]]
+        Binary,         // r[dst] = r[lhs] (flag) r[rhs]
+        Compare,        // r[dst] = r[lhs] (flag) r[rhs]
+        Unary,          // r[dst] = (flag) r[lhs]
+        Not,            // r[dst] = !r[lhs]
+        ToBool,         // r[dst] = bool(r[lhs])
+        Move,           // r[dst] = r[lhs]
+        Jump,           // pc = index
+        JumpIfFalse,    // if !r[lhs] pc = index
+        JumpIfTrue,     // if r[lhs] pc = index
+        Eval,           // r[dst] = nodes[index]->eval(ctx)
+        Return          // return r[lhs]
+    } ;
+
+    Code code_ ;
+    uint8_t flag_ ;
+    uint16_t dst_, lhs_, rhs_ ;
+    uint32_t index_ ;
+};
+
+class Program {
+public:
+    Variant run(Context &ctx) const ;
+
+    std::vector<Instruction> code_ ;
+    std::vector<Variant> constants_ ;
+    std::vector<std::string> names_ ;
+    std::vector<Node *> nodes_ ; // owned by the expression tree
+    std::vector<const IdentifierNode *> variables_ ; // likewise
+    uint16_t registers_ = 0 ;
+};
+
+// replaces an expression tree in the AST, keeping the original nodes alive for the fallbacks
+
+class CompiledExpressionNode: public Node {
+public:
+    CompiledExpressionNode(NodePtr source): source_(source) {}
+
+    Variant eval(Context &ctx) override { return program_.run(ctx) ; }
+
+    NodePtr source_ ;
+    Program program_ ;
+};
+
+class ExpressionCompiler {
+public:
+
+    // lower the expression in place; trivial expressions (a literal, a variable or a single fallback) are left
+    // as they are, but their operands are lowered
+    static void compile(NodePtr &expr) ;
+
+private:
+
+    ExpressionCompiler(Program &prog): prog_(prog) {}
+
+    void emit(Node *node, uint16_t dst) ;
+    size_t append(Instruction::Code code, uint16_t dst, uint16_t lhs = 0, uint16_t rhs = 0, uint32_t index = 0, uint8_t flag = 0) ;
+    uint16_t allocate() ;
+    void release(uint16_t r) { next_reg_ = r ; }
+    uint32_t addName(const std::string &name) ;
+    uint32_t addConstant(const Variant &v) ;
+
+    Program &prog_ ;
+    uint16_t next_reg_ = 0 ;
+    std::vector<NodePtr> fallbacks_ ;
+};
+
+}
+}
+
+#endif
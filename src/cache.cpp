@@ -0,0 +1,362 @@
+#include <twig/cache.hpp>
+#include <twig/exceptions.hpp>
+
+#include <functional>
+
+using namespace std ;
+
+namespace twig {
+
+static int64_t now_ticks() {
+    return chrono::steady_clock::now().time_since_epoch().count() ;
+}
+
+Cache::Cache(size_t max_entries, size_t max_size, size_t num_shards) {
+    if ( num_shards == 0 ) num_shards = 1 ;
+
+    for( size_t i=0 ; i<num_shards ; i++ )
+        shards_.emplace_back(new Shard) ;
+
+    // the bounds are split evenly between shards
+    max_entries_ = max_entries ? ( max_entries + num_shards - 1 ) / num_shards : 0 ;
+    max_size_ = max_size ? ( max_size + num_shards - 1 ) / num_shards : 0 ;
+}
+
+Cache::Shard &Cache::shard(const string &key) {
+    return *shards_[std::hash<string>()(key) % shards_.size()] ;
+}
+
+Cache::ItemPtr Cache::lookup(Shard &s, const string &key) {
+    shared_lock<shared_mutex> lock(s.guard_) ;
+
+    auto it = s.table_.find(key) ;
+    if ( it == s.table_.end() ) {
+        misses_.fetch_add(1, memory_order_relaxed) ;
+        return nullptr ;
+    }
+
+    hits_.fetch_add(1, memory_order_relaxed) ;
+    it->second->last_used_.store(s.clock_.fetch_add(1, memory_order_relaxed), memory_order_relaxed) ;
+    return it->second ;
+}
+
+Cache::Entry Cache::fetch(const string &key) {
+    ItemPtr item = lookup(shard(key), key) ;
+    return item ? item->val_ : nullptr ;
+}
+
+// lookup without touching the statistics or the recency of the entry
+Cache::ItemPtr Cache::peek(const string &key) {
+    Shard &s = shard(key) ;
+    shared_lock<shared_mutex> lock(s.guard_) ;
+    auto it = s.table_.find(key) ;
+    return ( it == s.table_.end() ) ? nullptr : it->second ;
+}
+
+// true if the entry is due for revalidation; only one of the threads accessing it concurrently gets to check it
+bool Cache::needsCheck(Item &item) {
+    int64_t interval = check_interval_.load(memory_order_relaxed) ;
+    if ( interval == 0 ) return false ;
+
+    int64_t now = now_ticks() ;
+    int64_t checked = item.checked_.load(memory_order_relaxed) ;
+    if ( now - checked < interval ) return false ;
+
+    return item.checked_.compare_exchange_strong(checked, now, memory_order_relaxed) ;
+}
+
+// check the source of an entry and of the cached templates it depends on, invalidating whatever has changed
+void Cache::revalidate(const string &key, const ItemPtr &item, const Validator &validator, set<string> &visited) {
+    if ( !visited.insert(key).second ) return ;
+
+    if ( !validator(key, item->version_) ) {
+        invalidate(key) ;
+        return ;
+    }
+
+    // a linked template may have been evicted or replaced since, so its version is checked against the source
+    for( const auto &lp: item->linked_ ) {
+        if ( !validator(lp.first, lp.second) ) {
+            invalidate(key) ;
+            return ;
+        }
+    }
+
+    for( const string &dep: item->dependencies_ ) {
+        if ( ItemPtr dep_item = peek(dep) )
+            revalidate(dep, dep_item, validator, visited) ;
+    }
+}
+
+Cache::Entry Cache::fetchOrAdd(const string &key, const Compiler &compiler, const Validator &validator) {
+    Shard &s = shard(key) ;
+
+    if ( ItemPtr item = lookup(s, key) ) {
+        if ( !validator || !needsCheck(*item) ) return item->val_ ;
+
+        set<string> visited ;
+        revalidate(key, item, validator, visited) ;
+
+        // still current unless it was invalidated, otherwise compile it again
+        if ( peek(key) == item ) return item->val_ ;
+    }
+
+    promise<Entry> leader ;
+
+    {
+        unique_lock<mutex> lock(s.flight_guard_) ;
+
+        auto it = s.in_flight_.find(key) ;
+        if ( it != s.in_flight_.end() ) {
+            thread::id self = this_thread::get_id() ;
+
+            {
+                // a template that (indirectly) extends or includes itself would wait on its own compilation, either
+                // directly or through threads compiling the templates in between
+                lock_guard<mutex> wlock(wait_guard_) ;
+
+                thread::id owner = it->second.owner_ ;
+                for( size_t n = 0 ; n <= waiting_.size() ; n++ ) {
+                    if ( owner == self )
+                        throw TemplateCompileException("Circular template reference: " + key) ;
+
+                    auto wit = waiting_.find(owner) ;
+                    if ( wit == waiting_.end() ) break ;
+                    auto oit = flight_owners_.find(wit->second) ;
+                    if ( oit == flight_owners_.end() ) break ;
+                    owner = oit->second ;
+                }
+
+                waiting_[self] = key ;
+            }
+
+            shared_future<Entry> result = it->second.result_ ;
+            lock.unlock() ;
+            result.wait() ;
+
+            {
+                lock_guard<mutex> wlock(wait_guard_) ;
+                waiting_.erase(self) ;
+            }
+
+            return result.get() ;
+        }
+
+        // it may have been added while we were waiting for the lock
+        if ( ItemPtr item = peek(key) ) return item->val_ ;
+
+        s.in_flight_.emplace(key, Flight{this_thread::get_id(), leader.get_future().share()}) ;
+
+        lock_guard<mutex> wlock(wait_guard_) ;
+        flight_owners_[key] = this_thread::get_id() ;
+    }
+
+    Entry val ;
+
+    try {
+        EntryInfo info ;
+        val = compiler(info) ;
+        add(key, val, info) ;
+    } catch ( ... ) {
+        leader.set_exception(current_exception()) ;
+        endFlight(s, key) ;
+        throw ;
+    }
+
+    leader.set_value(val) ;
+    endFlight(s, key) ;
+
+    return val ;
+}
+
+void Cache::endFlight(Shard &s, const string &key) {
+    lock_guard<mutex> lock(s.flight_guard_) ;
+    s.in_flight_.erase(key) ;
+
+    // the threads waiting for it are no longer blocked
+    lock_guard<mutex> wlock(wait_guard_) ;
+    flight_owners_.erase(key) ;
+    for( auto it = waiting_.begin() ; it != waiting_.end() ; ) {
+        if ( it->second == key ) it = waiting_.erase(it) ;
+        else ++it ;
+    }
+}
+
+void Cache::add(const string &key, const Entry &val, const EntryInfo &info) {
+    Shard &s = shard(key) ;
+
+    bool replaced = false ;
+
+    {
+        unique_lock<shared_mutex> lock(s.guard_) ;
+
+        ItemPtr item = make_shared<Item>(key, val, info, s.clock_.fetch_add(1, memory_order_relaxed), now_ticks()) ;
+
+        auto it = s.table_.find(key) ;
+        if ( it != s.table_.end() ) {
+            s.size_ -= it->second->size_ ;
+            unlink(key, *it->second) ;
+            dequeue(s, it->second.get()) ;
+            it->second = item ;
+            replaced = true ;
+        } else
+            s.table_.emplace(key, item) ;
+
+        s.size_ += item->size_ ;
+        link(key, *item) ;
+        enqueue(s, item.get()) ;
+
+        evict(s, item.get()) ;
+    }
+
+    // entries compiled against the replaced template are stale
+    if ( replaced ) invalidations_.fetch_add(removeDependents(key), memory_order_relaxed) ;
+}
+
+// remove key if it still maps to item (or unconditionally if item is null)
+bool Cache::remove(Shard &s, const string &key, const ItemPtr &item) {
+    unique_lock<shared_mutex> lock(s.guard_) ;
+
+    auto it = s.table_.find(key) ;
+    if ( it == s.table_.end() || ( item && it->second != item ) ) return false ;
+
+    erase(s, it) ;
+    return true ;
+}
+
+// called with the shard locked
+void Cache::erase(Shard &s, Table::iterator it) {
+    s.size_ -= it->second->size_ ;
+    unlink(it->first, *it->second) ;
+    dequeue(s, it->second.get()) ;
+    s.table_.erase(it) ;
+}
+
+void Cache::remove(const string &key) {
+    remove(shard(key), key, nullptr) ;
+}
+
+size_t Cache::invalidate(const string &key) {
+    size_t count = removeDependents(key) ;
+    if ( remove(shard(key), key, nullptr) ) ++count ;
+
+    invalidations_.fetch_add(count, memory_order_relaxed) ;
+    return count ;
+}
+
+size_t Cache::removeDependents(const string &key) {
+    size_t count = 0 ;
+    for( const string &k: dependents(key) ) {
+        if ( remove(shard(k), k, nullptr) ) ++count ;
+    }
+    return count ;
+}
+
+set<string> Cache::dependents(const string &key) const {
+    lock_guard<mutex> lock(graph_guard_) ;
+
+    set<string> res ;
+    vector<string> pending{key} ;
+
+    while ( !pending.empty() ) {
+        string k = std::move(pending.back()) ;
+        pending.pop_back() ;
+
+        auto it = dependents_.find(k) ;
+        if ( it == dependents_.end() ) continue ;
+
+        for( const string &d: it->second ) {
+            if ( d != key && res.insert(d).second ) pending.push_back(d) ;
+        }
+    }
+
+    return res ;
+}
+
+// add the edges of an entry to the reverse dependency graph
+void Cache::link(const string &key, const Item &item) {
+    lock_guard<mutex> lock(graph_guard_) ;
+    for( const string &dep: item.dependencies_ )
+        dependents_[dep].insert(key) ;
+}
+
+void Cache::unlink(const string &key, const Item &item) {
+    lock_guard<mutex> lock(graph_guard_) ;
+    for( const string &dep: item.dependencies_ ) {
+        auto it = dependents_.find(dep) ;
+        if ( it == dependents_.end() ) continue ;
+        it->second.erase(key) ;
+        if ( it->second.empty() ) dependents_.erase(it) ;
+    }
+}
+
+void Cache::clear() {
+    for( auto &s: shards_ ) {
+        unique_lock<shared_mutex> lock(s->guard_) ;
+        s->table_.clear() ;
+        s->oldest_ = s->newest_ = nullptr ;
+        s->size_ = 0 ;
+    }
+
+    lock_guard<mutex> lock(graph_guard_) ;
+    dependents_.clear() ;
+}
+
+void Cache::enqueue(Shard &s, Item *item) {
+    item->older_ = s.newest_ ;
+    item->newer_ = nullptr ;
+    if ( s.newest_ ) s.newest_->newer_ = item ;
+    else s.oldest_ = item ;
+    s.newest_ = item ;
+}
+
+void Cache::dequeue(Shard &s, Item *item) {
+    if ( item->older_ ) item->older_->newer_ = item->newer_ ;
+    else s.oldest_ = item->newer_ ;
+    if ( item->newer_ ) item->newer_->older_ = item->older_ ;
+    else s.newest_ = item->older_ ;
+    item->older_ = item->newer_ = nullptr ;
+}
+
+// drop least recently used entries until the shard is within bounds, called with the shard locked. An entry used
+// since it was queued gets a second chance at the tail, which happens at most once per lookup. So does the entry
+// just added, which is the most recently used one.
+void Cache::evict(Shard &s, const Item *added) {
+    bool spared = false ;
+
+    while ( s.table_.size() > 1 &&
+            ( ( max_entries_ && s.table_.size() > max_entries_ ) || ( max_size_ && s.size_ > max_size_ ) ) ) {
+
+        Item *victim = s.oldest_ ;
+        bool used = victim->last_used_.load(memory_order_relaxed) > victim->queued_ ;
+        if ( victim == added && !spared ) used = spared = true ;
+
+        if ( used ) {
+            dequeue(s, victim) ;
+            victim->queued_ = s.clock_.fetch_add(1, memory_order_relaxed) ;
+            enqueue(s, victim) ;
+            continue ;
+        }
+
+        erase(s, s.table_.find(victim->key_)) ;
+        evictions_.fetch_add(1, memory_order_relaxed) ;
+    }
+}
+
+Cache::Stats Cache::stats() const {
+    Stats st ;
+    st.hits_ = hits_.load(memory_order_relaxed) ;
+    st.misses_ = misses_.load(memory_order_relaxed) ;
+    st.evictions_ = evictions_.load(memory_order_relaxed) ;
+    st.invalidations_ = invalidations_.load(memory_order_relaxed) ;
+
+    for( auto &s: shards_ ) {
+        shared_lock<shared_mutex> lock(s->guard_) ;
+        st.entries_ += s->table_.size() ;
+        st.size_ += s->size_.load(memory_order_relaxed) ;
+    }
+
+    return st ;
+}
+
+}
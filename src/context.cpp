@@ -0,0 +1,26 @@
+#include <twig/context.hpp>
+
+#include <mutex>
+#include <unordered_map>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+// symbols are shared by all templates and never released
+Symbol intern(const string &name) {
+    static mutex guard ;
+    static unordered_map<string, Symbol> symbols ;
+
+    lock_guard<mutex> lock(guard) ;
+    return symbols.emplace(name, symbols.size()).first->second ;
+}
+
+SlotLayout::SlotLayout(const vector<string> &names): names_(names) {
+    for( const string &name: names )
+        symbols_.push_back(intern(name)) ;
+}
+
+}
+}
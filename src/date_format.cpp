@@ -0,0 +1,280 @@
+#include "date_format.hpp"
+
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+static const char *s_day_names[] = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday" } ;
+static const char *s_month_names[] = { "January", "February", "March", "April", "May", "June", "July", "August",
+                                       "September", "October", "November", "December" } ;
+
+DateFormat::DateFormat(const string &format) {
+    compile(format) ;
+}
+
+void DateFormat::add(Field f) {
+    items_.push_back(Item{f, 0, 0}) ;
+}
+
+// consecutive literal characters are merged in one item
+void DateFormat::addLiteral(char c) {
+    if ( items_.empty() || items_.back().field_ != Literal )
+        items_.push_back(Item{Literal, static_cast<uint32_t>(literals_.size()), 0}) ;
+    literals_.push_back(c) ;
+    items_.back().len_++ ;
+}
+
+void DateFormat::compile(const string &format) {
+    for( size_t i = 0 ; i < format.size() ; ++i ) {
+        char c = format[i] ;
+        switch ( c ) {
+        case 'd': add(DayPadded) ; break ;
+        case 'D': add(DayShortName) ; break ;
+        case 'j': add(Day) ; break ;
+        case 'l': add(DayName) ; break ;
+        case 'N': add(IsoWeekday) ; break ;
+        case 'S': add(DaySuffix) ; break ;
+        case 'w': add(Weekday) ; break ;
+        case 'z': add(DayOfYear) ; break ;
+        case 'F': add(MonthName) ; break ;
+        case 'm': add(MonthPadded) ; break ;
+        case 'M': add(MonthShortName) ; break ;
+        case 'n': add(Month) ; break ;
+        case 't': add(DaysInMonth) ; break ;
+        case 'L': add(LeapYear) ; break ;
+        case 'Y': add(Year) ; break ;
+        case 'y': add(Year2) ; break ;
+        case 'a': add(AmPmLower) ; break ;
+        case 'A': add(AmPmUpper) ; break ;
+        case 'g': add(Hour12) ; break ;
+        case 'G': add(Hour24) ; break ;
+        case 'h': add(Hour12Padded) ; break ;
+        case 'H': add(Hour24Padded) ; break ;
+        case 'i': add(Minutes) ; break ;
+        case 's': add(Seconds) ; break ;
+        case 'O': add(Offset) ; break ;
+        case 'P': add(OffsetColon) ; break ;
+        case 'T': add(ZoneAbbrev) ; break ;
+        case 'U': add(Timestamp) ; break ;
+        case 'c': compile("Y-m-d\\TH:i:sP") ; break ;
+        case 'r': compile("D, d M Y H:i:s O") ; break ;
+        case '\\':
+            if ( i + 1 < format.size() ) ++i ;
+            addLiteral(format[i]) ;
+            break ;
+        default:
+            addLiteral(c) ;
+        }
+    }
+}
+
+shared_ptr<const DateFormat> DateFormat::get(const string &format) {
+    static shared_mutex s_mutex ;
+    static unordered_map<string, shared_ptr<const DateFormat>> s_formats ;
+    // formats may be computed at run time, do not let the cache grow without bound
+    static const size_t s_max_formats = 256 ;
+
+    // a template usually formats many dates the same way
+    thread_local string t_last_format ;
+    thread_local shared_ptr<const DateFormat> t_last ;
+    if ( t_last && t_last_format == format ) return t_last ;
+
+    shared_ptr<const DateFormat> compiled ;
+    {
+        shared_lock<shared_mutex> lock(s_mutex) ;
+        auto it = s_formats.find(format) ;
+        if ( it != s_formats.end() ) compiled = it->second ;
+    }
+
+    if ( !compiled ) {
+        compiled = make_shared<const DateFormat>(format) ;
+        unique_lock<shared_mutex> lock(s_mutex) ;
+        if ( s_formats.size() < s_max_formats ) compiled = s_formats.emplace(format, compiled).first->second ;
+    }
+
+    t_last_format = format ;
+    t_last = compiled ;
+    return compiled ;
+}
+
+// Output staged in a small buffer and appended to the string in one go
+class Writer {
+public:
+    Writer(string &out): out_(out) {}
+    ~Writer() { out_.append(buf_, n_) ; }
+
+    // room for n more characters
+    void reserve(size_t n) {
+        if ( n_ + n > sizeof(buf_) ) {
+            out_.append(buf_, n_) ;
+            n_ = 0 ;
+        }
+    }
+
+    void append(const char *s, size_t n) {
+        if ( n > sizeof(buf_) ) {
+            reserve(sizeof(buf_)) ;
+            out_.append(s, n) ;
+            return ;
+        }
+        reserve(n) ;
+        memcpy(buf_ + n_, s, n) ;
+        n_ += n ;
+    }
+
+    void append(const char *s) { append(s, strlen(s)) ; }
+
+    void put(char c) {
+        reserve(1) ;
+        buf_[n_++] = c ;
+    }
+
+    void put2(int v) {
+        reserve(2) ;
+        buf_[n_++] = '0' + v / 10 % 10 ;
+        buf_[n_++] = '0' + v % 10 ;
+    }
+
+    void putInt(int64_t v, int min_digits) {
+        char digits[24] ;
+        int n = 0 ;
+        uint64_t u = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v) ;
+        do {
+            digits[n++] = '0' + u % 10 ;
+            u /= 10 ;
+        } while ( u || n < min_digits ) ;
+        reserve(n + 1) ;
+        if ( v < 0 ) buf_[n_++] = '-' ;
+        while ( n ) buf_[n_++] = digits[--n] ;
+    }
+
+    void putOffset(long offset, bool colon) {
+        put(offset < 0 ? '-' : '+') ;
+        if ( offset < 0 ) offset = -offset ;
+        put2(static_cast<int>(offset / 3600)) ;
+        if ( colon ) put(':') ;
+        put2(static_cast<int>(offset / 60 % 60)) ;
+    }
+
+private:
+    string &out_ ;
+    char buf_[64] ;
+    size_t n_ = 0 ;
+};
+
+static bool is_leap(int year) {
+    return ( year % 4 == 0 && year % 100 != 0 ) || year % 400 == 0 ;
+}
+
+void DateFormat::format(const std::tm &tm, int64_t t, string &res) const {
+    int year = tm.tm_year + 1900 ;
+    Writer out(res) ;
+
+    for( const Item &item: items_ ) {
+        switch ( item.field_ ) {
+        case Literal:
+            out.append(literals_.data() + item.pos_, item.len_) ;
+            break ;
+        case DayPadded:
+            out.put2(tm.tm_mday) ;
+            break ;
+        case DayShortName:
+            out.append(s_day_names[tm.tm_wday], 3) ;
+            break ;
+        case Day:
+            out.putInt(tm.tm_mday, 1) ;
+            break ;
+        case DayName:
+            out.append(s_day_names[tm.tm_wday]) ;
+            break ;
+        case IsoWeekday:
+            out.put('0' + ( tm.tm_wday == 0 ? 7 : tm.tm_wday )) ;
+            break ;
+        case DaySuffix: {
+            int d = tm.tm_mday ;
+            if ( d % 10 == 1 && d != 11 ) out.append("st", 2) ;
+            else if ( d % 10 == 2 && d != 12 ) out.append("nd", 2) ;
+            else if ( d % 10 == 3 && d != 13 ) out.append("rd", 2) ;
+            else out.append("th", 2) ;
+            break ;
+        }
+        case Weekday:
+            out.put('0' + tm.tm_wday) ;
+            break ;
+        case DayOfYear:
+            out.putInt(tm.tm_yday, 1) ;
+            break ;
+        case MonthName:
+            out.append(s_month_names[tm.tm_mon]) ;
+            break ;
+        case MonthPadded:
+            out.put2(tm.tm_mon + 1) ;
+            break ;
+        case MonthShortName:
+            out.append(s_month_names[tm.tm_mon], 3) ;
+            break ;
+        case Month:
+            out.putInt(tm.tm_mon + 1, 1) ;
+            break ;
+        case DaysInMonth: {
+            static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 } ;
+            out.put2(( tm.tm_mon == 1 && is_leap(year) ) ? 29 : days[tm.tm_mon]) ;
+            break ;
+        }
+        case LeapYear:
+            out.put(is_leap(year) ? '1' : '0') ;
+            break ;
+        case Year:
+            out.putInt(year, 4) ;
+            break ;
+        case Year2:
+            out.put2(( year % 100 + 100 ) % 100) ;
+            break ;
+        case AmPmLower:
+            out.append(tm.tm_hour < 12 ? "am" : "pm", 2) ;
+            break ;
+        case AmPmUpper:
+            out.append(tm.tm_hour < 12 ? "AM" : "PM", 2) ;
+            break ;
+        case Hour12:
+            out.putInt(( tm.tm_hour + 11 ) % 12 + 1, 1) ;
+            break ;
+        case Hour24:
+            out.putInt(tm.tm_hour, 1) ;
+            break ;
+        case Hour12Padded:
+            out.put2(( tm.tm_hour + 11 ) % 12 + 1) ;
+            break ;
+        case Hour24Padded:
+            out.put2(tm.tm_hour) ;
+            break ;
+        case Minutes:
+            out.put2(tm.tm_min) ;
+            break ;
+        case Seconds:
+            out.put2(tm.tm_sec) ;
+            break ;
+        case Offset:
+            out.putOffset(tm.tm_gmtoff, false) ;
+            break ;
+        case OffsetColon:
+            out.putOffset(tm.tm_gmtoff, true) ;
+            break ;
+        case ZoneAbbrev:
+            if ( tm.tm_zone ) out.append(tm.tm_zone) ;
+            break ;
+        case Timestamp:
+            out.putInt(t, 1) ;
+            break ;
+        }
+    }
+}
+
+}
+}
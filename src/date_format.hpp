@@ -0,0 +1,77 @@
+#ifndef TWIG_DATE_FORMAT_HPP
+#define TWIG_DATE_FORMAT_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace twig {
+namespace detail {
+
+// A PHP date() format string compiled into a list of fields, each written with integer formatting or a table
+// lookup. Names of days and months are English as in PHP.
+
+class DateFormat {
+public:
+
+    explicit DateFormat(const std::string &format) ;
+
+    // compiled form of the format, shared between calls; only a bounded number of formats is kept
+    static std::shared_ptr<const DateFormat> get(const std::string &format) ;
+
+    // append the broken down time tm of the timestamp t
+    void format(const std::tm &tm, int64_t t, std::string &out) const ;
+
+private:
+
+    enum Field : uint8_t {
+        Literal,
+        DayPadded,      // d
+        DayShortName,   // D
+        Day,            // j
+        DayName,        // l
+        IsoWeekday,     // N
+        DaySuffix,      // S
+        Weekday,        // w
+        DayOfYear,      // z
+        MonthName,      // F
+        MonthPadded,    // m
+        MonthShortName, // M
+        Month,          // n
+        DaysInMonth,    // t
+        LeapYear,       // L
+        Year,           // Y
+        Year2,          // y
+        AmPmLower,      // a
+        AmPmUpper,      // A
+        Hour12,         // g
+        Hour24,         // G
+        Hour12Padded,   // h
+        Hour24Padded,   // H
+        Minutes,        // i
+        Seconds,        // s
+        Offset,         // O
+        OffsetColon,    // P
+        ZoneAbbrev,     // T
+        Timestamp       // U
+    };
+
+    struct Item {
+        Field field_ ;
+        uint32_t pos_, len_ ; // literal text in literals_
+    };
+
+    void compile(const std::string &format) ;
+    void add(Field f) ;
+    void addLiteral(char c) ;
+
+    std::vector<Item> items_ ;
+    std::string literals_ ;
+};
+
+}
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include <twig/date_helpers.hpp>
 
+#include "timezone.hpp"
+
 #include <algorithm>
 #include <cctype>
 #include <chrono>
@@ -7,7 +9,6 @@
 #include <cstring>
 #include <ctime>
 #include <map>
-#include <regex>
 #include <sstream>
 #include <iomanip>
 #include <stdexcept>
@@ -80,51 +81,50 @@ bool parse_fixed_date_formats(const std::string &src, std::tm &tm) {
     return false ;
 }
 
-static bool is_iana_timezone(const std::string &tz) {
-    static const std::regex iana_re(R"(^[A-Za-z_]+/[A-Za-z0-9_]+(?:/[A-Za-z0-9_]+)?$)") ;
-    return std::regex_match(tz, iana_re) ;
-}
-
-static int64_t mktime_with_tz(std::tm &tm, const std::string &tz) {
-    tm.tm_isdst = -1 ;
-    if ( tz.empty() ) {
-        return static_cast<int64_t>(std::mktime(&tm)) ;
-    }
+// YYYY-MM-DD with optional HH:MM[:SS] after a space or T, the common case parsed without strptime
+static bool parse_iso_date(const std::string &src, std::tm &tm) {
+    const char *p = src.c_str() ;
 
-    if ( is_iana_timezone(tz) ) {
-        const char *original_tz = std::getenv("TZ") ;
-        std::string saved_tz = original_tz ? original_tz : "" ;
-        if ( setenv("TZ", tz.c_str(), 1) != 0 )
-            return -1 ;
-        tzset() ;
-        int64_t result = static_cast<int64_t>(std::mktime(&tm)) ;
-        if ( saved_tz.empty() )
-            unsetenv("TZ") ;
-        else
-            setenv("TZ", saved_tz.c_str(), 1) ;
-        tzset() ;
-        return result ;
+    auto number = [&](int digits, int &v) {
+        v = 0 ;
+        for( int i = 0 ; i < digits ; i++, p++ ) {
+            if ( *p < '0' || *p > '9' ) return false ;
+            v = v * 10 + ( *p - '0' ) ;
+        }
+        return true ;
+    } ;
+
+    int year, month, day, hour = 0, minute = 0, second = 0 ;
+    if ( !number(4, year) || *p++ != '-' || !number(2, month) || *p++ != '-' || !number(2, day) ) return false ;
+    if ( *p == ' ' || *p == 'T' ) {
+        ++p ;
+        if ( !number(2, hour) || *p++ != ':' || !number(2, minute) ) return false ;
+        if ( *p == ':' ) {
+            ++p ;
+            if ( !number(2, second) ) return false ;
+        }
     }
+    if ( *p != '\0' ) return false ;
+    if ( month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 61 ) return false ;
+
+    std::memset(&tm, 0, sizeof(tm)) ;
+    tm.tm_year = year - 1900 ;
+    tm.tm_mon = month - 1 ;
+    tm.tm_mday = day ;
+    tm.tm_hour = hour ;
+    tm.tm_min = minute ;
+    tm.tm_sec = second ;
+    tm.tm_isdst = -1 ;
+    return true ;
+}
 
-    int offset_seconds ;
-    if ( !parse_timezone_offset(tz, offset_seconds) )
-        return -1 ;
-
-    const char *original_tz = std::getenv("TZ") ;
-    std::string saved_tz = original_tz ? original_tz : "" ;
-    if ( setenv("TZ", "UTC", 1) != 0 )
-        return -1 ;
-    tzset() ;
-    int64_t result = static_cast<int64_t>(std::mktime(&tm)) ;
-    if ( saved_tz.empty() )
-        unsetenv("TZ") ;
-    else
-        setenv("TZ", saved_tz.c_str(), 1) ;
-    tzset() ;
-    return result - offset_seconds ;
+static int64_t mktime_with_tz(std::tm &tm, const std::string &tz) {
+    const detail::TimeZone *zone = detail::TimeZone::get(tz) ;
+    if ( !zone ) return -1 ;
+    return zone->fromLocal(tm) ;
 }
 
-bool apply_relative_offset(int64_t &base_s, int64_t amount, const std::string &unit) {
+bool apply_relative_offset(int64_t &base_s, int64_t amount, const std::string &unit, const std::string &tz) {
     auto tp = std::chrono::system_clock::time_point(std::chrono::seconds(base_s)) ;
     std::string lower_unit = to_lower_copy(unit) ;
 
@@ -138,23 +138,17 @@ bool apply_relative_offset(int64_t &base_s, int64_t amount, const std::string &u
         tp += std::chrono::hours(amount * 24) ;
     } else if ( lower_unit == "week" || lower_unit == "weeks" ) {
         tp += std::chrono::hours(amount * 24 * 7) ;
-    } else if ( lower_unit == "month" || lower_unit == "months" ) {
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()) ;
-        std::time_t base = static_cast<std::time_t>(seconds.count()) ;
-        std::tm tm = *std::localtime(&base) ;
-        tm.tm_mon += static_cast<int>(amount) ;
-        tm.tm_isdst = -1 ;
-        base = std::mktime(&tm) ;
-        base_s = static_cast<int64_t>(base) ;
-        return true ;
-    } else if ( lower_unit == "year" || lower_unit == "years" ) {
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()) ;
-        std::time_t base = static_cast<std::time_t>(seconds.count()) ;
-        std::tm tm = *std::localtime(&base) ;
-        tm.tm_year += static_cast<int>(amount) ;
-        tm.tm_isdst = -1 ;
-        base = std::mktime(&tm) ;
-        base_s = static_cast<int64_t>(base) ;
+    } else if ( lower_unit == "month" || lower_unit == "months" || lower_unit == "year" || lower_unit == "years" ) {
+        // calendar arithmetic in the local time of the zone
+        const detail::TimeZone *zone = detail::TimeZone::get(tz) ;
+        if ( !zone ) return false ;
+        std::tm tm ;
+        zone->toLocal(base_s, tm) ;
+        if ( lower_unit[0] == 'm' )
+            tm.tm_mon += static_cast<int>(amount) ;
+        else
+            tm.tm_year += static_cast<int>(amount) ;
+        base_s = zone->fromLocal(tm) ;
         return true ;
     } else {
         return false ;
@@ -177,60 +171,33 @@ bool parse_timezone_offset(const std::string &tz, int &offset_seconds) {
         return true ;
     }
 
-    // Try numeric offset format: +05:30, -08:00, +0530, etc.
-    std::regex offset_re(R"(^([+-]?)(\d{1,2})(?::?(\d{2}))?$)") ;
-    std::smatch match ;
-    if ( std::regex_match(tz, match, offset_re) ) {
-        int sign = (match[1].str() == "-") ? -1 : 1 ;
-        int hours = std::stoi(match[2].str()) ;
-        int minutes = match[3].matched ? std::stoi(match[3].str()) : 0 ;
-        offset_seconds = sign * (hours * 3600 + minutes * 60) ;
-        return true ;
-    }
+    // numeric offsets (+05:30, -08:00, +0530) or IANA names, whose offset is the current one
+    const detail::TimeZone *zone = detail::TimeZone::get(tz) ;
+    if ( !zone ) return false ;
+    offset_seconds = zone->offset(static_cast<int64_t>(std::time(nullptr))) ;
+    return true ;
+}
+
+// "[+-]N unit[s]" with unit one of second, minute, hour, day, week, month, year; s is lower case
+static bool parse_relative_offset(const std::string &s, std::string &amount, std::string &unit) {
+    static const char *units[] = { "second", "minute", "hour", "day", "week", "month", "year" } ;
 
-    // Try IANA timezone format: Continent/City, Region/Timezone
-    std::regex iana_re(R"(^[A-Za-z_]+/[A-Za-z0-9_]+(?:/[A-Za-z0-9_]+)?$)") ;
-    if ( std::regex_match(tz, iana_re) ) {
-        // Save original TZ
-        const char *original_tz = std::getenv("TZ") ;
-        std::string saved_tz = original_tz ? original_tz : "" ;
-
-        // Set TZ to the IANA timezone and recalculate
-        if ( setenv("TZ", tz.c_str(), 1) == 0 ) {
-            tzset() ;
-
-            // Get current time and compute offset
-            std::time_t now = std::time(nullptr) ;
-            std::tm *tm_local = std::localtime(&now) ;
-            std::tm *tm_utc = std::gmtime(&now) ;
-
-            if ( tm_local && tm_utc ) {
-                // Calculate offset in seconds
-                std::time_t local_t = std::mktime(tm_local) ;
-                // Note: mktime converts to UTC, so we need the raw offset
-                offset_seconds = static_cast<int>(tm_local->tm_gmtoff) ;
-
-                // Restore original TZ
-                if ( saved_tz.empty() ) {
-                    unsetenv("TZ") ;
-                } else {
-                    setenv("TZ", saved_tz.c_str(), 1) ;
-                }
-                tzset() ;
-
-                return true ;
-            }
-
-            // Restore original TZ on error
-            if ( saved_tz.empty() ) {
-                unsetenv("TZ") ;
-            } else {
-                setenv("TZ", saved_tz.c_str(), 1) ;
-            }
-            tzset() ;
+    size_t i = ( !s.empty() && ( s[0] == '+' || s[0] == '-' ) ) ? 1 : 0 ;
+    size_t digits = i ;
+    while ( i < s.size() && isdigit((unsigned char)s[i]) ) ++i ;
+    if ( i == digits ) return false ;
+    amount = s.substr(0, i) ;
+
+    while ( i < s.size() && isspace((unsigned char)s[i]) ) ++i ;
+
+    std::string word = s.substr(i) ;
+    if ( word.size() > 1 && word.back() == 's' ) word.pop_back() ;
+    for( const char *u: units ) {
+        if ( word == u ) {
+            unit = word ;
+            return true ;
         }
     }
-
     return false ;
 }
 
@@ -240,102 +207,19 @@ int64_t strtotime(const std::string &src, const std::string &tz) {
         return static_cast<int64_t>(std::time(nullptr)) ;
 
    
-    if ( lower_src == "today" ) {
-        auto now = std::time(nullptr) ;
-        std::tm tm ;
-        if ( tz.empty() || !is_iana_timezone(tz) ) {
-            int offset_seconds = 0 ;
-            if ( !tz.empty() && parse_timezone_offset(tz, offset_seconds) && !is_iana_timezone(tz) ) {
-                std::time_t adjusted = now + offset_seconds ;
-                tm = *std::gmtime(&adjusted) ;
-            } else {
-                tm = *std::localtime(&now) ;
-            }
-        } else {
-            const char *original_tz = std::getenv("TZ") ;
-            std::string saved_tz = original_tz ? original_tz : "" ;
-            setenv("TZ", tz.c_str(), 1) ;
-            tzset() ;
-            tm = *std::localtime(&now) ;
-            if ( saved_tz.empty() )
-                unsetenv("TZ") ;
-            else
-                setenv("TZ", saved_tz.c_str(), 1) ;
-            tzset() ;
-        }
-        tm.tm_hour = 0 ;
-        tm.tm_min = 0 ;
-        tm.tm_sec = 0 ;
-        int64_t result = mktime_with_tz(tm, tz) ;
-        if ( result < 0 )
-            throw std::runtime_error("Failed to parse date string: " + src) ;
-        return result ;
-    }
-
-    if ( lower_src == "tomorrow" ) {
-        auto now = std::time(nullptr) ;
-        std::tm tm ;
-        if ( tz.empty() || !is_iana_timezone(tz) ) {
-            int offset_seconds = 0 ;
-            if ( !tz.empty() && parse_timezone_offset(tz, offset_seconds) && !is_iana_timezone(tz) ) {
-                std::time_t adjusted = now + offset_seconds ;
-                tm = *std::gmtime(&adjusted) ;
-            } else {
-                tm = *std::localtime(&now) ;
-            }
-        } else {
-            const char *original_tz = std::getenv("TZ") ;
-            std::string saved_tz = original_tz ? original_tz : "" ;
-            setenv("TZ", tz.c_str(), 1) ;
-            tzset() ;
-            tm = *std::localtime(&now) ;
-            if ( saved_tz.empty() )
-                unsetenv("TZ") ;
-            else
-                setenv("TZ", saved_tz.c_str(), 1) ;
-            tzset() ;
-        }
-        tm.tm_mday += 1 ;
-        tm.tm_hour = 0 ;
-        tm.tm_min = 0 ;
-        tm.tm_sec = 0 ;
-        int64_t result = mktime_with_tz(tm, tz) ;
-        if ( result < 0 )
+    if ( lower_src == "today" || lower_src == "tomorrow" || lower_src == "yesterday" ) {
+        const detail::TimeZone *zone = detail::TimeZone::get(tz) ;
+        if ( !zone )
             throw std::runtime_error("Failed to parse date string: " + src) ;
-        return result ;
-    }
 
-    if ( lower_src == "yesterday" ) {
-        auto now = std::time(nullptr) ;
         std::tm tm ;
-        if ( tz.empty() || !is_iana_timezone(tz) ) {
-            int offset_seconds = 0 ;
-            if ( !tz.empty() && parse_timezone_offset(tz, offset_seconds) && !is_iana_timezone(tz) ) {
-                std::time_t adjusted = now + offset_seconds ;
-                tm = *std::gmtime(&adjusted) ;
-            } else {
-                tm = *std::localtime(&now) ;
-            }
-        } else {
-            const char *original_tz = std::getenv("TZ") ;
-            std::string saved_tz = original_tz ? original_tz : "" ;
-            setenv("TZ", tz.c_str(), 1) ;
-            tzset() ;
-            tm = *std::localtime(&now) ;
-            if ( saved_tz.empty() )
-                unsetenv("TZ") ;
-            else
-                setenv("TZ", saved_tz.c_str(), 1) ;
-            tzset() ;
-        }
-        tm.tm_mday -= 1 ;
+        zone->toLocal(static_cast<int64_t>(std::time(nullptr)), tm) ;
+        if ( lower_src == "tomorrow" ) tm.tm_mday += 1 ;
+        else if ( lower_src == "yesterday" ) tm.tm_mday -= 1 ;
         tm.tm_hour = 0 ;
         tm.tm_min = 0 ;
         tm.tm_sec = 0 ;
-        int64_t result = mktime_with_tz(tm, tz) ;
-        if ( result < 0 )
-            throw std::runtime_error("Failed to parse date string: " + src) ;
-        return result ;
+        return zone->fromLocal(tm) ;
     }
 
     bool all_digits = !src.empty() && (std::all_of(src.begin(), src.end(), ::isdigit) || (src[0] == '-' && src.size() > 1 && std::all_of(src.begin() + 1, src.end(), ::isdigit)));
@@ -347,26 +231,26 @@ int64_t strtotime(const std::string &src, const std::string &tz) {
     }
 
     std::tm tm = {} ;
-    if ( parse_fixed_date_formats(src, tm) ) {
+    if ( parse_iso_date(src, tm) || parse_fixed_date_formats(src, tm) ) {
         int64_t result = mktime_with_tz(tm, tz) ;
         if ( result >= 0 )
             return result ;
     }
 
-    std::regex rel_re(R"(^([+-]?\d+)\s*(second|minute|hour|day|week|month|year)s?$)", std::regex::icase) ;
-    std::smatch match ;
-    if ( std::regex_match(lower_src, match, rel_re) ) {
+    std::string amount, unit ;
+    if ( parse_relative_offset(lower_src, amount, unit) ) {
         int64_t base_s = static_cast<int64_t>(std::time(nullptr)) ;
-        int64_t value = std::stoll(match[1].str()) ;
-        if ( apply_relative_offset(base_s, value, match[2].str()) )
+        int64_t value = std::stoll(amount) ;
+        if ( apply_relative_offset(base_s, value, unit, tz) )
             return base_s ;
     }
 
     std::istringstream in(src) ;
     in >> std::get_time(&tm, "%Y-%m-%d %H:%M:%S") ;
     if ( !in.fail() ) {
-        tm.tm_isdst = -1 ;
-        return static_cast<int64_t>(std::mktime(&tm)) ;
+        int64_t result = mktime_with_tz(tm, tz) ;
+        if ( result >= 0 )
+            return result ;
     }
 
     throw std::runtime_error("Failed to parse date string: " + src) ;
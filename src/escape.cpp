@@ -0,0 +1,492 @@
+#include "escape.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// the AVX2 kernels are compiled for the target regardless of the build flags and only used if the CPU supports them
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#include <immintrin.h>
+#define TWIG_ESCAPE_AVX2
+#endif
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+static constexpr bool is_alnum(int c) {
+    return ( c >= '0' && c <= '9' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ;
+}
+
+// characters that need escaping per strategy
+struct CharClass {
+    bool html_[256] = {} ;
+    bool js_[256] = {} ;
+    bool css_[256] = {} ;
+    bool url_[256] = {} ;
+    bool html_attr_[256] = {} ;
+
+    constexpr CharClass() {
+        for( const char *p = "&\"'<>" ; *p ; ++p ) html_[(unsigned char)*p] = true ;
+        for( int c = 0 ; c < 0x20 ; c++ ) js_[c] = true ;
+        for( const char *p = "\\\"'/\x7f" ; *p ; ++p ) js_[(unsigned char)*p] = true ;
+
+        for( int c = 0 ; c < 256 ; c++ ) {
+            css_[c] = !is_alnum(c) ;
+            url_[c] = !is_alnum(c) && c != '-' && c != '_' && c != '.' && c != '~' ;
+            html_attr_[c] = !is_alnum(c) && c != ',' && c != '-' && c != '.' && c != '_' ;
+        }
+    }
+};
+
+static constexpr CharClass s_class ;
+
+// Output staged in a small buffer, so that short clean runs and escape sequences are not appended to the string one
+// by one. Long runs go to the string directly.
+
+class Buffer {
+public:
+    Buffer(string &out): out_(out) {}
+    ~Buffer() { flush() ; }
+
+    void append(const char *s, size_t n) {
+        if ( n_ + n > sizeof(buf_) ) {
+            flush() ;
+            if ( n > sizeof(buf_) / 2 ) {
+                out_.append(s, n) ;
+                return ;
+            }
+        }
+        memcpy(buf_ + n_, s, n) ;
+        n_ += n ;
+    }
+
+    void push_back(char c) {
+        if ( n_ == sizeof(buf_) ) flush() ;
+        buf_[n_++] = c ;
+    }
+
+    // upper case hex digits of v, at least min_digits
+    void appendHex(uint32_t v, int min_digits) {
+        char digits[8] ;
+        int n = 0 ;
+        do {
+            digits[n++] = "0123456789ABCDEF"[v & 0xF] ;
+            v >>= 4 ;
+        } while ( v || n < min_digits ) ;
+        while ( n ) push_back(digits[--n]) ;
+    }
+
+    void flush() {
+        out_.append(buf_, n_) ;
+        n_ = 0 ;
+    }
+
+private:
+    string &out_ ;
+    char buf_[512] ;
+    size_t n_ = 0 ;
+};
+
+// code point of the UTF-8 sequence at p, returns its length; invalid sequences decode to U+FFFD one byte at a time
+static size_t decode_utf8(const unsigned char *p, size_t n, uint32_t &cp) {
+    unsigned char c = p[0] ;
+    size_t len ;
+    if ( c < 0x80 ) { cp = c ; return 1 ; }
+    else if ( ( c & 0xE0 ) == 0xC0 ) { cp = c & 0x1F ; len = 2 ; }
+    else if ( ( c & 0xF0 ) == 0xE0 ) { cp = c & 0x0F ; len = 3 ; }
+    else if ( ( c & 0xF8 ) == 0xF0 ) { cp = c & 0x07 ; len = 4 ; }
+    else { cp = 0xFFFD ; return 1 ; }
+
+    if ( len > n ) { cp = 0xFFFD ; return 1 ; }
+
+    for( size_t i = 1 ; i < len ; i++ ) {
+        if ( ( p[i] & 0xC0 ) != 0x80 ) { cp = 0xFFFD ; return 1 ; }
+        cp = ( cp << 6 ) | ( p[i] & 0x3F ) ;
+    }
+    return len ;
+}
+
+// vector character classes
+
+#if defined(__SSE2__)
+
+static inline __m128i eq_sse2(__m128i x, char c) {
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c)) ;
+}
+
+// unsigned lo <= x <= hi
+static inline __m128i range_sse2(__m128i x, unsigned char lo, unsigned char hi) {
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo)) ;
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(hi - lo)), d) ;
+}
+
+static inline __m128i alnum_sse2(__m128i x) {
+    return _mm_or_si128(range_sse2(x, '0', '9'), _mm_or_si128(range_sse2(x, 'A', 'Z'), range_sse2(x, 'a', 'z'))) ;
+}
+
+static inline __m128i not_sse2(__m128i x) {
+    return _mm_xor_si128(x, _mm_set1_epi8(-1)) ;
+}
+
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+
+__attribute__((target("avx2")))
+static inline __m256i eq_avx2(__m256i x, char c) {
+    return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c)) ;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i range_avx2(__m256i x, unsigned char lo, unsigned char hi) {
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo)) ;
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(hi - lo)), d) ;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i alnum_avx2(__m256i x) {
+    return _mm256_or_si256(range_avx2(x, '0', '9'), _mm256_or_si256(range_avx2(x, 'A', 'Z'), range_avx2(x, 'a', 'z'))) ;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i not_avx2(__m256i x) {
+    return _mm256_xor_si256(x, _mm256_set1_epi8(-1)) ;
+}
+
+#endif
+
+// Each strategy provides the table of characters to escape, how to write them and the vector tests locating them.
+// write() escapes the character starting at src[pos] and returns the number of bytes consumed.
+// The kernels keep the start of the pending clean run and only copy it when reaching a character to escape (or the
+// end), so clean text is copied in one go whatever the block size.
+
+struct HtmlSpec {
+    static constexpr const bool *table() { return s_class.html_ ; }
+
+    static size_t write(const char *src, size_t pos, size_t, Buffer &out) {
+        switch ( src[pos] ) {
+        case '&':  out.append("&amp;", 5) ; break ;
+        case '"':  out.append("&quot;", 6) ; break ;
+        case '\'': out.append("&apos;", 6) ; break ;
+        case '<':  out.append("&lt;", 4) ; break ;
+        case '>':  out.append("&gt;", 4) ; break ;
+        default:   out.push_back(src[pos]) ; break ;
+        }
+        return 1 ;
+    }
+
+#if defined(__SSE2__)
+    static __m128i special(__m128i x) {
+        return _mm_or_si128(_mm_or_si128(eq_sse2(x, '&'), eq_sse2(x, '"')),
+                            _mm_or_si128(eq_sse2(x, '\''), _mm_or_si128(eq_sse2(x, '<'), eq_sse2(x, '>')))) ;
+    }
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+    __attribute__((target("avx2")))
+    static __m256i special(__m256i x) {
+        return _mm256_or_si256(_mm256_or_si256(eq_avx2(x, '&'), eq_avx2(x, '"')),
+                               _mm256_or_si256(eq_avx2(x, '\''), _mm256_or_si256(eq_avx2(x, '<'), eq_avx2(x, '>')))) ;
+    }
+#endif
+};
+
+struct JsSpec {
+    static constexpr const bool *table() { return s_class.js_ ; }
+
+    static size_t write(const char *src, size_t pos, size_t, Buffer &out) {
+        unsigned char c = src[pos] ;
+        switch ( c ) {
+        case '\\': out.append("\\\\", 2) ; break ;
+        case '"':  out.append("\\\"", 2) ; break ;
+        case '\'': out.append("\\'", 2) ; break ;
+        case '\n': out.append("\\n", 2) ; break ;
+        case '\r': out.append("\\r", 2) ; break ;
+        case '\t': out.append("\\t", 2) ; break ;
+        case '\b': out.append("\\b", 2) ; break ;
+        case '\f': out.append("\\f", 2) ; break ;
+        case '/':  out.append("\\/", 2) ; break ;  // prevents </script> injection
+        case '\0': out.append("\\0", 2) ; break ;
+        default: {
+            // other control characters and DEL
+            const char *digits = "0123456789abcdef" ;
+            char hex[4] = { '\\', 'x', digits[c >> 4], digits[c & 0xF] } ;
+            out.append(hex, 4) ;
+        }
+        }
+        return 1 ;
+    }
+
+    // control characters, quotes, backslash, slash and DEL
+#if defined(__SSE2__)
+    static __m128i special(__m128i x) {
+        return _mm_or_si128(_mm_or_si128(range_sse2(x, 0, 0x1f), eq_sse2(x, '\\')),
+                            _mm_or_si128(_mm_or_si128(eq_sse2(x, '"'), eq_sse2(x, '\'')),
+                                         _mm_or_si128(eq_sse2(x, '/'), eq_sse2(x, 0x7f)))) ;
+    }
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+    __attribute__((target("avx2")))
+    static __m256i special(__m256i x) {
+        return _mm256_or_si256(_mm256_or_si256(range_avx2(x, 0, 0x1f), eq_avx2(x, '\\')),
+                               _mm256_or_si256(_mm256_or_si256(eq_avx2(x, '"'), eq_avx2(x, '\'')),
+                                               _mm256_or_si256(eq_avx2(x, '/'), eq_avx2(x, 0x7f)))) ;
+    }
+#endif
+};
+
+// anything but alphanumerics as \HEX followed by a space, non ASCII characters by code point
+struct CssSpec {
+    static constexpr const bool *table() { return s_class.css_ ; }
+
+    static size_t write(const char *src, size_t pos, size_t len, Buffer &out) {
+        uint32_t cp ;
+        size_t n = decode_utf8(reinterpret_cast<const unsigned char *>(src) + pos, len - pos, cp) ;
+        out.push_back('\\') ;
+        out.appendHex(cp, 1) ;
+        out.push_back(' ') ;
+        return n ;
+    }
+
+#if defined(__SSE2__)
+    static __m128i special(__m128i x) {
+        return not_sse2(alnum_sse2(x)) ;
+    }
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+    __attribute__((target("avx2")))
+    static __m256i special(__m256i x) {
+        return not_avx2(alnum_avx2(x)) ;
+    }
+#endif
+};
+
+// percent encoding of every byte but the unreserved characters of RFC 3986 (as PHP rawurlencode)
+struct UrlSpec {
+    static constexpr const bool *table() { return s_class.url_ ; }
+
+    static size_t write(const char *src, size_t pos, size_t, Buffer &out) {
+        out.push_back('%') ;
+        out.appendHex((unsigned char)src[pos], 2) ;
+        return 1 ;
+    }
+
+#if defined(__SSE2__)
+    static __m128i special(__m128i x) {
+        return not_sse2(_mm_or_si128(alnum_sse2(x), _mm_or_si128(_mm_or_si128(eq_sse2(x, '-'), eq_sse2(x, '_')),
+                                                                 _mm_or_si128(eq_sse2(x, '.'), eq_sse2(x, '~'))))) ;
+    }
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+    __attribute__((target("avx2")))
+    static __m256i special(__m256i x) {
+        return not_avx2(_mm256_or_si256(alnum_avx2(x), _mm256_or_si256(_mm256_or_si256(eq_avx2(x, '-'), eq_avx2(x, '_')),
+                                                                       _mm256_or_si256(eq_avx2(x, '.'), eq_avx2(x, '~'))))) ;
+    }
+#endif
+};
+
+// attribute values, quoted or not: anything but alphanumerics and ",-._" as a character reference. Characters that
+// are not allowed in HTML (control characters other than white space) are replaced by U+FFFD.
+struct HtmlAttrSpec {
+    static constexpr const bool *table() { return s_class.html_attr_ ; }
+
+    static size_t write(const char *src, size_t pos, size_t len, Buffer &out) {
+        uint32_t cp ;
+        size_t n = decode_utf8(reinterpret_cast<const unsigned char *>(src) + pos, len - pos, cp) ;
+
+        switch ( cp ) {
+        case '&': out.append("&amp;", 5) ; return n ;
+        case '"': out.append("&quot;", 6) ; return n ;
+        case '<': out.append("&lt;", 4) ; return n ;
+        case '>': out.append("&gt;", 4) ; return n ;
+        }
+
+        if ( ( cp <= 0x1f && cp != '\t' && cp != '\n' && cp != '\r' ) || ( cp >= 0x7f && cp <= 0x9f ) )
+            cp = 0xFFFD ;
+
+        out.append("&#x", 3) ;
+        out.appendHex(cp, cp < 0x100 ? 2 : 4) ;
+        out.push_back(';') ;
+        return n ;
+    }
+
+#if defined(__SSE2__)
+    static __m128i special(__m128i x) {
+        return not_sse2(_mm_or_si128(alnum_sse2(x), _mm_or_si128(_mm_or_si128(eq_sse2(x, ','), eq_sse2(x, '-')),
+                                                                 _mm_or_si128(eq_sse2(x, '.'), eq_sse2(x, '_'))))) ;
+    }
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+    __attribute__((target("avx2")))
+    static __m256i special(__m256i x) {
+        return not_avx2(_mm256_or_si256(alnum_avx2(x), _mm256_or_si256(_mm256_or_si256(eq_avx2(x, ','), eq_avx2(x, '-')),
+                                                                       _mm256_or_si256(eq_avx2(x, '.'), eq_avx2(x, '_'))))) ;
+    }
+#endif
+};
+
+// at least the input size, growing geometrically when appending to a large buffer
+static void reserve_for(size_t len, string &out) {
+    if ( out.capacity() - out.size() < len )
+        out.reserve(std::max(out.size() + len, 2 * out.capacity())) ;
+}
+
+// escape the character at pos after copying the pending clean run
+template<class Spec>
+static inline void escape_at(const char *src, size_t pos, size_t len, size_t &last, Buffer &out) {
+    if ( pos > last ) out.append(src + last, pos - last) ;
+    last = pos + Spec::write(src, pos, len, out) ;
+}
+
+// escape the set bits of a block mask starting at offset i, skipping the bytes consumed by a previous sequence
+template<class Spec>
+static inline void escape_mask(const char *src, size_t i, uint32_t mask, size_t len, size_t &last, Buffer &out) {
+    while ( mask ) {
+        size_t pos = i + __builtin_ctz(mask) ;
+        if ( pos >= last ) escape_at<Spec>(src, pos, len, last, out) ;
+        mask &= mask - 1 ;
+    }
+}
+
+template<class Spec>
+static void escape_tail(const char *src, size_t i, size_t len, size_t last, Buffer &out) {
+    const bool *table = Spec::table() ;
+    for( i = std::max(i, last) ; i < len ; ) {
+        if ( table[(unsigned char)src[i]] ) {
+            escape_at<Spec>(src, i, len, last, out) ;
+            i = last ;
+        } else
+            ++i ;
+    }
+    out.append(src + last, len - last) ;
+}
+
+template<class Spec>
+static void escape_scalar(const char *src, size_t len, string &out) {
+    reserve_for(len, out) ;
+    Buffer buf(out) ;
+    escape_tail<Spec>(src, 0, len, 0, buf) ;
+}
+
+#if defined(__SSE2__)
+
+template<class Spec>
+static void escape_sse2(const char *src, size_t len, string &out) {
+    reserve_for(len, out) ;
+    Buffer buf(out) ;
+
+    size_t i = 0, last = 0 ;
+    for( ; i + 16 <= len ; i += 16 ) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)) ;
+        if ( uint32_t mask = _mm_movemask_epi8(Spec::special(x)) ) escape_mask<Spec>(src, i, mask, len, last, buf) ;
+    }
+
+    escape_tail<Spec>(src, i, len, last, buf) ;
+}
+
+#endif
+
+#if defined(TWIG_ESCAPE_AVX2)
+
+template<class Spec>
+__attribute__((target("avx2")))
+static void escape_avx2(const char *src, size_t len, string &out) {
+    reserve_for(len, out) ;
+    Buffer buf(out) ;
+
+    size_t i = 0, last = 0 ;
+    for( ; i + 32 <= len ; i += 32 ) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)) ;
+        if ( uint32_t mask = _mm256_movemask_epi8(Spec::special(x)) ) escape_mask<Spec>(src, i, mask, len, last, buf) ;
+    }
+
+    escape_tail<Spec>(src, i, len, last, buf) ;
+}
+
+#endif
+
+using Escaper = void (*)(const char *src, size_t len, string &out) ;
+
+static void copy(const char *src, size_t len, string &out) {
+    out.append(src, len) ;
+}
+
+// kernels indexed by EscapeMode
+struct Kernels {
+    Escaper escapers_[6] ;
+};
+
+template<template<class> class K>
+static Kernels make_kernels() {
+    return {{ copy, K<HtmlSpec>::run, K<JsSpec>::run, K<CssSpec>::run, K<UrlSpec>::run, K<HtmlAttrSpec>::run }} ;
+}
+
+template<class Spec> struct ScalarKernel { static constexpr Escaper run = escape_scalar<Spec> ; } ;
+#if defined(__SSE2__)
+template<class Spec> struct Sse2Kernel { static constexpr Escaper run = escape_sse2<Spec> ; } ;
+#endif
+#if defined(TWIG_ESCAPE_AVX2)
+template<class Spec> struct Avx2Kernel { static constexpr Escaper run = escape_avx2<Spec> ; } ;
+#endif
+
+static Kernels select_kernels() {
+#if defined(TWIG_ESCAPE_AVX2)
+    __builtin_cpu_init() ;
+    if ( __builtin_cpu_supports("avx2") ) return make_kernels<Avx2Kernel>() ;
+#endif
+#if defined(__SSE2__)
+    return make_kernels<Sse2Kernel>() ;
+#else
+    return make_kernels<ScalarKernel>() ;
+#endif
+}
+
+static const Kernels &kernels() {
+    static const Kernels s_kernels = select_kernels() ;
+    return s_kernels ;
+}
+
+bool parse_escape_mode(const string &name, EscapeMode &mode) {
+    if ( name == "html" ) mode = EscapeMode::Html ;
+    else if ( name == "js" ) mode = EscapeMode::Js ;
+    else if ( name == "css" ) mode = EscapeMode::Css ;
+    else if ( name == "url" ) mode = EscapeMode::Url ;
+    else if ( name == "html_attr" ) mode = EscapeMode::HtmlAttr ;
+    else if ( name == "no" || name == "false" ) mode = EscapeMode::None ;
+    else return false ;
+    return true ;
+}
+
+void escape_text(EscapeMode mode, const char *src, size_t len, string &out) {
+    kernels().escapers_[static_cast<size_t>(mode)](src, len, out) ;
+}
+
+void escape_text_scalar(EscapeMode mode, const char *src, size_t len, string &out) {
+    static const Kernels s_scalar = make_kernels<ScalarKernel>() ;
+    s_scalar.escapers_[static_cast<size_t>(mode)](src, len, out) ;
+}
+
+}
+
+void escape(const Variant &src, detail::EscapeMode mode, string &out)
+{
+    string s = src.toString() ;
+
+    if ( src.isSafe() )
+        out.append(s) ;
+    else
+        detail::escape_text(mode, s.data(), s.size(), out) ;
+}
+
+}
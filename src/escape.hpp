@@ -0,0 +1,35 @@
+#ifndef TWIG_ESCAPE_HPP
+#define TWIG_ESCAPE_HPP
+
+#include <string>
+#include <cstdint>
+
+#include <variant/variant.hpp>
+
+namespace twig {
+namespace detail {
+
+// escaping strategy of substitutions, fixed when the template is compiled
+enum class EscapeMode : uint8_t { None, Html, Js, Css, Url, HtmlAttr } ;
+
+// strategy by name ("html", "js", "css", "url", "html_attr", false or "no" for none), false if unknown
+bool parse_escape_mode(const std::string &name, EscapeMode &mode) ;
+
+}
+
+// append the value escaped with the given strategy to out
+void escape(const Variant &src, detail::EscapeMode mode, std::string &out) ;
+
+namespace detail {
+
+// Append the escaped form of [src, src + len) to out. Runs of characters that need no escaping are located 16 (SSE2)
+// or 32 (AVX2) bytes at a time and copied in bulk. The widest kernels supported by the CPU are selected at run time.
+void escape_text(EscapeMode mode, const char *src, size_t len, std::string &out) ;
+
+// portable byte at a time version
+void escape_text_scalar(EscapeMode mode, const char *src, size_t len, std::string &out) ;
+
+}
+}
+
+#endif
@@ -78,6 +78,14 @@ FormFieldValidator FormFieldValidators::matches(const std::regex &rx, const twig
     );
 }
 
+FormFieldValidator FormFieldValidators::matches(const Regex &rx, const twig::Translatable &msg) {
+    return makeValidator(
+        [rx](const Variant &val) { return !val.isString() || !rx.match(val.toString()); },
+        msg,
+        "Field {field} does not match expression"
+    );
+}
+
 FormFieldValidator FormFieldValidators::isOneOf(const std::vector<std::string> &keys, const twig::Translatable &msg) {
     return makeValidator(
         [keys](const Variant &val) { return std::find(keys.begin(), keys.end(), val.toString()) == keys.end(); },
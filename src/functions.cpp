@@ -5,6 +5,9 @@
 #include <twig/translator.hpp>
 
 #include "ast.hpp"
+#include "date_format.hpp"
+#include "escape.hpp"
+#include "timezone.hpp"
 
 #include <algorithm>
 #include <cmath>
@@ -27,42 +30,192 @@ extern std::string format(const std::string& fmt, const std::vector<Variant>& ar
 
 namespace twig {
 
-Variant FunctionFactory::invokeFunction(const string &name, const Variant &args, Context &ctx) {
+static const Variant &undefined_arg() {
+    static const Variant s_undefined ;
+    return s_undefined ;
+}
+
+const Variant &Arguments::operator[](size_t pos) const {
+    return pos < n_positional_ ? positional_[pos] : undefined_arg() ;
+}
+
+const Variant &Arguments::keyword(const string &name) const {
+    for( size_t i=0 ; i<n_keywords_ ; i++ ) {
+        if ( *keywords_[i].name_ == name ) return keywords_[i].value_ ;
+    }
+    return undefined_arg() ;
+}
+
+const Variant &Arguments::get(size_t pos, const char *name) const {
+    if ( pos < n_positional_ ) return positional_[pos] ;
+
+    for( size_t i=0 ; i<n_keywords_ ; i++ ) {
+        if ( *keywords_[i].name_ == name ) return keywords_[i].value_ ;
+    }
+    return undefined_arg() ;
+}
+
+const Variant &Arguments::required(size_t pos, const char *name) const {
+    const Variant &v = get(pos, name) ;
+    if ( v.isUndefined() )
+        throw TemplateRuntimeException("function call missing required arguments") ;
+    return v ;
+}
+
+Variant::Array Arguments::positional() const {
+    return Variant::Array(positional_, positional_ + n_positional_) ;
+}
+
+Variant Arguments::pack() const {
+    Variant::Object kw ;
+    for( size_t i=0 ; i<n_keywords_ ; i++ )
+        kw.emplace(*keywords_[i].name_, keywords_[i].value_) ;
+
+    Variant::Object packed ;
+    packed.emplace("args", positional()) ;
+    packed.emplace("kw", kw) ;
+    return packed ;
+}
+
+ArgumentList::ArgumentList(const Variant &packed) {
+    for( const Variant &v: packed["args"] )
+        add(Variant(v)) ;
+
+    const Variant &kw = packed["kw"] ;
+    names_.reserve(kw.length()) ;
+    for( auto it = kw.begin() ; it != kw.end() ; ++it ) {
+        names_.push_back(it.key()) ;
+        keywords_.push_back({&names_.back(), it.value()}) ;
+    }
+}
+
+void ArgumentList::add(Variant &&v) {
+    if ( heap_.empty() ) {
+        if ( n_ < InlineCapacity ) {
+            local_[n_++] = std::move(v) ;
+            return ;
+        }
+        // spill to the heap once the inline storage is full
+        heap_.reserve(2 * InlineCapacity) ;
+        for( size_t i=0 ; i<n_ ; i++ )
+            heap_.emplace_back(std::move(local_[i])) ;
+    }
+
+    heap_.emplace_back(std::move(v)) ;
+    ++n_ ;
+}
+
+void ArgumentList::add(const string &name, Variant &&v) {
+    // the first occurrence of a name wins
+    for( const auto &k: keywords_ )
+        if ( *k.name_ == name ) return ;
+    keywords_.push_back({&name, std::move(v)}) ;
+}
+
+Variant FunctionFactory::invokeFunction(const string &name, const Arguments &args, Context &ctx) {
     auto it = functions_.find(name) ;
     if ( it == functions_.end() )
         throw TemplateRuntimeException("Unknown function '" + name + "'") ;
 
-    return (it->second)(args, ctx) ;
+    return it->second.f_(args, ctx) ;
 }
 
-Variant FunctionFactory::invokeFilter(const string &name, const Variant &target, const Variant &args, Context &ctx)
+Variant FunctionFactory::invokeFilter(const string &name, const Variant &target, const Arguments &args, Context &ctx)
 {
     auto it = filters_.find(name) ;
     if ( it == filters_.end() )
         throw TemplateRuntimeException("Unknown filter '" + name + "'") ;
 
-    return (it->second)(target, args, ctx) ;
+    return it->second.f_(target, args, ctx) ;
 }
 
-Variant FunctionFactory::invokeTest(const string &name, const Variant &target, const Variant &args, Context &ctx)
+bool FunctionFactory::invokeTest(const string &name, const Variant &target, const Arguments &args, Context &ctx)
 {
     auto it = tests_.find(name) ;
     if ( it == tests_.end() )
         throw TemplateRuntimeException("Unknown test " + name + "'") ;
 
-    return (it->second)(target, args, ctx) ;
+    return it->second.f_(target, args, ctx) ;
+}
+
+Variant FunctionFactory::invokeFunction(const string &name, const Variant &args, Context &ctx) {
+    ArgumentList list(args) ;
+    return invokeFunction(name, list.view(), ctx) ;
+}
+
+Variant FunctionFactory::invokeFilter(const string &name, const Variant &target, const Variant &args, Context &ctx) {
+    ArgumentList list(args) ;
+    return invokeFilter(name, target, list.view(), ctx) ;
+}
+
+Variant FunctionFactory::invokeTest(const string &name, const Variant &target, const Variant &args, Context &ctx) {
+    ArgumentList list(args) ;
+    return invokeTest(name, target, list.view(), ctx) ;
+}
+
+void FunctionFactory::registerFunction(const string &name, const FunctionCall &f, unsigned flags) {
+    functions_[name] = { f, flags } ;
+}
+
+void FunctionFactory::registerFilter(const string &name, const FilterCall &f, unsigned flags) {
+    filters_[name] = { f, flags } ;
+}
+
+void FunctionFactory::registerTest(const string &name, const TestCall &f, unsigned flags) {
+    tests_[name] = { f, flags } ;
+}
+
+// callables taking packed arguments
+
+void FunctionFactory::registerFunction(const string &name, const TemplateFunction &f, unsigned flags) {
+    registerFunction(name, FunctionCall([f](const Arguments &args, Context &ctx) {
+        return f(args.pack(), ctx) ;
+    }), flags) ;
+}
+
+void FunctionFactory::registerFilter(const string &name, const FilterFunction &f, unsigned flags) {
+    registerFilter(name, FilterCall([f](const Variant &target, const Arguments &args, Context &ctx) {
+        return f(target, args.pack(), ctx) ;
+    }), flags) ;
+}
+
+void FunctionFactory::registerTest(const string &name, const TestFunction &f, unsigned flags) {
+    registerTest(name, TestCall([f](const Variant &target, const Arguments &args, Context &ctx) {
+        return f(target, args.pack(), ctx) ;
+    }), flags) ;
+}
+
+template<class M>
+static const typename M::mapped_type *find_entry(const M &m, const string &name) {
+    auto it = m.find(name) ;
+    return ( it == m.end() ) ? nullptr : &it->second ;
+}
+
+FunctionFactory::FunctionHandle FunctionFactory::findFunction(const string &name) const {
+    return find_entry(functions_, name) ;
+}
+
+FunctionFactory::FilterHandle FunctionFactory::findFilter(const string &name) const {
+    return find_entry(filters_, name) ;
+}
+
+FunctionFactory::TestHandle FunctionFactory::findTest(const string &name) const {
+    return find_entry(tests_, name) ;
 }
 
-void FunctionFactory::registerFunction(const string &name, const TemplateFunction &f) {
-    functions_[name] = f ;
+unsigned FunctionFactory::functionFlags(const string &name) const {
+    FunctionHandle h = findFunction(name) ;
+    return h ? h->flags_ : NoFlags ;
 }
 
-void FunctionFactory::registerFilter(const string &name, const FilterFunction &f) {
-    filters_[name] = f ;
+unsigned FunctionFactory::filterFlags(const string &name) const {
+    FilterHandle h = findFilter(name) ;
+    return h ? h->flags_ : NoFlags ;
 }
 
-void FunctionFactory::registerTest(const string &name, const TestFunction &f) {
-    tests_[name] = f ;
+unsigned FunctionFactory::testFlags(const string &name) const {
+    TestHandle h = findTest(name) ;
+    return h ? h->flags_ : NoFlags ;
 }
 
 void unpack_args(const Variant &args, const std::vector<std::string> &named_args, Variant::Array &res) {
@@ -108,12 +261,12 @@ void unpack_args(const Variant &args, const std::vector<std::string> &named_args
 }
 
 
-static Variant _join(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"glue?", "and?"}, unpacked);
-   
-    string sep = ( unpacked[0].isUndefined() ) ? "" : unpacked[0].toString() ;
-    string key = ( unpacked[1].isUndefined() ) ? "" : unpacked[1].toString() ;
+static Variant _join(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &glue = args.get(0, "glue") ;
+    const Variant &attr = args.get(1, "and") ;
+
+    string sep = ( glue.isUndefined() ) ? "" : glue.toString() ;
+    string key = ( attr.isUndefined() ) ? "" : attr.toString() ;
 
     bool is_first = true ;
     string res ;
@@ -128,129 +281,63 @@ static Variant _join(const Variant &target, const Variant &args, Context &ctx) {
     return res ;
 }
 
-static Variant _lower(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _lower(const Variant &target, const Arguments &args, Context &ctx) {
     string str = target.toString() ;
     std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
     return str ;
 }
 
-static Variant _upper(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _upper(const Variant &target, const Arguments &args, Context &ctx) {
     string str = target.toString() ;
     std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::toupper(c); });
     return str ;
 }
 
 
-static Variant _default(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"default"}, unpacked) ;
-    return ( target.isUndefined() || target.isNull() ) ? unpacked[0] : target ;
+static Variant _default(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &fallback = args.required(0, "default") ;
+    return ( target.isUndefined() || target.isNull() ) ? fallback : target ;
 }
 
-static Variant _raw(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _raw(const Variant &target, const Arguments &args, Context &ctx) {
     if ( target.isString() )
         return Variant(target.toString(), true) ; // make it safe
     else
         return target ;
 }
 
-static string escape_html(const string &src) {
-    string buffer ;
-    for ( char c: src ) {
-        switch(c) {
-        case '&':  buffer.append("&amp;");       break;
-        case '\"': buffer.append("&quot;");      break;
-        case '\'': buffer.append("&apos;");      break;
-        case '<':  buffer.append("&lt;");        break;
-        case '>':  buffer.append("&gt;");        break;
-        default:   buffer.push_back(c);          break;
-        }
-    }
-    return buffer ;
-}
-
-static string escape_js(const string &src) {
-   std::ostringstream escaped;
-
-    for (unsigned char c : src) {
-        switch (c) {
-            case '\\': escaped << "\\\\"; break;
-            case '"':  escaped << "\\\""; break;
-            case '\'': escaped << "\\'";  break;
-            case '\n': escaped << "\\n";  break;
-            case '\r': escaped << "\\r";  break;
-            case '\t': escaped << "\\t";  break;
-            case '\b': escaped << "\\b";  break;
-            case '\f': escaped << "\\f";  break;
-            case '/':  escaped << "\\/";  break;  // prevents </script> injection
-            case '\0': escaped << "\\0";  break;
-            case 0xE2: // check for U+2028 / U+2029 (UTF-8: E2 80 A8 / E2 80 A9)
-                // These are "line terminators" in JS and must be escaped
-                // We'd need lookahead; fall through to hex escape
-            default:
-                if (c < 0x20 || c == 0x7F) {
-                    // Control characters: use \xNN
-                    escaped << "\\x"
-                            << "0123456789abcdef"[c >> 4]
-                            << "0123456789abcdef"[c & 0xF];
-                } else {
-                    escaped << c;
-                }
-        }
-    }
-
-    return escaped.str();
-}
-
-
-Variant escape(const Variant &src, const string &escape_mode)
-{
-    if ( src.isSafe() ) return src ;
+static Variant _escape(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &strategy = args.get(0, "strategy") ;
 
-    if ( escape_mode == "html" )
-        return Variant(escape_html(src.toString()), true) ;
-    else if ( escape_mode == "js" ) 
-        return Variant(escape_js(src.toString()), true) ;
-    else return src ;
-}
+    // an unknown strategy would leave the value unescaped
+    detail::EscapeMode mode = detail::EscapeMode::Html ;
+    if ( strategy.isBoolean() && !strategy.toBoolean() )
+        mode = detail::EscapeMode::None ;
+    else if ( !strategy.isUndefined() && !detail::parse_escape_mode(strategy.toString(), mode) )
+        throw TemplateRuntimeException("Unknown escaping strategy '" + strategy.toString() + "'") ;
 
-static Variant _escape(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"strategy?", "charset?"}, unpacked) ;
+    if ( target.isSafe() || mode == detail::EscapeMode::None ) return target ;
 
-    string mode = unpacked[0].isUndefined() ? "html" : unpacked[0].toString() ;
-    return escape(target, mode) ;
+    string res ;
+    escape(target, mode, res) ;
+    return Variant(res, true) ;
 }
 
-static Variant _defined(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _defined(const Variant &target, const Arguments &args, Context &ctx) {
     return !(target.isUndefined() ) ;
 }
 
-static Variant range(const Variant &args, Context &ctx) {
-    Variant::Array unpacked, result ;
-    unpack_args(args, {"low", "high", "step?"}, unpacked) ;
-
-    if ( unpacked[0].type() == Variant::Type::Integer ) {
-        int64_t start = unpacked[0].toInteger() ;
-        int64_t stop = unpacked[1].toInteger() ;
-        int64_t step = unpacked[2].isUndefined() ? 1 : unpacked[2].toInteger() ;
-        if ( step == 0 ) throw TemplateRuntimeException("Zero step is provided in range function") ;
-        if ( ( step > 0 && start > stop ) ||
-             ( step < 0 && start < stop ) )
-            throw TemplateRuntimeException("Invalid arguments provided in range function") ;
-
-        for( int64_t i = start ; i <= stop ; i += step )
-            result.push_back(i) ;
-    }
-
-    return result ;
+static Variant range(const Arguments &args, Context &ctx) {
+    detail::Range r ;
+    detail::range_bounds(args, r) ;
+    return r.toArray() ;
 }
 
-static Variant _length(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _length(const Variant &target, const Arguments &args, Context &ctx) {
     return Variant(static_cast<int64_t>(target.length())) ;
 }
 
-static Variant _last(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _last(const Variant &target, const Arguments &args, Context &ctx) {
     if ( target.isArray() )
         return target.at(target.length() - 1) ;
     else if ( target.isString() ) {
@@ -262,11 +349,9 @@ static Variant _last(const Variant &target, const Variant &args, Context &ctx) {
     else return Variant::null() ;
 }
 
-static Variant _find(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"arrow"}, unpacked) ;   
+static Variant _find(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &lambda = args.required(0, "arrow") ;
 
-    Variant lambda = unpacked[0] ;
     if ( lambda.type() != Variant::Type::Function )
         throw TemplateRuntimeException("find filter expects a lambda as an argument") ;
     if ( target.isArray() ) {
@@ -289,7 +374,7 @@ static Variant _find(const Variant &target, const Variant &args, Context &ctx) {
         return Variant::undefined() ;
 }
 
-static Variant _first(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _first(const Variant &target, const Arguments &args, Context &ctx) {
     if ( target.isArray() )
         return target.at(0) ;
     else if ( target.isString() ) {
@@ -301,7 +386,7 @@ static Variant _first(const Variant &target, const Variant &args, Context &ctx)
     else return Variant::null() ;
 }
 
-static Variant _abs(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _abs(const Variant &target, const Arguments &args, Context &ctx) {
     try {
         Variant num = target.toNumber() ;
         if ( num.type() == Variant::Type::Integer )
@@ -317,7 +402,7 @@ static Variant _abs(const Variant &target, const Variant &args, Context &ctx) {
     }
 }
 
-static Variant _capitalize(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _capitalize(const Variant &target, const Arguments &args, Context &ctx) {
     string val = target.toString() ;
     if ( val.empty() )
         return val ;
@@ -339,12 +424,10 @@ static Variant _capitalize(const Variant &target, const Variant &args, Context &
     return output;
 }
 
-static Variant _filter(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"arrow"}, unpacked) ;
+static Variant _filter(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &lambda = args.required(0, "arrow") ;
 
     Variant data = target ;
-    Variant lambda = unpacked[0] ;
     if ( lambda.type() != Variant::Type::Function )
         throw TemplateRuntimeException("filter function expects a lambda as second argument") ;
     if ( data.isArray() ) {
@@ -368,7 +451,7 @@ static Variant _filter(const Variant &target, const Variant &args, Context &ctx)
        
 }
 
-static Variant _keys(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _keys(const Variant &target, const Arguments &args, Context &ctx) {
     if ( target.isObject() ) {
         Variant::Array res ;
         for( auto it = target.begin() ; it != target.end() ; ++it )
@@ -378,15 +461,16 @@ static Variant _keys(const Variant &target, const Variant &args, Context &ctx) {
     else return Variant::null() ;
 }
 
-static Variant _batch(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked, out ;
-    unpack_args(args, {"size", "fill", "preserve_keys?"}, unpacked) ;
+static Variant _batch(const Variant &target, const Arguments &args, Context &ctx) {
+    Variant::Array out ;
+    const Variant &size_arg = args.required(0, "size") ;
+    const Variant &fill = args.required(1, "fill") ;
 
     if ( !target.isArray() )
         throw TemplateRuntimeException("batch filter expects an array") ;
 
     int len = target.length() ;
-    int size = ceil(unpacked[0].toFloat()) ;
+    int size = ceil(size_arg.toFloat()) ;
     int batches = ceil(len/(float)size) ;
 
     if ( size <= 0 )
@@ -400,8 +484,8 @@ static Variant _batch(const Variant &target, const Variant &args, Context &ctx)
         for( uint i = 0 ; i<size ; i++, idx++ ) {
             if ( idx < len )
                 ba.push_back(target.at(idx)) ;
-            else if ( !unpacked[1].isUndefined() )
-                ba.push_back(unpacked[1]) ;
+            else if ( !fill.isUndefined() )
+                ba.push_back(fill) ;
         }
         out[k] = ba ;
     }
@@ -409,9 +493,8 @@ static Variant _batch(const Variant &target, const Variant &args, Context &ctx)
     return out ;
 }
 
-static Variant _merge(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"other"}, unpacked) ;
+static Variant _merge(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &other = args.required(0, "other") ;
 
     if ( target.isArray() ) {
         Variant::Array res ;
@@ -419,7 +502,7 @@ static Variant _merge(const Variant &target, const Variant &args, Context &ctx)
         for( auto &&e: target )
             res.emplace_back(std::move(e)) ;
 
-        for( auto &&e: unpacked[0] )
+        for( auto &&e: other )
             res.emplace_back(std::move(e)) ;
 
         return res ;
@@ -429,7 +512,7 @@ static Variant _merge(const Variant &target, const Variant &args, Context &ctx)
         for( auto it = target.begin() ; it != target.end() ; ++it )
             res[it.key()] = it.value() ;
 
-        for( auto it = unpacked[0].begin() ; it != unpacked[0].end() ; ++it )
+        for( auto it = other.begin() ; it != other.end() ; ++it )
             res[it.key()] = it.value() ;
 
         return res ;
@@ -438,38 +521,37 @@ static Variant _merge(const Variant &target, const Variant &args, Context &ctx)
     else return target ;
 }
 
-static Variant cycle(const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"values", "position?"}, unpacked) ;
-    if ( !unpacked[0].isArray() )
+static Variant cycle(const Arguments &args, Context &ctx) {
+    const Variant &values = args.required(0, "values") ;
+    const Variant &pos = args.get(1, "position") ;
+    if ( !values.isArray() )
         throw TemplateRuntimeException("cycle function expects an array as first argument") ;
 
-    int position = ( !unpacked[1].isUndefined() ) ? unpacked[1].toInteger() : 0 ;
-    return unpacked[0].at(position % unpacked[0].length()) ;
+    int position = ( !pos.isUndefined() ) ? pos.toInteger() : 0 ;
+    return values.at(position % values.length()) ;
 }
 
-static Variant _format(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _format(const Variant &target, const Arguments &args, Context &ctx) {
     string fmt = target.toString() ;
-    return ::format(fmt, args["args"].toArray());
+    return ::format(fmt, args.positional());
 }
 
-static Variant _date(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"format?", "timezone?"}, unpacked) ;
+static Variant _date(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &fmt = args.get(0, "format") ;
+    const Variant &timezone = args.get(1, "timezone") ;
 
     Variant src = target ;
-    string tz = unpacked[1].isUndefined() ? string() : unpacked[1].toString() ;
+    string tz = timezone.isUndefined() ? string() : timezone.toString() ;
     
-    string format = ( unpacked[0].isUndefined() ) ? "F j, Y H:i" : unpacked[0].toString() ;
+    string format = ( fmt.isUndefined() ) ? "F j, Y H:i" : fmt.toString() ;
 
     int64_t tms ;
     if ( src.isString() ) {
         try {
-            return strtotime(src.toString(), tz) ;
+            tms = strtotime(src.toString(), tz) ;
         } catch ( const std::runtime_error & ) {
             throw TemplateRuntimeException("Failed to parse date string: " + src.toString()) ;
         }
-        
     }
     else if ( src.type() == Variant::Type::Integer ) {
         tms = src.toInteger() ;
@@ -483,106 +565,86 @@ static Variant _date(const Variant &target, const Variant &args, Context &ctx) {
     else
         throw TemplateRuntimeException("date function expects a string, integer timestamp, DateTime or Duration as first argument") ;
 
-    string strftime_format = php_date_format_to_strftime(format) ;
+    // unknown zones fall back to local time
+    const detail::TimeZone *zone = detail::TimeZone::get(tz) ;
+    if ( !zone ) zone = detail::TimeZone::get(string()) ;
 
-    std::time_t t = static_cast<std::time_t>(tms) ;
     tm tm ;
-    if ( tz.empty() ) {
-        // Use local timezone
-        localtime_r(&t, &tm) ;
-    } else {
-        // Convert to the specified timezone
-        int offset_seconds ;
-        if ( parse_timezone_offset(tz, offset_seconds) ) {
-            // Adjust the UTC timestamp by the timezone offset to get local time
-            // gmtime_r will then interpret the adjusted timestamp as UTC epoch,
-            // giving us the correct struct tm for that timezone
-            std::time_t adjusted = t + offset_seconds ;
-            gmtime_r(&adjusted, &tm) ;
-        } else {
-            // Fall back to local timezone if parsing fails
-            localtime_r(&t, &tm) ;
-        }
-    }
-
-    char buffer[256] ;
-    if ( std::strftime(buffer, sizeof(buffer), strftime_format.c_str(), &tm) == 0 )
-        throw TemplateRuntimeException("Failed to format date string") ;
+    zone->toLocal(tms, tm) ;
 
-    return Variant(buffer) ;
+    string res ;
+    detail::DateFormat::get(format)->format(tm, tms, res) ;
+    return res ;
 
 }
 
-static Variant include(const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"template", "variables?", "with_context?", "ignore_missing?", "sandboxed?"}, unpacked) ;
+static Variant include(const Arguments &args, Context &ctx) {
+    const Variant &tmpl = args.required(0, "template") ;
+    const Variant &vars = args.get(1, "variables") ;
 
     Variant::Object variables ;
-    if ( !unpacked[1].isUndefined() ) 
-        variables = unpacked[1].toObject() ;
+    if ( !vars.isUndefined() )
+        variables = vars.toObject() ;
 
-    bool ignore_missing = unpacked[3].isUndefined() ? false : unpacked[3].toBoolean() ;
-    bool with_context = unpacked[2].isUndefined() ? true : unpacked[2].toBoolean() ;
+    bool ignore_missing = args.has(3, "ignore_missing") ? args.get(3, "ignore_missing").toBoolean() : false ;
+    bool with_context = args.has(2, "with_context") ? args.get(2, "with_context").toBoolean() : true ;
 
-    if ( with_context )
-        variables.insert(ctx.data_.begin(), ctx.data_.end());
+    if ( with_context ) {
+        Variant::Object visible = ctx.variables() ;
+        variables.insert(visible.begin(), visible.end());
+    }
 
-    return ctx.rdr_.render(unpacked[0].toString(), variables, ignore_missing) ;
+    return ctx.rdr_.render(tmpl.toString(), variables, ignore_missing) ;
 }
 namespace detail {
-extern std::string resolve_and_render_block(const std::string &name, detail::DocumentNode *doc, Context &ctx) ;
+extern void resolve_and_render_block(const std::string &name, const detail::TemplateChain &chain, size_t start, Context &ctx, std::string &res) ;
 }
-static Variant parent(const Variant &args, Context &ctx) {
+static Variant parent(const Arguments &args, Context &ctx) {
 
-    if ( ctx.active_block_ == nullptr ) return Variant::undefined() ;
+    if ( ctx.active_block_ == nullptr || ctx.chain_ == nullptr ) return Variant::undefined() ;
 
-    detail::DocumentNode* current_block_owner = ctx.active_block_->root();
+    const detail::TemplateChain &chain = *ctx.chain_ ;
 
     // Guard: If there is no parent template above this layer, parent() does nothing
-    if ( !current_block_owner || current_block_owner->parent_ == nullptr) {
+    size_t parent_layer = ctx.active_layer_ + 1 ;
+    if ( parent_layer >= chain.size() ) {
         return Variant::undefined();
     }
 
-    // Step exactly one file layer up the chain
-    detail::DocumentNode* parent_layer = current_block_owner->parent_.get();
-
-    // Create a local context copy to isolate this recursive branch pass
-    Context nested_ctx(ctx) ;
-
     // Ask the engine to resolve the block starting strictly from the parent layer upward
     try {
-        return resolve_and_render_block(ctx.active_block_->name_, parent_layer, nested_ctx);
+        string res ;
+        resolve_and_render_block(ctx.active_block_->name_, chain, parent_layer, ctx, res);
+        return res ;
     } catch ( TemplateRuntimeException &e ) {
-        current_block_owner->throwException(e.what()) ;
+        chain[ctx.active_layer_]->throwException(e.what()) ;
     }
 
     return std::string() ;
 }
 
-static Variant block(const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"name", "template?"}, unpacked) ;
+static Variant block(const Arguments &args, Context &ctx) {
+    string name = args.required(0, "name").toString() ;
+
+    if ( ctx.chain_ == nullptr ) return Variant::undefined() ;
 
-    string name = unpacked[0].toString() ;
-   
     try {
-        Context nested_ctx(ctx) ;
-        return resolve_and_render_block(name, ctx.root_tmpl_, nested_ctx);
+        string res ;
+        resolve_and_render_block(name, *ctx.chain_, 0, ctx, res);
+        return res ;
     } catch ( TemplateRuntimeException &e ) {
-        ctx.root_tmpl_->throwException(e.what()) ;
-        
+        ctx.chain_->front()->throwException(e.what()) ;
     }
     return std::string() ;
 }
 
-static Variant html_attr(const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"dict"}, unpacked) ;
+static Variant html_attr(const Arguments &args, Context &ctx) {
+    const Variant &dict = args.required(0, "dict") ;
 
-    if ( !unpacked[0].isObject() ) return "" ;
+    if ( !dict.isObject() ) return "" ;
 
     std::ostringstream ss;
-    for( const auto &[key, val]: unpacked[0].toObject() ) {
+    for( const auto &[key, val]: dict.toObject() ) {
         if ( val.isNull() || ( val.isBoolean() && !val.toBoolean()) ) 
             continue ;
         else if ( val.isBoolean() && val.toBoolean() ) {
@@ -598,7 +660,9 @@ static Variant html_attr(const Variant &args, Context &ctx) {
             }
             ss << "\"";
         } else {
-            ss << ' ' << key << "=\"" << escape_html(val.toString()) << "\"";
+            string value = val.toString(), escaped ;
+            detail::escape_text(detail::EscapeMode::Html, value.data(), value.size(), escaped) ;
+            ss << ' ' << key << "=\"" << escaped << "\"";
         }
     }
    
@@ -606,12 +670,12 @@ static Variant html_attr(const Variant &args, Context &ctx) {
     return res.empty() ? "" : res.substr(1) ;
 }
 
-static Variant date(const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"date?", "timezone?"}, unpacked) ;
+static Variant date(const Arguments &args, Context &ctx) {
+    const Variant &when = args.get(0, "date") ;
+    const Variant &timezone = args.get(1, "timezone") ;
 
-    auto t = unpacked[0] ;
-    string tz = unpacked[1].isUndefined() ? string() : unpacked[1].toString() ;
+    auto t = when ;
+    string tz = timezone.isUndefined() ? string() : timezone.toString() ;
 
     if ( t.isUndefined() ) return Variant::now() ;
 
@@ -619,10 +683,10 @@ static Variant date(const Variant &args, Context &ctx) {
         try {
             return strtotime(t.toString(), tz) ;
         } catch ( const std::runtime_error & ) {
-            throw TemplateRuntimeException("Failed to parse date string: " + unpacked[0].toString()) ;
+            throw TemplateRuntimeException("Failed to parse date string: " + when.toString()) ;
         }
     } else if ( t.type() == Variant::Type::Integer ) {
-        return unpacked[0].toInteger() ;
+        return when.toInteger() ;
     }
     else if ( t.isDateTime() ) {
         return t ;
@@ -634,13 +698,13 @@ static Variant date(const Variant &args, Context &ctx) {
         throw TemplateRuntimeException("date function expects a string, integer timestamp, DateTime or Duration as first argument") ;
 }
 
-static Variant _trim(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"character_mask?", "side?"}, unpacked) ;
+static Variant _trim(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &character_mask = args.get(0, "character_mask") ;
+    const Variant &side_arg = args.get(1, "side") ;
 
     string str = target.toString() ;
-    string chars = unpacked[0].isUndefined() ? " \t\n\r\f\v" : unpacked[0].toString() ;
-    string side = unpacked[1].isUndefined() ? "both" : unpacked[1].toString() ;
+    string chars = character_mask.isUndefined() ? " \t\n\r\f\v" : character_mask.toString() ;
+    string side = side_arg.isUndefined() ? "both" : side_arg.toString() ;
 
     size_t start = str.find_first_not_of(chars) ;
     if ( start == string::npos ) return "" ;
@@ -649,12 +713,10 @@ static Variant _trim(const Variant &target, const Variant &args, Context &ctx) {
     return str.substr(start, end - start + 1) ;
 }
 
-static Variant _map_filter(const Variant &target, const Variant &args, Context &ctx) {
-   Variant::Array unpacked ;
-    unpack_args(args, {"arrow"}, unpacked) ;
+static Variant _map_filter(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &lambda = args.required(0, "arrow") ;
 
     Variant data = target ;
-    Variant lambda = unpacked[0] ;
     if ( lambda.type() != Variant::Type::Function )
         throw TemplateRuntimeException("filter function expects a lambda as second argument") ;
     if ( data.isArray() ) {
@@ -677,13 +739,12 @@ static Variant _map_filter(const Variant &target, const Variant &args, Context &
         return data ;
 }
 
-static Variant _reduce(const Variant &target, const Variant &args, Context &ctx) {
-   Variant::Array unpacked ;
-    unpack_args(args, {"arrow", "initial?"}, unpacked) ;
+static Variant _reduce(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &lambda = args.required(0, "arrow") ;
+    const Variant &initial_arg = args.get(1, "initial") ;
 
     Variant data = target ;
-    Variant lambda = unpacked[0] ;
-    double initial = unpacked[1].isUndefined() ? 0 : unpacked[1].toFloat() ;
+    double initial = initial_arg.isUndefined() ? 0 : initial_arg.toFloat() ;
 
     if ( lambda.type() != Variant::Type::Function )
         throw TemplateRuntimeException("reduce function expects a lambda as an argument") ;
@@ -707,16 +768,16 @@ static Variant _reduce(const Variant &target, const Variant &args, Context &ctx)
         return 0 ;
 }
 
-static Variant _json_encode(const Variant &target, const Variant &args, Context &ctx) {
+static Variant _json_encode(const Variant &target, const Arguments &args, Context &ctx) {
     return target.toJSON() ;
 }
 
-static Variant _round(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"precision?", "method?"}, unpacked) ;
+static Variant _round(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &precision_arg = args.get(0, "precision") ;
+    const Variant &method_arg = args.get(1, "method") ;
 
-    int precision = unpacked[0].isUndefined() ? 0 : unpacked[0].toInteger() ;
-    string method = unpacked[1].isUndefined() ? "common" : unpacked[1].toString() ;
+    int precision = precision_arg.isUndefined() ? 0 : precision_arg.toInteger() ;
+    string method = method_arg.isUndefined() ? "common" : method_arg.toString() ;
 
     double v = target.toFloat() ;
     double scale = std::pow(10.0, precision);
@@ -725,14 +786,15 @@ static Variant _round(const Variant &target, const Variant &args, Context &ctx)
     else return std::round(v * scale) / scale;
 }
 
-static Variant _slice(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"start?", "length?", "preserve_keys?"}, unpacked) ;
+static Variant _slice(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &start_arg = args.get(0, "start") ;
+    const Variant &length_arg = args.get(1, "length") ;
+    const Variant &preserve_keys_arg = args.get(2, "preserve_keys") ;
 
-    int start = unpacked[0].isUndefined() ? 0 : unpacked[0].toInteger() ;
-    bool has_length = !unpacked[1].isUndefined();
-    int length = has_length ? unpacked[1].toInteger() : 0 ;
-    bool preserve_keys = unpacked[2].isUndefined() ? false : unpacked[2].toBoolean() ;
+    int start = start_arg.isUndefined() ? 0 : start_arg.toInteger() ;
+    bool has_length = !length_arg.isUndefined();
+    int length = has_length ? length_arg.toInteger() : 0 ;
+    bool preserve_keys = preserve_keys_arg.isUndefined() ? false : preserve_keys_arg.toBoolean() ;
 
     // Work with the correct size depending on the type
     int total = static_cast<int>(target.length());
@@ -803,12 +865,10 @@ static Variant _slice(const Variant &target, const Variant &args, Context &ctx)
 
 }
 
-static Variant _trans(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"params?"}, unpacked) ;
+static Variant _trans(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &params = args.get(0, "params") ;
 
     string msg = target.toString() ;
-    auto params = unpacked[0] ;
     if ( ctx.mgr_ != nullptr )
         return ctx.mgr_->translate(msg, ctx.locale_,
             params.isUndefined() ? Variant::Object{} : params.toObject() );
@@ -816,44 +876,43 @@ static Variant _trans(const Variant &target, const Variant &args, Context &ctx)
         return msg ;
 }
 
-static bool _even(const Variant &target, const Variant &args, Context &ctx) {
+static bool _even(const Variant &target, const Arguments &args, Context &ctx) {
     return target.toInteger() % 2 == 0 ;
 }
 
-static bool _divisible_by(const Variant &target, const Variant &args, Context &ctx) {
-    Variant::Array unpacked ;
-    unpack_args(args, {"divisor"}, unpacked) ;
-    return target.toInteger() % unpacked[0].toInteger() == 0 ;
+static bool _divisible_by(const Variant &target, const Arguments &args, Context &ctx) {
+    const Variant &divisor = args.required(0, "divisor") ;
+    return target.toInteger() % divisor.toInteger() == 0 ;
 }
 
-static bool _odd(const Variant &target, const Variant &args, Context &ctx) {
+static bool _odd(const Variant &target, const Arguments &args, Context &ctx) {
     return target.toInteger() % 2 != 0 ;
 }
 
-static bool _is_defined(const Variant &target, const Variant &args, Context &ctx) {
+static bool _is_defined(const Variant &target, const Arguments &args, Context &ctx) {
     return !target.isUndefined() ;
 }
 
-static bool _empty(const Variant &target, const Variant &args, Context &ctx) {
+static bool _empty(const Variant &target, const Arguments &args, Context &ctx) {
     return target.isUndefined() || target.isNull() || ( target.isString() && target.toString().empty() ) ||
            ( target.isArray() && target.length() == 0 ) ||
            ( target.isObject() && target.length() == 0 ) ;
 }
 
-static bool _iterable(const Variant &target, const Variant &args, Context &ctx) {
+static bool _iterable(const Variant &target, const Arguments &args, Context &ctx) {
     return target.isArray() ||
            target.isObject()  ;
 }
 
-static bool _null(const Variant &target, const Variant &args, Context &ctx) {
+static bool _null(const Variant &target, const Arguments &args, Context &ctx) {
     return target.isNull() ;
 }
 
-static bool _sequence(const Variant &target, const Variant &args, Context &ctx) {
+static bool _sequence(const Variant &target, const Arguments &args, Context &ctx) {
     return target.isArray()  ;
 }
 
-static bool _map(const Variant &target, const Variant &args, Context &ctx) {
+static bool _map(const Variant &target, const Arguments &args, Context &ctx) {
     return target.isObject()  ;
 }
 
@@ -862,52 +921,52 @@ extern Variant form_end(const Variant &args, Context &ctx) ;
 extern Variant form_row(const Variant &args, Context &ctx) ;
 
 FunctionFactory::FunctionFactory() {
-    registerFilter("join", _join);
-    registerFilter("lower", _lower);
-    registerFilter("upper", _upper);
-    registerFilter("default", _default);
-    registerFilter("e", _escape);
-    registerFilter("escape", _escape);
-    registerFilter("defined", _defined);
-    registerFilter("length", _length);
-    registerFilter("first", _first);
-    registerFilter("last", _last);
-    registerFilter("raw", _raw);
-    registerFilter("safe", _raw);
-    registerFilter("batch", _batch);
-    registerFilter("merge", _merge);
-    registerFilter("date", _date) ;
-    registerFilter("abs", _abs) ;
-    registerFilter("capitalize", _capitalize) ;
-    registerFilter("filter", _filter) ;
-    registerFilter("trim", _trim) ;
-    registerFilter("keys", _keys) ;
-    registerFilter("format", _format) ;
-    registerFilter("json_encode", _json_encode) ;
-    registerFilter("find", _find) ;
-    registerFilter("map", _map_filter) ;
-    registerFilter("reduce", _reduce) ;
-    registerFilter("round", _round) ;
-    registerFilter("slice", _slice) ;
-    registerFilter("trans", _trans) ;
-
-    registerFunction("range", range);
+    registerFilter("join", _join, Pure);
+    registerFilter("lower", _lower, Pure);
+    registerFilter("upper", _upper, Pure);
+    registerFilter("default", _default, Pure);
+    registerFilter("e", _escape, Pure | OutputSafe);
+    registerFilter("escape", _escape, Pure | OutputSafe);
+    registerFilter("defined", _defined, Pure);
+    registerFilter("length", _length, Pure);
+    registerFilter("first", _first, Pure);
+    registerFilter("last", _last, Pure);
+    registerFilter("raw", _raw, Pure | OutputSafe);
+    registerFilter("safe", _raw, Pure | OutputSafe);
+    registerFilter("batch", _batch, Pure);
+    registerFilter("merge", _merge, Pure);
+    registerFilter("date", _date) ; // local timezone and relative dates
+    registerFilter("abs", _abs, Pure) ;
+    registerFilter("capitalize", _capitalize, Pure) ;
+    registerFilter("filter", _filter, ContextDependent) ; // as find, map and reduce, calls an arrow function that may read any variable
+    registerFilter("trim", _trim, Pure) ;
+    registerFilter("keys", _keys, Pure) ;
+    registerFilter("format", _format, Pure) ;
+    registerFilter("json_encode", _json_encode, Pure) ;
+    registerFilter("find", _find, ContextDependent) ;
+    registerFilter("map", _map_filter, ContextDependent) ;
+    registerFilter("reduce", _reduce, ContextDependent) ;
+    registerFilter("round", _round, Pure) ;
+    registerFilter("slice", _slice, Pure) ;
+    registerFilter("trans", _trans, Deterministic | ContextDependent) ;
+
+    registerFunction("range", range, Pure);
     registerFunction("cycle", cycle) ;
-    registerFunction("date",  date) ;
-    registerFunction("include",  include) ;
-    registerFunction("parent", parent);
-    registerFunction("block", block);
-    registerFunction("html_attr", html_attr);
+    registerFunction("date",  date) ; // current time
+    registerFunction("include",  include, ContextDependent) ;
+    registerFunction("parent", parent, Deterministic | ContextDependent);
+    registerFunction("block", block, Deterministic | ContextDependent);
+    registerFunction("html_attr", html_attr, Pure);
   
-    registerTest("divisible by", _divisible_by) ;
-    registerTest("even", _even) ;
-    registerTest("odd", _odd) ;
-    registerTest("defined", _is_defined) ;
-    registerTest("empty", _empty) ;
-    registerTest("iterable", _iterable) ;
-    registerTest("null", _null) ;
-    registerTest("sequence", _sequence) ;
-    registerTest("mapping", _map) ;
+    registerTest("divisible by", _divisible_by, Pure) ;
+    registerTest("even", _even, Pure) ;
+    registerTest("odd", _odd, Pure) ;
+    registerTest("defined", _is_defined, Pure) ;
+    registerTest("empty", _empty, Pure) ;
+    registerTest("iterable", _iterable, Pure) ;
+    registerTest("null", _null, Pure) ;
+    registerTest("sequence", _sequence, Pure) ;
+    registerTest("mapping", _map, Pure) ;
 }
 
 bool FunctionFactory::hasFunction(const string &name)
@@ -920,4 +979,72 @@ bool FunctionFactory::hasFilter(const string &name)
     return filters_.count(name) ;
 }
 
+namespace detail {
+
+void range_bounds(const Arguments &args, Range &r) {
+    const Variant &low = args.required(0, "low") ;
+    const Variant &high = args.required(1, "high") ;
+    const Variant &increment = args.get(2, "step") ;
+
+    if ( low.type() == Variant::Type::Integer ) {
+        int64_t start = low.toInteger() ;
+        int64_t stop = high.toInteger() ;
+        int64_t step = increment.isUndefined() ? 1 : increment.toInteger() ;
+        if ( step == 0 ) throw TemplateRuntimeException("Zero step is provided in range function") ;
+        if ( ( step > 0 && start > stop ) ||
+             ( step < 0 && start < stop ) )
+            throw TemplateRuntimeException("Invalid arguments provided in range function") ;
+
+        r.start_ = start ;
+        r.step_ = step ;
+        r.size_ = ( step > 0 ) ? ( stop - start ) / step + 1 : ( start - stop ) / -step + 1 ;
+    }
+}
+
+bool is_range_function(FunctionFactory::FunctionHandle h) {
+    auto f = h->f_.target<Variant (*)(const Arguments &, Context &)>() ;
+    return f && *f == range ;
+}
+
+RangeFilter apply_range_filter(FunctionFactory::FilterHandle h, Range &r, const Arguments &args, Variant &res) {
+    auto f = h->f_.target<Variant (*)(const Variant &, const Arguments &, Context &)>() ;
+    if ( !f ) return RangeFilter::Unsupported ;
+
+    if ( *f == _length ) {
+        res = static_cast<int64_t>(r.size_) ;
+        return RangeFilter::Value ;
+    } else if ( *f == _first && r.size_ ) {
+        res = r.at(0) ;
+        return RangeFilter::Value ;
+    } else if ( *f == _last && r.size_ ) {
+        res = r.at(r.size_ - 1) ;
+        return RangeFilter::Value ;
+    } else if ( *f == _slice ) {
+        const Variant &start_arg = args.get(0, "start") ;
+        const Variant &length_arg = args.get(1, "length") ;
+        const Variant &preserve_keys_arg = args.get(2, "preserve_keys") ;
+        if ( !preserve_keys_arg.isUndefined() && preserve_keys_arg.toBoolean() ) return RangeFilter::Unsupported ;
+
+        // same bounds as _slice
+        int64_t total = r.size_ ;
+        int64_t start = start_arg.isUndefined() ? 0 : start_arg.toInteger() ;
+        if ( start < 0 ) start = total + start ;
+        if ( start < 0 ) start = 0 ;
+        if ( start > total ) start = total ;
+
+        int64_t length = length_arg.isUndefined() ? total - start : length_arg.toInteger() ;
+        if ( length < 0 ) length = ( total - start ) + length ;
+        if ( length < 0 ) length = 0 ;
+        if ( start + length > total ) length = total - start ;
+
+        r.start_ += start * r.step_ ;
+        r.size_ = length ;
+        return RangeFilter::Range ;
+    }
+
+    return RangeFilter::Unsupported ;
+}
+
+}
+
 }
@@ -4,6 +4,8 @@
 #include <fstream>
 #include <sstream>
 
+#include <sys/stat.h>
+
 using namespace std ;
 
 namespace twig {
@@ -12,15 +14,39 @@ FileSystemTemplateLoader::FileSystemTemplateLoader(const std::initializer_list<s
     root_folders_(root_folders), suffix_(suffix) {
 }
 
-string FileSystemTemplateLoader::load(const string &key) {
-
+bool FileSystemTemplateLoader::resolve(const string &key, string &p, TemplateVersion &version) {
     for ( const string &r: root_folders_ ) {
 
-        string p(r) ;
+        p = r ;
 
         if ( key.rfind(suffix_) != string::npos ) p += '/' + key ;
         else p += '/' + key + suffix_;
 
+        struct stat st ;
+        if ( ::stat(p.c_str(), &st) == 0 && S_ISREG(st.st_mode) ) {
+#ifdef __APPLE__
+            version.mtime_ = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec ;
+#else
+            version.mtime_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec ;
+#endif
+            version.size_ = st.st_size ;
+            version.inode_ = st.st_ino ;
+            return true ;
+        }
+    }
+
+    return false ;
+}
+
+string FileSystemTemplateLoader::load(const string &key) {
+    TemplateVersion version ;
+    return load(key, version) ;
+}
+
+string FileSystemTemplateLoader::load(const string &key, TemplateVersion &version) {
+    string p ;
+
+    if ( resolve(key, p, version) ) {
         ifstream in(p) ;
 
         if ( in ) {
@@ -31,6 +57,16 @@ string FileSystemTemplateLoader::load(const string &key) {
     throw TemplateLoadException("Cannot find template: " + key) ;
 }
 
+TemplateVersion FileSystemTemplateLoader::version(const string &key) {
+    string p ;
+    TemplateVersion version ;
+
+    if ( !resolve(key, p, version) )
+        throw TemplateLoadException("Cannot find template: " + key) ;
+
+    return version ;
+}
+
 
 DictTemplateLoader::DictTemplateLoader(const std::map<std::string, std::string> &templates):
     templates_(templates) {
@@ -44,6 +80,12 @@ string DictTemplateLoader::load(const string &key) {
     throw TemplateLoadException("Cannot find template: " + key) ;
 }
 
+TemplateVersion DictTemplateLoader::version(const string &key) {
+    if ( templates_.count(key) == 0 )
+        throw TemplateLoadException("Cannot find template: " + key) ;
+    return TemplateVersion() ;
+}
+
 string ChoiceTemplateLoader::load(const string &key) {
     for ( auto l: loaders_ ) {
         try {
@@ -56,5 +98,28 @@ string ChoiceTemplateLoader::load(const string &key) {
     throw TemplateLoadException("Cannot find template: " + key) ;
 }
 
+string ChoiceTemplateLoader::load(const string &key, TemplateVersion &version) {
+    for ( auto l: loaders_ ) {
+        try {
+            return l->load(key, version) ;
+        } catch ( TemplateLoadException &e ) {
+
+        }
+    }
+
+    throw TemplateLoadException("Cannot find template: " + key) ;
+}
+
+TemplateVersion ChoiceTemplateLoader::version(const string &key) {
+    for ( auto l: loaders_ ) {
+        try {
+            return l->version(key) ;
+        } catch ( TemplateLoadException &e ) {
+
+        }
+    }
+
+    throw TemplateLoadException("Cannot find template: " + key) ;
+}
 
 }
@@ -0,0 +1,279 @@
+#include "optimizer.hpp"
+#include "escape.hpp"
+
+#include <twig/exceptions.hpp>
+#include <twig/functions.hpp>
+
+#include <algorithm>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+static bool is_literal(const NodePtr &e) {
+    return dynamic_cast<LiteralNode *>(e.get()) != nullptr ;
+}
+
+// nodes that only combine the values of their operands, without side effects or access to the context
+static bool is_pure(Node *e) {
+    return dynamic_cast<ValueNode *>(e) ||
+           dynamic_cast<ArrayNode *>(e) ||
+           dynamic_cast<DictionaryNode *>(e) ||
+           dynamic_cast<ContainmentNode *>(e) ||
+           dynamic_cast<MatchesNode *>(e) ||
+           dynamic_cast<SubscriptIndexingNode *>(e) ||
+           dynamic_cast<AttributeIndexingNode *>(e) ||
+           dynamic_cast<BinaryOperator *>(e) ||
+           dynamic_cast<BooleanOperator *>(e) ||
+           dynamic_cast<RangeOperatorNode *>(e) ||
+           dynamic_cast<BooleanNegationOperator *>(e) ||
+           dynamic_cast<UnaryOperator *>(e) ||
+           dynamic_cast<ComparisonPredicate *>(e) ;
+}
+
+// spread elements are expanded by the array itself
+static bool is_constant_operand(const NodePtr &e) {
+    if ( SpreadOperator *s = dynamic_cast<SpreadOperator *>(e.get()) )
+        return is_literal(s->rhs_) ;
+    return is_literal(e) ;
+}
+
+// spread arguments are expanded by the call itself
+static bool constant_args(const arg_list_t &args) {
+    for( const auto &a: args )
+        if ( !is_literal(a.value_) ) return false ;
+    return true ;
+}
+
+// calls of filters, functions and tests registered as pure
+bool Optimizer::isPureCall(Node *e) {
+    if ( InvokeFilterNode *n = dynamic_cast<InvokeFilterNode *>(e) ) {
+        for( const auto &f: n->filters_ )
+            if ( !FunctionFactory::hasFlags(f->handle_->flags_, Pure) ) return false ;
+        return true ;
+    } else if ( TestExpressionNode *n = dynamic_cast<TestExpressionNode *>(e) ) {
+        return FunctionFactory::hasFlags(n->handle_->flags_, Pure) ;
+    }
+    return false ;
+}
+
+void Optimizer::fold(NodePtr &expr) {
+    if ( !expr ) return ;
+
+    expr->visitOperands([this](NodePtr &e) { fold(e) ; }) ;
+
+    // a constant condition selects the branch
+    if ( TernaryOperatorNode *n = dynamic_cast<TernaryOperatorNode *>(expr.get()) ) {
+        if ( LiteralNode *c = dynamic_cast<LiteralNode *>(n->condition_.get()) ) {
+            if ( c->val_.toBoolean() ) expr = n->true_expr_ ;
+            else expr = n->false_expr_ ? n->false_expr_ : std::make_shared<LiteralNode>(Variant::null()) ;
+        }
+        return ;
+    }
+
+    bool constant = true ;
+
+    if ( InvokeFunctionNode *n = dynamic_cast<InvokeFunctionNode *>(expr.get()) ) {
+        constant = n->function_ && FunctionFactory::hasFlags(n->function_->flags_, Pure) && constant_args(n->args_) ;
+    } else if ( is_pure(expr.get()) || isPureCall(expr.get()) ) {
+        expr->visitOperands([&constant](NodePtr &e) {
+            constant = constant && is_constant_operand(e) ;
+        }) ;
+    } else
+        return ;
+
+    if ( !constant ) return ;
+
+    // errors are left to be reported at render time with the location of the node
+    try {
+        // long ranges are not stored in the template, they are iterated lazily
+        Range r ;
+        if ( eval_range(expr.get(), ctx_, r) && r.size_ > max_folded_range ) return ;
+
+        expr = std::make_shared<LiteralNode>(expr->eval(ctx_)) ;
+    } catch ( TemplateRuntimeException & ) {
+    }
+}
+
+void Optimizer::optimize(ContainerNode *node) {
+    node->visitExpressions([this](NodePtr &e) { fold(e) ; }) ;
+    bindLoops(node, nullptr) ;
+    simplify(node) ;
+}
+
+// uses of the loop variable of a for loop in its body
+struct Optimizer::LoopScope {
+    bool whole_ = false ; // used as a value or possibly looked up by name (includes, blocks, context functions)
+    vector<pair<NodePtr *, LoopAttributeNode::Attribute>> attributes_ ;
+};
+
+// callables that may look up variables in the context; the ones registered without flags could do anything
+static bool reads_context(unsigned flags) {
+    return flags == NoFlags || FunctionFactory::hasFlags(flags, ContextDependent) ;
+}
+
+static bool declares_loop(const identifier_list_t &names) {
+    return std::find(names.begin(), names.end(), "loop") != names.end() ;
+}
+
+void Optimizer::scanLoopUses(NodePtr &e, LoopScope *scope) {
+    if ( !e || !scope ) return ;
+
+    if ( IdentifierNode *n = dynamic_cast<IdentifierNode *>(e.get()) ) {
+        const string &name = n->name() ;
+        if ( name == "loop" ) scope->whole_ = true ;
+        else if ( name.compare(0, 5, "loop.") == 0 ) {
+            LoopAttributeNode::Attribute attr ;
+            if ( LoopAttributeNode::parse(name.substr(5), attr) ) scope->attributes_.emplace_back(&e, attr) ;
+            else scope->whole_ = true ;
+        }
+        return ;
+    } else if ( LambdaNode *n = dynamic_cast<LambdaNode *>(e.get()) ) {
+        // an argument named loop hides it
+        if ( declares_loop(n->args_) ) return ;
+    } else if ( AssignmentNode *n = dynamic_cast<AssignmentNode *>(e.get()) ) {
+        if ( declares_loop(n->args_) ) scope->whole_ = true ;
+        for( const auto &a: n->dict_args_ )
+            if ( a.alias_ == "loop" ) scope->whole_ = true ;
+    } else if ( InvokeFunctionNode *n = dynamic_cast<InvokeFunctionNode *>(e.get()) ) {
+        if ( n->function_ && reads_context(n->function_->flags_) ) scope->whole_ = true ;
+    } else if ( InvokeFilterNode *n = dynamic_cast<InvokeFilterNode *>(e.get()) ) {
+        for( const auto &f: n->filters_ )
+            if ( reads_context(f->handle_->flags_) ) scope->whole_ = true ;
+    } else if ( TestExpressionNode *n = dynamic_cast<TestExpressionNode *>(e.get()) ) {
+        if ( reads_context(n->handle_->flags_) ) scope->whole_ = true ;
+    }
+
+    e->visitOperands([this, scope](NodePtr &c) { scanLoopUses(c, scope) ; }) ;
+}
+
+// the body of a loop is its own scope, the else part belongs to the enclosing one
+void Optimizer::bindLoopBody(ForLoopBlockNode *node) {
+    LoopScope scope ;
+    scope.whole_ = declares_loop(node->ids_) ;
+
+    scanLoopUses(node->condition_, &scope) ;
+    size_t body_end = ( node->else_child_start_ < 0 ) ? node->children_.size() : node->else_child_start_ ;
+    for( size_t i = 0 ; i < body_end ; i++ )
+        bindLoops(node->children_[i].get(), &scope) ;
+
+    if ( scope.whole_ ) node->loop_mode_ = ForLoopBlockNode::LoopObject ;
+    else if ( scope.attributes_.empty() ) node->loop_mode_ = ForLoopBlockNode::NoLoop ;
+    else {
+        node->loop_mode_ = ForLoopBlockNode::LoopCounters ;
+        for( auto &a: scope.attributes_ )
+            *a.first = std::make_shared<LoopAttributeNode>(&node->layout_, a.second) ;
+    }
+}
+
+void Optimizer::bindLoops(ContentNode *node, LoopScope *scope) {
+    if ( ForLoopBlockNode *f = dynamic_cast<ForLoopBlockNode *>(node) ) {
+        scanLoopUses(f->target_, scope) ;
+        bindLoopBody(f) ;
+        if ( f->else_child_start_ >= 0 ) {
+            for( size_t i = f->else_child_start_ ; i < f->children_.size() ; i++ )
+                bindLoops(f->children_[i].get(), scope) ;
+        }
+        return ;
+    }
+
+    if ( dynamic_cast<MacroBlockNode *>(node) ) {
+        // macros are called with an isolated context
+        scope = nullptr ;
+    } else if ( dynamic_cast<NamedBlockNode *>(node) || dynamic_cast<RefBlockNode *>(node) ||
+                dynamic_cast<IncludeBlockNode *>(node) || dynamic_cast<EmbedBlockNode *>(node) ||
+                dynamic_cast<WithBlockNode *>(node) || dynamic_cast<ExtensionBlockNode *>(node) ) {
+        // other templates, overriding blocks or variables of a with block may refer to loop by name
+        if ( scope ) scope->whole_ = true ;
+    } else if ( AssignmentBlockNode *a = dynamic_cast<AssignmentBlockNode *>(node) ) {
+        if ( scope && declares_loop(a->names_) ) scope->whole_ = true ;
+    } else if ( FilterBlockNode *f = dynamic_cast<FilterBlockNode *>(node) ) {
+        if ( scope && reads_context(f->filter_->handle_->flags_) ) scope->whole_ = true ;
+    } else if ( ApplyBlockNode *a = dynamic_cast<ApplyBlockNode *>(node) ) {
+        for( const auto &f: a->filters_ )
+            if ( scope && reads_context(f->handle_->flags_) ) scope->whole_ = true ;
+    }
+
+    ContainerNode *c = dynamic_cast<ContainerNode *>(node) ;
+    if ( !c ) {
+        node->visitExpressions([this, scope](NodePtr &e) { scanLoopUses(e, scope) ; }) ;
+        return ;
+    }
+
+    // expressions of the node itself, those of the children are visited below with their own scopes
+    vector<ContentNodePtr> children ;
+    children.swap(c->children_) ;
+    c->visitExpressions([this, scope](NodePtr &e) { scanLoopUses(e, scope) ; }) ;
+    children.swap(c->children_) ;
+
+    for( auto &child: c->children_ )
+        bindLoops(child.get(), scope) ;
+}
+
+void Optimizer::simplify(ContainerNode *node) {
+    auto &children = node->children_ ;
+    size_t n = children.size() ;
+
+    for( auto &c: children ) {
+        if ( ContainerNode *cn = dynamic_cast<ContainerNode *>(c.get()) ) {
+            simplify(cn) ;
+        } else if ( SubstitutionBlockNode *s = dynamic_cast<SubstitutionBlockNode *>(c.get()) ) {
+            // the escaping strategy is known, so a constant prints as fixed text
+            if ( LiteralNode *l = dynamic_cast<LiteralNode *>(s->expr_.get()) ) {
+                string text ;
+                escape(l->val_, s->mode_, text) ;
+                auto r = std::make_shared<RawTextNode>(text) ;
+                r->parent_ = node ;
+                r->setLineAndColumn(s->line_, s->column_) ;
+                c = r ;
+            }
+        }
+    }
+
+    // children are addressed by index by the sections of if and for blocks, text is not merged across them
+    vector<bool> section(n + 1, false) ;
+    if ( IfBlockNode *b = dynamic_cast<IfBlockNode *>(node) ) {
+        for( const auto &blk: b->blocks_ ) {
+            section[blk.cstart_] = true ;
+            if ( blk.cstop_ >= 0 ) section[blk.cstop_] = true ;
+        }
+    } else if ( ForLoopBlockNode *f = dynamic_cast<ForLoopBlockNode *>(node) ) {
+        if ( f->else_child_start_ >= 0 ) section[f->else_child_start_] = true ;
+    }
+
+    vector<ContentNodePtr> merged ;
+    vector<int> index(n + 1) ;
+    RawTextNode *last = nullptr ;
+
+    for( size_t i = 0 ; i < n ; i++ ) {
+        index[i] = merged.size() ;
+        if ( section[i] ) last = nullptr ;
+
+        RawTextNode *r = dynamic_cast<RawTextNode *>(children[i].get()) ;
+        if ( r && last ) {
+            last->text_.append(r->text_) ;
+            continue ;
+        }
+
+        merged.push_back(children[i]) ;
+        last = r ;
+    }
+    index[n] = merged.size() ;
+
+    if ( merged.size() == n ) return ;
+
+    if ( IfBlockNode *b = dynamic_cast<IfBlockNode *>(node) ) {
+        for( auto &blk: b->blocks_ ) {
+            blk.cstart_ = index[blk.cstart_] ;
+            if ( blk.cstop_ >= 0 ) blk.cstop_ = index[blk.cstop_] ;
+        }
+    } else if ( ForLoopBlockNode *f = dynamic_cast<ForLoopBlockNode *>(node) ) {
+        if ( f->else_child_start_ >= 0 ) f->else_child_start_ = index[f->else_child_start_] ;
+    }
+
+    children = std::move(merged) ;
+}
+
+}
+}
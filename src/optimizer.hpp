@@ -0,0 +1,43 @@
+#ifndef TWIG_OPTIMIZER_HPP
+#define TWIG_OPTIMIZER_HPP
+
+#include "ast.hpp"
+
+namespace twig {
+namespace detail {
+
+// Simplification of a parsed template. Expressions whose operands are all literals, including calls of filters,
+// functions and tests registered as pure, are evaluated once and replaced by a literal, substitutions of constants
+// become raw text escaped with the strategy of the substitution and adjacent raw text nodes are merged. For loops
+// only provide the loop variable in the form their body needs (see ForLoopBlockNode::LoopMode).
+
+class Optimizer {
+public:
+    Optimizer(TemplateRenderer &rdr): ctx_(rdr, empty_, nullptr, "en_US") {}
+
+    void optimize(ContainerNode *node) ;
+
+    // fold the constant sub-trees of the expression in place
+    void fold(NodePtr &expr) ;
+
+private:
+
+    void simplify(ContainerNode *node) ;
+    static bool isPureCall(Node *e) ;
+
+    struct LoopScope ;
+    void bindLoops(ContentNode *node, LoopScope *scope) ;
+    void bindLoopBody(ForLoopBlockNode *node) ;
+    void scanLoopUses(NodePtr &e, LoopScope *scope) ;
+
+    // constant ranges up to this size become literal arrays
+    static const size_t max_folded_range = 256 ;
+
+    Variant::Object empty_ ;
+    Context ctx_ ;
+};
+
+}
+}
+
+#endif
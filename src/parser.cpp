@@ -1,13 +1,21 @@
 #include "parser.hpp"
 
 #include <iostream>
-#include <regex>
 
 using namespace std ;
 
 namespace twig {
 namespace detail {
 
+// strategy of the innermost autoescape block
+EscapeMode Parser::escapeMode() const {
+    for( auto it = stack_.rbegin() ; it != stack_.rend() ; ++it ) {
+        if ( const AutoEscapeBlockNode *n = dynamic_cast<const AutoEscapeBlockNode *>(it->get()) )
+            return n->mode_ ;
+    }
+    return EscapeMode::None ;
+}
+
 bool Parser::parse(DocumentNodePtr node, const string &resourceId ) {
     root_ = node ;
     stack_.push_back(node) ;
@@ -270,47 +278,71 @@ bool Parser::parseRegexString(std::string &res)
     return false ;
 }
 
-NodePtr Parser::parseNumber() {
-    static std::regex rx_number(R"(^(-?(?:0|[1-9]\d*))(\.\d+)?([eE][+-]?\d+)?)") ;
+// length of the run of digits starting at c
+static size_t scan_digits(string::const_iterator c, string::const_iterator end) {
+    size_t n = 0 ;
+    while ( c + n != end && isdigit((unsigned char)c[n]) ) ++n ;
+    return n ;
+}
 
+NodePtr Parser::parseNumber() {
     Position cur = pos_ ;
 
     skipSpace() ;
 
-    smatch what ;
-    if ( !regex_search(pos_.cursor_, pos_.end_, what, rx_number) ) {
+    // -?(0|[1-9]\d*)(\.\d+)?([eE][+-]?\d+)?
+    auto c = pos_.cursor_, end = pos_.end_ ;
+    size_t n = ( c != end && *c == '-' ) ? 1 : 0 ;
+
+    size_t digits = scan_digits(c + n, end) ;
+    if ( digits == 0 ) {
         pos_ = cur ;
         return nullptr ;
     }
-    else {
-        string val = what[0] ;
-        string dec = what[2] ;
-        string exp = what[3] ;
-        size_t len = val.length() ;
-        pos_.cursor_ += len ;
-        pos_.column_ += len ;
-        if ( dec.empty() && exp.empty() ) {
-          try {
-              int64_t i = stoll(val) ;
-              return NodePtr(new LiteralNode(i)) ;
-          } catch ( std::invalid_argument & ) {
-              pos_ = cur ;
-              return nullptr ;
-          } catch ( std::out_of_range & ) {
-              pos_ = cur ;
-              return nullptr ;
-          }
-        } else {
-            try {
-                double f = stod(val) ;
-                return NodePtr(new LiteralNode(f)) ;
-             } catch ( std::invalid_argument & ) {
-                pos_ = cur ;
-                return nullptr ;
-            } catch ( std::out_of_range & ) {
-                pos_ = cur ;
-                return nullptr ;
-            }
+    n += ( c[n] == '0' ) ? 1 : digits ;
+
+    bool dec = false, exp = false ;
+    if ( c + n != end && c[n] == '.' ) {
+        size_t frac = scan_digits(c + n + 1, end) ;
+        if ( frac ) {
+            n += frac + 1 ;
+            dec = true ;
+        }
+    }
+    if ( c + n != end && ( c[n] == 'e' || c[n] == 'E' ) ) {
+        size_t m = n + 1 ;
+        if ( c + m != end && ( c[m] == '+' || c[m] == '-' ) ) ++m ;
+        size_t e = scan_digits(c + m, end) ;
+        if ( e ) {
+            n = m + e ;
+            exp = true ;
+        }
+    }
+
+    string val(c, c + n) ;
+    pos_.cursor_ += n ;
+    pos_.column_ += n ;
+    if ( !dec && !exp ) {
+      try {
+          int64_t i = stoll(val) ;
+          return NodePtr(new LiteralNode(i)) ;
+      } catch ( std::invalid_argument & ) {
+          pos_ = cur ;
+          return nullptr ;
+      } catch ( std::out_of_range & ) {
+          pos_ = cur ;
+          return nullptr ;
+      }
+    } else {
+        try {
+            double f = stod(val) ;
+            return NodePtr(new LiteralNode(f)) ;
+         } catch ( std::invalid_argument & ) {
+            pos_ = cur ;
+            return nullptr ;
+        } catch ( std::out_of_range & ) {
+            pos_ = cur ;
+            return nullptr ;
         }
     }
 }
@@ -367,19 +399,19 @@ bool Parser::parseIdentifier(string &name)
 
 bool Parser::parseName(string &name)
 {
-    static regex rx_name(R"(^([a-zA-Z_][a-zA-Z0-9_]*))") ;
-
     skipSpace() ;
 
-    smatch what ;
-    if ( !regex_search(pos_.cursor_, pos_.end_, what, rx_name) ) return false ;
-    else {
-        name = what[0] ;
-        size_t len = name.length() ;
-        pos_.cursor_ += len ;
-        pos_.column_ += len ;
-        return true ;
-    }
+    // [a-zA-Z_][a-zA-Z0-9_]*
+    auto c = pos_.cursor_, end = pos_.end_ ;
+    if ( c == end || !( isalpha((unsigned char)*c) || *c == '_' ) ) return false ;
+
+    size_t len = 1 ;
+    while ( c + len != end && ( isalnum((unsigned char)c[len]) || c[len] == '_' ) ) ++len ;
+
+    name.assign(c, c + len) ;
+    pos_.cursor_ += len ;
+    pos_.column_ += len ;
+    return true ;
 }
 
 void  Parser::parseControlTag() {
@@ -479,7 +511,11 @@ bool Parser::parseControlTagDeclaration() {
             }
         } else throwException("filter name expected") ;
 
-        auto n = ContainerNodePtr(new FilterBlockNode(name, std::move(args))) ;
+        FunctionFactory::FilterHandle handle = FunctionFactory::instance().findFilter(name) ;
+        if ( !handle )
+            throwException("Unknown filter '" + name + "'") ;
+
+        auto n = ContainerNodePtr(new FilterBlockNode(FilterNodePtr(new FilterNode(name, handle, std::move(args))))) ;
         n->setLineAndColumn(saved.line_, saved.column_) ;
 
         addNode(n) ;
@@ -583,11 +619,13 @@ bool Parser::parseControlTagDeclaration() {
     }  else if ( tag_name == "endinclude" ) {
         popControlBlock("include") ;
     } else if ( tag_name == "autoescape" ) {
-        string mode = "html";
+        EscapeMode mode = EscapeMode::Html ;
+        string strategy ;
         if ( expect("false") )
-            mode = "no" ;
-        else if ( parseString(mode)) 
-        ;
+            mode = EscapeMode::None ;
+        else if ( parseString(strategy) && !parse_escape_mode(strategy, mode) )
+            throwException("unknown escaping strategy '" + strategy + "'") ;
+
         auto n = make_shared<AutoEscapeBlockNode>(mode) ;
         n->setLineAndColumn(saved.line_, saved.column_) ;
 
@@ -670,7 +708,7 @@ void Parser::parseSubstitutionTag() {
         throwException(msg) ;
     }
 
-    auto n = make_shared<SubstitutionBlockNode>(expr) ;
+    auto n = make_shared<SubstitutionBlockNode>(expr, escapeMode()) ;
     n->setLineAndColumn(saved.line_, saved.column_-1);
 
     addNode(n) ;
@@ -794,15 +832,19 @@ bool Parser::parseArgumentList(arg_list_t &args) {
 bool Parser::parseFilterChain(std::vector<FilterNodePtr> &filters) {
     string name ;
     while ( parseName(name) ) {
+        FunctionFactory::FilterHandle handle = FunctionFactory::instance().findFilter(name) ;
+        if ( !handle )
+            throwException("Unknown filter '" + name + "'") ;
+
         if ( expect('(') ) {
             arg_list_t args ;
             parseArgumentList(args) ;
             if ( !expect(')') )
                 throwException("No closing parenthesis") ;
 
-            filters.emplace_back(FilterNodePtr(new FilterNode(name, std::move(args))));
+            filters.emplace_back(FilterNodePtr(new FilterNode(name, handle, std::move(args))));
         } else {
-            filters.emplace_back(FilterNodePtr(new FilterNode(name, {})));
+            filters.emplace_back(FilterNodePtr(new FilterNode(name, handle, {})));
         }
 
         if ( !expect("|") ) break ;
@@ -934,7 +976,7 @@ NodePtr Parser::parseNullCoalescing() {
     auto left = parseOr();
     if ( expect("??") ) {
         auto right = parseNullCoalescing(); // right-associative
-        return NodePtr(new BinaryOperator("??", left, right)) ;
+        return NodePtr(new BinaryOperator(BinaryOperator::Coalesce, left, right)) ;
     } else 
         return left ;
 }
@@ -960,7 +1002,7 @@ NodePtr Parser::parseAnd() {
 NodePtr Parser::parseNot() {
     if ( expect("not") || expect("!") ) {
         auto expr = parseNot();
-        return NodePtr(new UnaryOperator('!', expr)) ;
+        return NodePtr(new UnaryOperator(UnaryOperator::Not, expr)) ;
     } else {
         return parseComparison() ;
     }
@@ -1042,7 +1084,7 @@ NodePtr Parser::parseConcat() {
     auto lhs = parseAddSub() ;
     while ( expect('~') ) {
         auto rhs = parseAddSub() ; 
-        lhs = NodePtr(new BinaryOperator("~", lhs, rhs)) ;
+        lhs = NodePtr(new BinaryOperator(BinaryOperator::Concat, lhs, rhs)) ;
     }
     return lhs ;
 }
@@ -1055,7 +1097,7 @@ NodePtr Parser::parseAddSub()
         if (expect('+')) {
             auto rhs = parseMulDiv();
             if (rhs)
-                lhs = NodePtr(new BinaryOperator("+", lhs, rhs));
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::Add, lhs, rhs));
             else
                 throwException("expecting expression after '+' in addition operator");
         }
@@ -1068,7 +1110,7 @@ NodePtr Parser::parseAddSub()
         else if (expect('-')) {
             auto rhs = parseMulDiv();
             if (rhs)
-                lhs = NodePtr(new BinaryOperator("-", lhs, rhs));
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::Subtract, lhs, rhs));
             else
                 throwException("expecting expression after '-' in subtraction operator");
         }
@@ -1086,21 +1128,21 @@ NodePtr Parser::parseMulDiv()
         if ( expect('*') ) {
             auto rhs = parseTest() ;
             if ( rhs )
-                lhs = NodePtr(new BinaryOperator("*", lhs, rhs)) ;
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::Multiply, lhs, rhs)) ;
             else
                 throwException("expecting expression after '*' in multiplication operator") ;
         
          } else if ( expect("//") ) {
             auto rhs = parseTest() ;
             if ( rhs )
-                lhs = NodePtr(new BinaryOperator("//", lhs, rhs)) ;
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::FloorDivide, lhs, rhs)) ;
             else
                 throwException("expecting expression after '//' in floor division operator") ;
         }
         else if ( expect('/') ) {
             auto rhs = parseTest() ;
             if ( rhs )
-                lhs = NodePtr(new BinaryOperator("/", lhs, rhs)) ;
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::Divide, lhs, rhs)) ;
             else
                 throwException("expecting expression after '/' in division operator") ;
         }
@@ -1111,7 +1153,7 @@ NodePtr Parser::parseMulDiv()
             }
             auto rhs = parseTest() ;
             if ( rhs )
-                lhs = NodePtr(new BinaryOperator("%", lhs, rhs)) ;
+                lhs = NodePtr(new BinaryOperator(BinaryOperator::Modulo, lhs, rhs)) ;
             else
                 throwException("expecting expression after '%' in modulus operator") ;
         }
@@ -1142,9 +1184,13 @@ NodePtr Parser::parseTest() {
         if ( name.empty() )
             throwException("test name expected") ;
 
+        FunctionFactory::TestHandle handle = FunctionFactory::instance().findTest(name) ;
+        if ( !handle )
+            throwException("Unknown test '" + name + "'") ;
+
         auto e = parseExpression() ;
        
-        return NodePtr(new TestExpressionNode(lhs, name, e, negation)) ;
+        return NodePtr(new TestExpressionNode(lhs, name, handle, e, negation)) ;
     } else return lhs ;
 }
 
@@ -1153,7 +1199,7 @@ NodePtr Parser::parseExponent() {
     if ( expect("**") ) {
         auto rhs = parseExponent() ; // right-associative
         if ( rhs )
-            return NodePtr(new BinaryOperator("**", lhs, rhs)) ;
+            return NodePtr(new BinaryOperator(BinaryOperator::Power, lhs, rhs)) ;
         else
             throwException("expecting expression after '**' in exponentiation operator") ;
     } else return lhs ;
@@ -1163,7 +1209,7 @@ NodePtr Parser::parseUnary() {
     if ( expect("-") ) {
         auto rhs = parseUnary() ; // right-associative
         if ( rhs )
-            return NodePtr(new UnaryOperator('-', rhs)) ;
+            return NodePtr(new UnaryOperator(UnaryOperator::Negate, rhs)) ;
         else
             throwException("expecting expression after '-' in unary minus operator") ;
     } else return parseFilterExpression() ;
@@ -1354,11 +1400,13 @@ NodePtr Parser::parsePrimary() {
 
 bool Parser::parseFunctionArg(FuncArg &arg) {
     string key ;
+    arg = FuncArg() ;
 
     if ( expect("...") ) {
         NodePtr pe = parseExpression() ;
         if ( pe ) {
-            arg.value_ = NodePtr(new SpreadOperator(pe)) ;
+            arg.value_ = pe ;
+            arg.spread_ = true ;
         } else 
             throwException("identifier needed after spread operator") ;
     } else {
@@ -130,6 +130,7 @@ private:
     bool parseKeyList(identifier_list_t &ids);
     bool parseImportList(key_alias_list_t &ids);
 
+    EscapeMode escapeMode() const ;
     void pushControlBlock(ContainerNodePtr node) ;
     void popControlBlock(const char *tag_name);
     void addNode(ContentNodePtr node) ;
@@ -0,0 +1,654 @@
+#include <twig/regex.hpp>
+
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <vector>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+using ByteSet = bitset<256> ;
+
+// thrown for features or syntax left to the next engine
+struct RegexUnsupported {} ;
+
+struct RegexNode {
+    enum Type { Set, Concat, Alt, Repeat, Begin, End } ;
+
+    RegexNode(Type t): type_(t) {}
+
+    Type type_ ;
+    ByteSet set_ ;
+    vector<unique_ptr<RegexNode>> children_ ;
+    int min_ = 0, max_ = -1 ; // repetition, max -1 for unbounded
+};
+
+using RegexNodePtr = unique_ptr<RegexNode> ;
+
+static ByteSet byte_range(int lo, int hi) {
+    ByteSet s ;
+    for( int c = lo ; c <= hi ; c++ ) s.set(c) ;
+    return s ;
+}
+
+static ByteSet digit_set() { return byte_range('0', '9') ; }
+
+static ByteSet word_set() {
+    ByteSet s = byte_range('0', '9') | byte_range('A', 'Z') | byte_range('a', 'z') ;
+    s.set('_') ;
+    return s ;
+}
+
+static ByteSet space_set() {
+    ByteSet s ;
+    for( char c: string(" \t\n\v\f\r") ) s.set((unsigned char)c) ;
+    return s ;
+}
+
+static int hex_value(char c) {
+    if ( c >= '0' && c <= '9' ) return c - '0' ;
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10 ;
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10 ;
+    return -1 ;
+}
+
+// Recursive descent parser of the ECMAScript subset handled by the automaton. Anything else throws
+// RegexUnsupported, including syntax errors, which std::regex then reports.
+
+class RegexParser {
+public:
+    RegexParser(const string &pattern, bool icase): p_(pattern), icase_(icase) {}
+
+    RegexNodePtr parse() {
+        RegexNodePtr n = parseAlt(0) ;
+        if ( i_ != p_.size() ) throw RegexUnsupported() ;
+        return n ;
+    }
+
+private:
+
+    static const int max_depth = 64 ;
+    static const int max_count = 1000 ;
+
+    bool more() const { return i_ < p_.size() ; }
+    char peek() const { return p_[i_] ; }
+
+    bool accept(char c) {
+        if ( more() && p_[i_] == c ) {
+            i_++ ;
+            return true ;
+        }
+        return false ;
+    }
+
+    RegexNodePtr makeSet(const ByteSet &s) {
+        RegexNodePtr n(new RegexNode(RegexNode::Set)) ;
+        n->set_ = icase_ ? fold(s) : s ;
+        return n ;
+    }
+
+    static ByteSet fold(ByteSet s) {
+        for( int c = 'a' ; c <= 'z' ; c++ ) {
+            if ( s.test(c) || s.test(c - 'a' + 'A') ) {
+                s.set(c) ;
+                s.set(c - 'a' + 'A') ;
+            }
+        }
+        return s ;
+    }
+
+    RegexNodePtr parseAlt(int depth) {
+        if ( depth > max_depth ) throw RegexUnsupported() ;
+
+        RegexNodePtr first = parseConcat(depth) ;
+        if ( !more() || peek() != '|' ) return first ;
+
+        RegexNodePtr alt(new RegexNode(RegexNode::Alt)) ;
+        alt->children_.push_back(std::move(first)) ;
+        while ( accept('|') )
+            alt->children_.push_back(parseConcat(depth)) ;
+        return alt ;
+    }
+
+    RegexNodePtr parseConcat(int depth) {
+        RegexNodePtr seq(new RegexNode(RegexNode::Concat)) ;
+        while ( more() && peek() != '|' && peek() != ')' )
+            seq->children_.push_back(parseRepeat(depth)) ;
+        return seq ;
+    }
+
+    bool parseCount(int &v) {
+        size_t b = i_ ;
+        v = 0 ;
+        while ( more() && isdigit((unsigned char)peek()) ) {
+            v = v * 10 + ( p_[i_++] - '0' ) ;
+            if ( v > max_count ) throw RegexUnsupported() ;
+        }
+        return i_ > b ;
+    }
+
+    RegexNodePtr parseRepeat(int depth) {
+        RegexNodePtr atom = parseAtom(depth) ;
+        if ( !more() ) return atom ;
+
+        int min, max ;
+        if ( accept('*') ) { min = 0 ; max = -1 ; }
+        else if ( accept('+') ) { min = 1 ; max = -1 ; }
+        else if ( accept('?') ) { min = 0 ; max = 1 ; }
+        else if ( accept('{') ) {
+            if ( !parseCount(min) ) throw RegexUnsupported() ;
+            max = min ;
+            if ( accept(',') && !parseCount(max) ) max = -1 ;
+            if ( !accept('}') || ( max != -1 && max < min ) ) throw RegexUnsupported() ;
+        }
+        else return atom ;
+
+        accept('?') ; // lazy, same language
+
+        if ( atom->type_ == RegexNode::Begin || atom->type_ == RegexNode::End ) throw RegexUnsupported() ;
+        if ( more() && ( peek() == '*' || peek() == '+' || peek() == '?' || peek() == '{' ) ) throw RegexUnsupported() ;
+
+        RegexNodePtr rep(new RegexNode(RegexNode::Repeat)) ;
+        rep->min_ = min ;
+        rep->max_ = max ;
+        rep->children_.push_back(std::move(atom)) ;
+        return rep ;
+    }
+
+    RegexNodePtr parseAtom(int depth) {
+        char c = p_[i_++] ;
+        switch ( c ) {
+        case '(': {
+            if ( accept('?') ) {
+                if ( !accept(':') ) throw RegexUnsupported() ; // lookaround
+            }
+            RegexNodePtr n = parseAlt(depth + 1) ;
+            if ( !accept(')') ) throw RegexUnsupported() ;
+            return n ;
+        }
+        case '[':
+            return makeSet(parseClass()) ;
+        case '.': {
+            ByteSet s ;
+            s.set() ;
+            s.reset('\n') ;
+            s.reset('\r') ;
+            return makeSet(s) ;
+        }
+        case '^':
+            return RegexNodePtr(new RegexNode(RegexNode::Begin)) ;
+        case '$':
+            return RegexNodePtr(new RegexNode(RegexNode::End)) ;
+        case '\\':
+            return parseEscape() ;
+        case '*': case '+': case '?': case '{': case '}': case ']': case ')':
+            throw RegexUnsupported() ;
+        default: {
+            ByteSet s ;
+            s.set((unsigned char)c) ;
+            return makeSet(s) ;
+        }
+        }
+    }
+
+    // \d \w \s and their negations
+    bool classEscape(char c, ByteSet &s) {
+        switch ( c ) {
+        case 'd': s = digit_set() ; return true ;
+        case 'D': s = ~digit_set() ; return true ;
+        case 'w': s = word_set() ; return true ;
+        case 'W': s = ~word_set() ; return true ;
+        case 's': s = space_set() ; return true ;
+        case 'S': s = ~space_set() ; return true ;
+        }
+        return false ;
+    }
+
+    // single character escape, the code point in cp
+    void charEscape(char c, uint32_t &cp) {
+        switch ( c ) {
+        case 't': cp = '\t' ; return ;
+        case 'n': cp = '\n' ; return ;
+        case 'r': cp = '\r' ; return ;
+        case 'f': cp = '\f' ; return ;
+        case 'v': cp = '\v' ; return ;
+        case '0':
+            if ( more() && isdigit((unsigned char)peek()) ) throw RegexUnsupported() ;
+            cp = 0 ;
+            return ;
+        case 'x': case 'u': {
+            int digits = ( c == 'x' ) ? 2 : 4 ;
+            cp = 0 ;
+            for( int k = 0 ; k < digits ; k++ ) {
+                int v = more() ? hex_value(p_[i_++]) : -1 ;
+                if ( v < 0 ) throw RegexUnsupported() ;
+                cp = cp * 16 + v ;
+            }
+            return ;
+        }
+        }
+        // back references, \b, \c etc.
+        if ( isalnum((unsigned char)c) ) throw RegexUnsupported() ;
+        cp = (unsigned char)c ;
+    }
+
+    RegexNodePtr parseEscape() {
+        if ( !more() ) throw RegexUnsupported() ;
+        char c = p_[i_++] ;
+
+        ByteSet s ;
+        if ( classEscape(c, s) ) return makeSet(s) ;
+
+        // std::regex truncates code points above \xFF to a char, leave those to it
+        uint32_t cp ;
+        charEscape(c, cp) ;
+        if ( cp > 0xFF ) throw RegexUnsupported() ;
+
+        s.set(cp) ;
+        return makeSet(s) ;
+    }
+
+    // one class member, either a character (returned in c) or a class escape (in s)
+    bool classAtom(int &c, ByteSet &s) {
+        if ( !more() ) throw RegexUnsupported() ;
+        char ch = p_[i_++] ;
+
+        if ( ch == '\\' ) {
+            if ( !more() ) throw RegexUnsupported() ;
+            char e = p_[i_++] ;
+            if ( classEscape(e, s) ) return false ;
+            if ( e == 'b' ) {
+                c = '\b' ;
+                return true ;
+            }
+            uint32_t cp ;
+            charEscape(e, cp) ;
+            if ( cp >= 0x80 ) throw RegexUnsupported() ;
+            c = cp ;
+            return true ;
+        }
+
+        // POSIX classes, multibyte characters
+        if ( ch == '[' && more() && ( peek() == ':' || peek() == '.' || peek() == '=' ) ) throw RegexUnsupported() ;
+        if ( (unsigned char)ch >= 0x80 ) throw RegexUnsupported() ;
+
+        c = (unsigned char)ch ;
+        return true ;
+    }
+
+    ByteSet parseClass() {
+        bool negate = accept('^') ;
+        if ( more() && peek() == ']' ) throw RegexUnsupported() ;
+
+        ByteSet set ;
+        while ( true ) {
+            if ( !more() ) throw RegexUnsupported() ;
+            if ( accept(']') ) break ;
+
+            int lo ;
+            ByteSet s ;
+            if ( !classAtom(lo, s) ) {
+                set |= s ;
+                continue ;
+            }
+
+            if ( i_ + 1 < p_.size() && peek() == '-' && p_[i_ + 1] != ']' ) {
+                i_++ ;
+                int hi ;
+                if ( !classAtom(hi, s) || hi < lo ) throw RegexUnsupported() ;
+                set |= byte_range(lo, hi) ;
+            } else
+                set.set(lo) ;
+        }
+
+        if ( icase_ ) set = fold(set) ;
+        return negate ? ~set : set ;
+    }
+
+    const string &p_ ;
+    size_t i_ = 0 ;
+    bool icase_ ;
+};
+
+// Thompson construction: a program of byte tests and epsilon moves. Both the DFA and the state set simulation
+// follow the epsilon moves iteratively, so neither recurses on the input.
+
+struct RegexInst {
+    enum Op : uint8_t { Test, Split, Jump, Begin, End, Match } ;
+    Op op_ ;
+    int arg_, arg1_ ; // set index for Test, targets for Split and Jump
+};
+
+class RegexProgram {
+public:
+
+    static const size_t max_insts = 10000 ;
+
+    void compile(const RegexNode *root) {
+        emit(root) ;
+        append(RegexInst::Match) ;
+        computeClasses() ;
+    }
+
+    // add the states reached from pc by epsilon moves; End is followed only at the end of the input and Begin only
+    // at its start, otherwise End is kept in the set to be resolved by acceptsAtEnd
+    void addClosure(vector<int> &states, vector<uint32_t> &mark, uint32_t gen, int pc, bool at_begin, bool at_end) const {
+        vector<int> stack{pc} ;
+        while ( !stack.empty() ) {
+            int p = stack.back() ;
+            stack.pop_back() ;
+            if ( mark[p] == gen ) continue ;
+            mark[p] = gen ;
+
+            const RegexInst &i = code_[p] ;
+            switch ( i.op_ ) {
+            case RegexInst::Jump:
+                stack.push_back(i.arg_) ;
+                break ;
+            case RegexInst::Split:
+                stack.push_back(i.arg1_) ;
+                stack.push_back(i.arg_) ;
+                break ;
+            case RegexInst::Begin:
+                if ( at_begin ) stack.push_back(p + 1) ;
+                break ;
+            case RegexInst::End:
+                if ( at_end ) stack.push_back(p + 1) ;
+                else states.push_back(p) ;
+                break ;
+            default:
+                states.push_back(p) ;
+            }
+        }
+    }
+
+    bool accepts(const vector<int> &states) const {
+        for( int p: states )
+            if ( code_[p].op_ == RegexInst::Match ) return true ;
+        return false ;
+    }
+
+    bool acceptsAtEnd(const vector<int> &states, bool at_begin) const {
+        vector<int> closure ;
+        vector<uint32_t> mark(code_.size(), 0) ;
+        for( int p: states ) {
+            if ( code_[p].op_ == RegexInst::Match ) return true ;
+            if ( code_[p].op_ == RegexInst::End ) addClosure(closure, mark, 1, p + 1, at_begin, true) ;
+        }
+        return accepts(closure) ;
+    }
+
+    // states after consuming a byte of class cls; a search restarts the pattern at every position
+    vector<int> step(const vector<int> &states, int cls, bool search, vector<uint32_t> &mark, uint32_t gen) const {
+        vector<int> next ;
+        for( int p: states ) {
+            const RegexInst &i = code_[p] ;
+            if ( i.op_ == RegexInst::Test && class_sets_[cls][i.arg_] ) addClosure(next, mark, gen, p + 1, false, false) ;
+        }
+        if ( search ) addClosure(next, mark, gen, 0, false, false) ;
+        sort(next.begin(), next.end()) ;
+        return next ;
+    }
+
+    vector<int> start() const {
+        vector<int> states ;
+        vector<uint32_t> mark(code_.size(), 0) ;
+        addClosure(states, mark, 1, 0, true, false) ;
+        sort(states.begin(), states.end()) ;
+        return states ;
+    }
+
+    vector<RegexInst> code_ ;
+    vector<ByteSet> sets_ ;
+    uint8_t classes_[256] ;       // bytes that no set tells apart share a class
+    vector<vector<bool>> class_sets_ ; // for each class, membership in each set
+    int num_classes_ = 0 ;
+
+private:
+
+    int append(RegexInst::Op op, int arg = 0, int arg1 = 0) {
+        if ( code_.size() >= max_insts ) throw RegexUnsupported() ;
+        code_.push_back(RegexInst{op, arg, arg1}) ;
+        return code_.size() - 1 ;
+    }
+
+    void emit(const RegexNode *n) {
+        switch ( n->type_ ) {
+        case RegexNode::Set:
+            sets_.push_back(n->set_) ;
+            append(RegexInst::Test, sets_.size() - 1) ;
+            break ;
+        case RegexNode::Concat:
+            for( const auto &c: n->children_ ) emit(c.get()) ;
+            break ;
+        case RegexNode::Alt: {
+            vector<int> jumps ;
+            for( size_t k = 0 ; k < n->children_.size() ; k++ ) {
+                if ( k + 1 < n->children_.size() ) {
+                    int split = append(RegexInst::Split) ;
+                    code_[split].arg_ = split + 1 ;
+                    emit(n->children_[k].get()) ;
+                    jumps.push_back(append(RegexInst::Jump)) ;
+                    code_[split].arg1_ = code_.size() ;
+                } else
+                    emit(n->children_[k].get()) ;
+            }
+            for( int j: jumps ) code_[j].arg_ = code_.size() ;
+            break ;
+        }
+        case RegexNode::Repeat: {
+            const RegexNode *c = n->children_[0].get() ;
+            for( int k = 0 ; k < n->min_ ; k++ ) emit(c) ;
+            if ( n->max_ == -1 ) {
+                int split = append(RegexInst::Split) ;
+                code_[split].arg_ = split + 1 ;
+                emit(c) ;
+                append(RegexInst::Jump, split) ;
+                code_[split].arg1_ = code_.size() ;
+            } else {
+                vector<int> splits ;
+                for( int k = n->min_ ; k < n->max_ ; k++ ) {
+                    int split = append(RegexInst::Split) ;
+                    code_[split].arg_ = split + 1 ;
+                    splits.push_back(split) ;
+                    emit(c) ;
+                }
+                for( int s: splits ) code_[s].arg1_ = code_.size() ;
+            }
+            break ;
+        }
+        case RegexNode::Begin:
+            append(RegexInst::Begin) ;
+            break ;
+        case RegexNode::End:
+            append(RegexInst::End) ;
+            break ;
+        }
+    }
+
+    void computeClasses() {
+        map<vector<bool>, int> ids ;
+        for( int b = 0 ; b < 256 ; b++ ) {
+            vector<bool> sig(sets_.size()) ;
+            for( size_t s = 0 ; s < sets_.size() ; s++ ) sig[s] = sets_[s].test(b) ;
+            auto it = ids.emplace(sig, (int)ids.size()).first ;
+            if ( it->second == (int)class_sets_.size() ) class_sets_.push_back(sig) ;
+            classes_[b] = it->second ;
+        }
+        num_classes_ = class_sets_.size() ;
+    }
+};
+
+// Subset construction done when the pattern is compiled, so that matching only reads tables and needs no locking.
+// Patterns whose automaton would be too large are matched by simulating the state sets instead.
+
+class RegexDfa {
+public:
+
+    static const size_t max_states = 2048 ;
+    static const size_t max_cells = 1 << 18 ;
+
+    bool build(const RegexProgram &prog, bool search) {
+        search_ = search ;
+        num_classes_ = prog.num_classes_ ;
+
+        // the start state accepts ^ at the end of an empty input, it is not merged with later states
+        map<pair<vector<int>, bool>, int> ids ;
+        vector<vector<int>> sets ;
+        vector<uint32_t> mark(prog.code_.size(), 0) ;
+        uint32_t gen = 0 ;
+
+        auto add = [&](vector<int> &&s, bool at_begin) {
+            auto key = make_pair(s, at_begin) ;
+            auto it = ids.find(key) ;
+            if ( it != ids.end() ) return it->second ;
+            int id = sets.size() ;
+            accept_.push_back(prog.accepts(s)) ;
+            accept_end_.push_back(prog.acceptsAtEnd(s, at_begin)) ;
+            dead_.push_back(s.empty()) ;
+            ids.emplace(std::move(key), id) ;
+            sets.push_back(std::move(s)) ;
+            return id ;
+        } ;
+
+        add(prog.start(), true) ;
+
+        for( size_t id = 0 ; id < sets.size() ; id++ ) {
+            if ( sets.size() > max_states || sets.size() * num_classes_ > max_cells ) return false ;
+            for( int cls = 0 ; cls < num_classes_ ; cls++ ) {
+                vector<int> next = prog.step(sets[id], cls, search, mark, ++gen) ;
+                int to = add(std::move(next), false) ;
+                next_.push_back(to) ;
+            }
+        }
+
+        for( int b = 0 ; b < 256 ; b++ ) classes_[b] = prog.classes_[b] ;
+        return true ;
+    }
+
+    bool run(string_view s) const {
+        int state = 0 ;
+        if ( search_ && accept_[state] ) return true ;
+        for( unsigned char c: s ) {
+            state = next_[state * num_classes_ + classes_[c]] ;
+            if ( search_ && accept_[state] ) return true ;
+            // no state left, e.g. a search anchored with ^ past the first character
+            if ( dead_[state] ) return false ;
+        }
+        return accept_end_[state] ;
+    }
+
+private:
+    bool search_ ;
+    int num_classes_ ;
+    uint8_t classes_[256] ;
+    vector<int> next_ ;
+    vector<bool> accept_, accept_end_, dead_ ;
+};
+
+// the search and match automata are built on first use, most patterns are only used in one mode
+class AutomatonMatcher: public RegexMatcher {
+public:
+    AutomatonMatcher(const RegexNode *root) {
+        prog_.compile(root) ;
+    }
+
+    bool search(string_view s) const override {
+        return search_dfa_.get(prog_, true) ? search_dfa_.dfa_.run(s) : simulate(s, true) ;
+    }
+
+    bool match(string_view s) const override {
+        return match_dfa_.get(prog_, false) ? match_dfa_.dfa_.run(s) : simulate(s, false) ;
+    }
+
+private:
+
+    struct LazyDfa {
+        // builds the automaton once, returns false if it is too large
+        bool get(const RegexProgram &prog, bool search) const {
+            std::call_once(once_, [&] { built_ = dfa_.build(prog, search) ; }) ;
+            return built_ ;
+        }
+
+        mutable std::once_flag once_ ;
+        mutable RegexDfa dfa_ ;
+        mutable bool built_ = false ;
+    };
+
+    bool simulate(string_view s, bool search) const {
+        vector<uint32_t> mark(prog_.code_.size(), 0) ;
+        uint32_t gen = 0 ;
+        vector<int> states = prog_.start() ;
+        bool at_begin = true ;
+
+        for( unsigned char c: s ) {
+            if ( search && prog_.accepts(states) ) return true ;
+            states = prog_.step(states, prog_.classes_[c], search, mark, ++gen) ;
+            if ( !search && states.empty() ) return false ;
+            at_begin = false ;
+        }
+        return prog_.acceptsAtEnd(states, at_begin) ;
+    }
+
+    RegexProgram prog_ ;
+    LazyDfa search_dfa_, match_dfa_ ;
+};
+
+class StdRegexMatcher: public RegexMatcher {
+public:
+    StdRegexMatcher(const string &pattern, bool icase):
+        rx_(pattern, icase ? regex::ECMAScript | regex::icase : regex::ECMAScript) {}
+
+    bool search(string_view s) const override {
+        return regex_search(s.begin(), s.end(), rx_) ;
+    }
+
+    bool match(string_view s) const override {
+        return regex_match(s.begin(), s.end(), rx_) ;
+    }
+
+private:
+    std::regex rx_ ;
+};
+
+}
+
+shared_ptr<const RegexMatcher> AutomatonRegexEngine::compile(const string &pattern, bool icase) const {
+    try {
+        detail::RegexNodePtr root = detail::RegexParser(pattern, icase).parse() ;
+        return make_shared<detail::AutomatonMatcher>(root.get()) ;
+    } catch ( detail::RegexUnsupported & ) {
+        return nullptr ;
+    }
+}
+
+shared_ptr<const RegexMatcher> StdRegexEngine::compile(const string &pattern, bool icase) const {
+    return make_shared<detail::StdRegexMatcher>(pattern, icase) ;
+}
+
+static mutex s_engine_mutex ;
+static shared_ptr<const RegexEngine> s_engine ;
+
+Regex::Regex(const string &pattern, bool icase) {
+    shared_ptr<const RegexEngine> engine ;
+    {
+        lock_guard<mutex> lock(s_engine_mutex) ;
+        engine = s_engine ;
+    }
+
+    if ( engine ) matcher_ = engine->compile(pattern, icase) ;
+    if ( !matcher_ ) matcher_ = AutomatonRegexEngine().compile(pattern, icase) ;
+    if ( !matcher_ ) matcher_ = StdRegexEngine().compile(pattern, icase) ;
+}
+
+void Regex::setEngine(shared_ptr<const RegexEngine> engine) {
+    lock_guard<mutex> lock(s_engine_mutex) ;
+    s_engine = std::move(engine) ;
+}
+
+}
@@ -1,6 +1,8 @@
 #include <twig/renderer.hpp>
 #include <twig/context.hpp>
 #include "parser.hpp"
+#include "bytecode.hpp"
+#include "optimizer.hpp"
 
 using namespace std ;
 namespace twig {
@@ -11,10 +13,15 @@ string TemplateRenderer::render(const string &resource, const Variant::Object &c
         auto ast = compile(resource) ;
 
         Context eval_ctx(*this, ctx, translation_mgr_, locale_) ;
-        
+
+        // leave some headroom over the expected size to avoid growing the buffer at the very end
+        size_t estimate = ast->outputEstimate() ;
 
         string res ;
+        res.reserve(estimate + estimate/8) ;
         ast->eval(eval_ctx, res) ;
+
+        ast->updateOutputEstimate(res.size()) ;
         return res ;
     } catch ( detail::ParseException &e ) {
         throw TemplateCompileException(string("Error compiling template \"") + resource + "\": " + e.what()) ;
@@ -25,6 +32,29 @@ string TemplateRenderer::render(const string &resource, const Variant::Object &c
     }
 }
 
+void TemplateRenderer::render(const string &resource, const Variant::Object &ctx, OutputSink &sink, bool ignore_missing)
+{
+    try {
+        auto ast = compile(resource) ;
+
+        string res ;
+        res.reserve(flush_threshold_) ;
+
+        Context eval_ctx(*this, ctx, translation_mgr_, locale_) ;
+        eval_ctx.sink_ = &sink ;
+        eval_ctx.sink_buffer_ = &res ;
+        eval_ctx.flush_threshold_ = flush_threshold_ ;
+
+        ast->eval(eval_ctx, res) ;
+
+        if ( !res.empty() ) sink.write(res.data(), res.size()) ;
+        sink.flush() ;
+    } catch ( detail::ParseException &e ) {
+        throw TemplateCompileException(string("Error compiling template \"") + resource + "\": " + e.what()) ;
+    } catch ( TemplateLoadException &e ) {
+        if ( !ignore_missing ) throw e ;
+    }
+}
 
 string TemplateRenderer::renderString(const string &str, const Variant::Object &ctx) {
     try {
@@ -44,12 +74,32 @@ string TemplateRenderer::renderString(const string &str, const Variant::Object &
 detail::DocumentNodePtr TemplateRenderer::compile(const std::string &resource)
 {
     if ( resource.empty() ) return nullptr ;
+
+    // concurrent requests for a template that is not yet cached share a single compilation
     if ( cache_ ) {
-        auto stored = cache_->fetch(resource) ;
-        if ( stored ) return stored ;
+        auto compiler = [this, &resource](Cache::EntryInfo &info) {
+            return compileResource(resource, info) ;
+        } ;
+
+        // a cached template is current as long as the version reported by the loader has not changed
+        auto validator = [this](const std::string &key, const TemplateVersion &version) {
+            try {
+                return loader_->version(key) == version ;
+            } catch ( TemplateLoadException & ) {
+                return false ;
+            }
+        } ;
+
+        return cache_->fetchOrAdd(resource, compiler, validator) ;
     }
 
-    string src = loader_->load(resource);
+    Cache::EntryInfo info ;
+    return compileResource(resource, info) ;
+}
+
+detail::DocumentNodePtr TemplateRenderer::compileResource(const std::string &resource, Cache::EntryInfo &info)
+{
+    string src = loader_->load(resource, info.version_);
 
     detail::Parser parser(src, this) ;
 
@@ -57,16 +107,46 @@ detail::DocumentNodePtr TemplateRenderer::compile(const std::string &resource)
 
     try {
         parser.parse(root, resource) ;
+        detail::Optimizer(*this).optimize(root.get()) ;
         root->populateBlocks() ;
+        root->populateDependencies() ;
     } catch ( detail::ParseException & e ) {
         throw TemplateCompileException(e.what()) ;
     }
 
-    if ( cache_ ) cache_->add(resource, root) ;
+    if ( bytecode_ ) lowerExpressions(root) ;
+
+    // resolve static inheritance before the document is shared, it is immutable from now on
+    root->linkParent(*this) ;
+
+    // the source length is used as an estimate of the size of the compiled template
+    info.size_ = src.size() ;
+    info.dependencies_ = root->dependencies_ ;
+
+    // the linked ancestors are part of the compiled template, it must be recompiled when any of them changes
+    root->version_ = info.version_ ;
+    for( detail::DocumentNode *p = root->parent_tmpl_.get() ; p ; p = p->parent_tmpl_.get() )
+        info.linked_.emplace(p->resource_, p->version_) ;
 
     return root ;
 }
 
+void TemplateRenderer::lowerExpressions(const detail::DocumentNodePtr &root) {
+    root->visitExpressions([](detail::NodePtr &e) {
+        detail::ExpressionCompiler::compile(e) ;
+    }) ;
+}
+
+size_t TemplateRenderer::getOutputEstimate(const string &resource) {
+    auto ast = compile(resource) ;
+    return ast ? ast->outputEstimate() : 0 ;
+}
+
+std::set<string> TemplateRenderer::getDependencies(const string &resource) {
+    auto ast = compile(resource) ;
+    return ast ? ast->dependencies_ : std::set<string>() ;
+}
+
 detail::DocumentNodePtr TemplateRenderer::compileString(const std::string &src) {
     detail::Parser parser(src, this) ;
 
@@ -74,11 +154,17 @@ detail::DocumentNodePtr TemplateRenderer::compileString(const std::string &src)
 
     try {
         parser.parse(root, "--string--") ;
+        detail::Optimizer(*this).optimize(root.get()) ;
         root->populateBlocks() ;
+        root->populateDependencies() ;
     } catch ( detail::ParseException & e ) {
         throw TemplateCompileException(e.what()) ;
     }
 
+    if ( bytecode_ ) lowerExpressions(root) ;
+
+    root->linkParent(*this) ;
+
     return root ;
 }
 
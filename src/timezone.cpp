@@ -0,0 +1,426 @@
+#include "timezone.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+using namespace std ;
+
+namespace twig {
+namespace detail {
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - ( a % b != 0 && ( a < 0 ) != ( b < 0 ) ) ;
+}
+
+// days since 1970-01-01 of a date of the proleptic Gregorian calendar (H. Hinnant's algorithm)
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2 ;
+    int64_t era = floor_div(y, 400) ;
+    int64_t yoe = y - era * 400 ;
+    int64_t doy = ( 153 * ( m > 2 ? m - 3 : m + 9 ) + 2 ) / 5 + d - 1 ;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy ;
+    return era * 146097 + doe - 719468 ;
+}
+
+static void civil_from_days(int64_t z, int64_t &y, int &m, int &d) {
+    z += 719468 ;
+    int64_t era = floor_div(z, 146097) ;
+    int64_t doe = z - era * 146097 ;
+    int64_t yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365 ;
+    int64_t doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 ) ;
+    int64_t mp = ( 5 * doy + 2 ) / 153 ;
+    d = static_cast<int>(doy - ( 153 * mp + 2 ) / 5 + 1) ;
+    m = static_cast<int>(mp < 10 ? mp + 3 : mp - 9) ;
+    y = yoe + era * 400 + ( m <= 2 ) ;
+}
+
+static bool is_leap(int64_t y) {
+    return ( y % 4 == 0 && y % 100 != 0 ) || y % 400 == 0 ;
+}
+
+static int days_in_month(int64_t y, int m) {
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 } ;
+    return ( m == 2 && is_leap(y) ) ? 29 : days[m - 1] ;
+}
+
+// 0 = Sunday
+static int weekday(int64_t days) {
+    return static_cast<int>(( days % 7 + 11 ) % 7) ;
+}
+
+// broken down form of seconds since the epoch
+static void seconds_to_tm(int64_t s, std::tm &tm) {
+    int64_t days = floor_div(s, 86400) ;
+    int64_t secs = s - days * 86400 ;
+    int64_t y ;
+    int m, d ;
+    civil_from_days(days, y, m, d) ;
+
+    tm.tm_year = static_cast<int>(y - 1900) ;
+    tm.tm_mon = m - 1 ;
+    tm.tm_mday = d ;
+    tm.tm_hour = static_cast<int>(secs / 3600) ;
+    tm.tm_min = static_cast<int>(secs / 60 % 60) ;
+    tm.tm_sec = static_cast<int>(secs % 60) ;
+    tm.tm_wday = weekday(days) ;
+    tm.tm_yday = static_cast<int>(days - days_from_civil(y, 1, 1)) ;
+}
+
+// inverse of the above, fields may be out of range
+static int64_t tm_to_seconds(const std::tm &tm) {
+    int64_t years = floor_div(tm.tm_mon, 12) ;
+    int64_t y = tm.tm_year + 1900LL + years ;
+    int m = static_cast<int>(tm.tm_mon - years * 12) + 1 ;
+    int64_t days = days_from_civil(y, m, 1) + tm.tm_mday - 1 ;
+    return days * 86400 + tm.tm_hour * 3600LL + tm.tm_min * 60LL + tm.tm_sec ;
+}
+
+// [+-]hh[[:]mm] as seconds east of UTC
+static bool parse_offset(const string &s, int &offset) {
+    size_t i = 0 ;
+    int sign = 1 ;
+    if ( i < s.size() && ( s[i] == '+' || s[i] == '-' ) ) sign = ( s[i++] == '-' ) ? -1 : 1 ;
+
+    auto digits = [&](size_t min, size_t max, int &v) {
+        size_t b = i ;
+        v = 0 ;
+        while ( i < s.size() && i - b < max && isdigit((unsigned char)s[i]) ) v = v * 10 + ( s[i++] - '0' ) ;
+        return i - b >= min ;
+    } ;
+
+    int hours, minutes = 0 ;
+    if ( !digits(1, 2, hours) ) return false ;
+    if ( i < s.size() ) {
+        if ( s[i] == ':' ) i++ ;
+        if ( !digits(2, 2, minutes) ) return false ;
+    }
+    if ( i != s.size() ) return false ;
+
+    offset = sign * ( hours * 3600 + minutes * 60 ) ;
+    return true ;
+}
+
+// names of the database, no absolute or relative paths
+static bool is_zone_name(const string &name) {
+    if ( name.empty() || name[0] == '/' || name.find("..") != string::npos ) return false ;
+    for( char c: name ) {
+        if ( !isalnum((unsigned char)c) && c != '_' && c != '-' && c != '+' && c != '/' ) return false ;
+    }
+    return true ;
+}
+
+static bool is_utc(const string &name) {
+    if ( name.size() != 3 ) return false ;
+    string upper = name ;
+    transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return toupper(c) ; }) ;
+    return upper == "UTC" || upper == "GMT" ;
+}
+
+static string zoneinfo_dir() {
+    const char *dir = getenv("TZDIR") ;
+    return ( dir && *dir ) ? dir : "/usr/share/zoneinfo" ;
+}
+
+const TimeZone *TimeZone::get(const string &name) {
+    static shared_mutex s_mutex ;
+    static unordered_map<string, unique_ptr<TimeZone>> s_zones ;
+
+    {
+        shared_lock<shared_mutex> lock(s_mutex) ;
+        auto it = s_zones.find(name) ;
+        if ( it != s_zones.end() ) return it->second.get() ;
+    }
+
+    // unknown names are not cached, they would let the map grow without bound
+    unique_ptr<TimeZone> zone(new TimeZone) ;
+    int offset ;
+    if ( name.empty() )
+        zone->local_ = true ;
+    else if ( is_utc(name) )
+        zone->types_.push_back(Type{0, false, "UTC"}) ;
+    else if ( parse_offset(name, offset) )
+        zone->types_.push_back(Type{offset, false, name}) ;
+    else if ( !is_zone_name(name) || !zone->loadFile(zoneinfo_dir() + '/' + name) )
+        return nullptr ;
+
+    unique_lock<shared_mutex> lock(s_mutex) ;
+    return s_zones.emplace(name, std::move(zone)).first->second.get() ;
+}
+
+// big endian signed integer of n bytes
+static int64_t read_be(const unsigned char *p, int n) {
+    uint64_t v = 0 ;
+    for( int i = 0 ; i < n ; i++ ) v = ( v << 8 ) | p[i] ;
+    if ( n < 8 && ( v >> ( 8 * n - 1 ) ) ) v |= ~uint64_t(0) << ( 8 * n ) ;
+    return static_cast<int64_t>(v) ;
+}
+
+// TZif format of RFC 8536: a version 1 block with 32 bit times, then for version 2 and later a second block with
+// 64 bit times followed by a POSIX TZ string for the times after the last transition
+bool TimeZone::loadFile(const string &path) {
+    ifstream strm(path, ios::binary) ;
+    if ( !strm ) return false ;
+
+    string data((istreambuf_iterator<char>(strm)), istreambuf_iterator<char>()) ;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data()) ;
+    const unsigned char *end = p + data.size() ;
+
+    enum { IsUtCnt, IsStdCnt, LeapCnt, TimeCnt, TypeCnt, CharCnt } ;
+
+    auto header = [&](const unsigned char *h, uint32_t counts[6]) {
+        if ( end - h < 44 || memcmp(h, "TZif", 4) != 0 ) return false ;
+        for( int i = 0 ; i < 6 ; i++ ) counts[i] = static_cast<uint32_t>(read_be(h + 20 + 4 * i, 4)) & 0xFFFFFFFF ;
+        return true ;
+    } ;
+
+    auto block_size = [](const uint32_t counts[6], size_t time_size) {
+        return counts[TimeCnt] * ( time_size + 1 ) + counts[TypeCnt] * 6 + counts[CharCnt] +
+               counts[LeapCnt] * ( time_size + 4 ) + counts[IsStdCnt] + counts[IsUtCnt] ;
+    } ;
+
+    uint32_t counts[6] ;
+    if ( !header(p, counts) ) return false ;
+
+    const unsigned char *h = p ;
+    size_t time_size = 4 ;
+    if ( p[4] >= '2' ) {
+        h = p + 44 + block_size(counts, 4) ;
+        if ( !header(h, counts) ) return false ;
+        time_size = 8 ;
+    }
+
+    const unsigned char *q = h + 44 ;
+    if ( static_cast<size_t>(end - q) < block_size(counts, time_size) ) return false ;
+    if ( counts[TypeCnt] == 0 || counts[TypeCnt] > 256 ) return false ;
+
+    for( uint32_t i = 0 ; i < counts[TimeCnt] ; i++, q += time_size )
+        transitions_.push_back(read_be(q, time_size)) ;
+
+    for( uint32_t i = 0 ; i < counts[TimeCnt] ; i++, q++ ) {
+        if ( *q >= counts[TypeCnt] ) return false ;
+        indices_.push_back(*q) ;
+    }
+
+    const char *chars = reinterpret_cast<const char *>(q + counts[TypeCnt] * 6) ;
+    for( uint32_t i = 0 ; i < counts[TypeCnt] ; i++, q += 6 ) {
+        uint8_t idx = q[5] ;
+        if ( idx >= counts[CharCnt] ) return false ;
+        types_.push_back(Type{static_cast<int32_t>(read_be(q, 4)), q[4] != 0,
+                              string(chars + idx, strnlen(chars + idx, counts[CharCnt] - idx))}) ;
+    }
+
+    q += counts[CharCnt] + counts[LeapCnt] * ( time_size + 4 ) + counts[IsStdCnt] + counts[IsUtCnt] ;
+
+    if ( time_size == 8 && q < end && *q == '\n' ) {
+        const unsigned char *e = std::find(q + 1, end, '\n') ;
+        if ( e != end && e > q + 1 )
+            has_rule_ = parseRule(string(q + 1, e)) ;
+    }
+
+    return true ;
+}
+
+// std offset [dst [offset] [,start[/time],end[/time]]] where offsets are positive west of UTC
+bool TimeZone::parseRule(const string &s) {
+    size_t i = 0 ;
+
+    auto name = [&](string &out) {
+        if ( i < s.size() && s[i] == '<' ) {
+            size_t e = s.find('>', i) ;
+            if ( e == string::npos ) return false ;
+            out = s.substr(i + 1, e - i - 1) ;
+            i = e + 1 ;
+            return true ;
+        }
+        size_t b = i ;
+        while ( i < s.size() && isalpha((unsigned char)s[i]) ) i++ ;
+        out = s.substr(b, i - b) ;
+        return i - b >= 3 ;
+    } ;
+
+    auto number = [&](int &v) {
+        size_t b = i ;
+        v = 0 ;
+        while ( i < s.size() && isdigit((unsigned char)s[i]) ) v = v * 10 + ( s[i++] - '0' ) ;
+        return i > b ;
+    } ;
+
+    // [+-]hh[:mm[:ss]]
+    auto time = [&](int32_t &secs) {
+        int sign = 1 ;
+        if ( i < s.size() && ( s[i] == '+' || s[i] == '-' ) ) sign = ( s[i++] == '-' ) ? -1 : 1 ;
+        int parts[3] = { 0, 0, 0 } ;
+        for( int k = 0 ; k < 3 ; k++ ) {
+            if ( k > 0 ) {
+                if ( i < s.size() && s[i] == ':' ) i++ ;
+                else break ;
+            }
+            if ( !number(parts[k]) ) return false ;
+        }
+        secs = sign * ( parts[0] * 3600 + parts[1] * 60 + parts[2] ) ;
+        return true ;
+    } ;
+
+    auto date = [&](Rule::Date &d) {
+        int v ;
+        d.time_ = 7200 ;
+        d.day_ = d.week_ = d.month_ = 0 ;
+        if ( i < s.size() && s[i] == 'M' ) {
+            int m, w, wd ;
+            i++ ;
+            if ( !number(m) || i >= s.size() || s[i++] != '.' || !number(w) || i >= s.size() || s[i++] != '.' || !number(wd) )
+                return false ;
+            if ( m < 1 || m > 12 || w < 1 || w > 5 || wd > 6 ) return false ;
+            d.kind_ = Rule::MonthWeekDay ;
+            d.month_ = m ;
+            d.week_ = w ;
+            d.day_ = wd ;
+        } else if ( i < s.size() && s[i] == 'J' ) {
+            i++ ;
+            if ( !number(v) || v < 1 || v > 365 ) return false ;
+            d.kind_ = Rule::Julian1 ;
+            d.day_ = v ;
+        } else {
+            if ( !number(v) || v > 365 ) return false ;
+            d.kind_ = Rule::Julian0 ;
+            d.day_ = v ;
+        }
+        if ( i < s.size() && s[i] == '/' ) {
+            i++ ;
+            if ( !time(d.time_) ) return false ;
+        }
+        return true ;
+    } ;
+
+    Rule r ;
+    int32_t offset ;
+    if ( !name(r.std_.abbrev_) || !time(offset) ) return false ;
+    r.std_.offset_ = -offset ;
+    r.std_.dst_ = false ;
+
+    if ( i < s.size() ) {
+        if ( !name(r.dst_.abbrev_) ) return false ;
+        r.has_dst_ = true ;
+        r.dst_.dst_ = true ;
+        r.dst_.offset_ = r.std_.offset_ + 3600 ;
+        if ( i < s.size() && s[i] != ',' ) {
+            if ( !time(offset) ) return false ;
+            r.dst_.offset_ = -offset ;
+        }
+
+        if ( i < s.size() ) {
+            if ( s[i++] != ',' || !date(r.start_) || i >= s.size() || s[i++] != ',' || !date(r.end_) ) return false ;
+        } else {
+            // no rule given, the POSIX default is the US one
+            r.start_ = Rule::Date{Rule::MonthWeekDay, 0, 2, 3, 7200} ;
+            r.end_ = Rule::Date{Rule::MonthWeekDay, 0, 1, 11, 7200} ;
+        }
+    }
+
+    if ( i != s.size() ) return false ;
+
+    rule_ = r ;
+    return true ;
+}
+
+// local seconds since the epoch of a transition date in year y
+int64_t TimeZone::transitionTime(int64_t y, const Rule::Date &d) {
+    int64_t days ;
+    switch ( d.kind_ ) {
+    case Rule::Julian1: // February 29 is never counted
+        days = days_from_civil(y, 1, 1) + d.day_ - 1 + ( is_leap(y) && d.day_ >= 60 ) ;
+        break ;
+    case Rule::Julian0:
+        days = days_from_civil(y, 1, 1) + d.day_ ;
+        break ;
+    default: { // day of the week of the given week of the month, week 5 is the last
+        int64_t first = days_from_civil(y, d.month_, 1) ;
+        int mday = ( d.day_ - weekday(first) + 7 ) % 7 + ( d.week_ - 1 ) * 7 ;
+        while ( mday >= days_in_month(y, d.month_) ) mday -= 7 ;
+        days = first + mday ;
+    }
+    }
+    return days * 86400 + d.time_ ;
+}
+
+const TimeZone::Type &TimeZone::ruleTypeAt(int64_t t) const {
+    if ( !rule_.has_dst_ ) return rule_.std_ ;
+
+    int64_t y ;
+    int m, d ;
+    civil_from_days(floor_div(t + rule_.std_.offset_, 86400), y, m, d) ;
+
+    // start is given in standard time and end in daylight time
+    int64_t start = transitionTime(y, rule_.start_) - rule_.std_.offset_ ;
+    int64_t end = transitionTime(y, rule_.end_) - rule_.dst_.offset_ ;
+
+    bool dst = ( start < end ) ? ( t >= start && t < end ) : !( t >= end && t < start ) ;
+    return dst ? rule_.dst_ : rule_.std_ ;
+}
+
+const TimeZone::Type &TimeZone::typeAt(int64_t t) const {
+    if ( transitions_.empty() || t >= transitions_.back() ) {
+        if ( has_rule_ ) return ruleTypeAt(t) ;
+        return transitions_.empty() ? types_[0] : types_[indices_.back()] ;
+    }
+
+    auto it = upper_bound(transitions_.begin(), transitions_.end(), t) ;
+    if ( it == transitions_.begin() ) return types_[0] ;
+    return types_[indices_[it - transitions_.begin() - 1]] ;
+}
+
+int TimeZone::offset(int64_t t) const {
+    if ( local_ ) {
+        std::time_t tt = static_cast<std::time_t>(t) ;
+        std::tm tm ;
+        localtime_r(&tt, &tm) ;
+        return static_cast<int>(tm.tm_gmtoff) ;
+    }
+    return typeAt(t).offset_ ;
+}
+
+void TimeZone::toLocal(int64_t t, std::tm &tm) const {
+    if ( local_ ) {
+        std::time_t tt = static_cast<std::time_t>(t) ;
+        localtime_r(&tt, &tm) ;
+        return ;
+    }
+
+    const Type &type = typeAt(t) ;
+    seconds_to_tm(t + type.offset_, tm) ;
+    tm.tm_isdst = type.dst_ ;
+    tm.tm_gmtoff = type.offset_ ;
+    tm.tm_zone = type.abbrev_.c_str() ;
+}
+
+int64_t TimeZone::fromLocal(std::tm &tm) const {
+    if ( local_ ) {
+        tm.tm_isdst = -1 ;
+        return static_cast<int64_t>(std::mktime(&tm)) ;
+    }
+
+    // offsets in effect a day before and after; transitions are further apart than that
+    int64_t local = tm_to_seconds(tm) ;
+    int before = offset(local - 86400), after = offset(local + 86400) ;
+    int64_t t_before = local - before, t_after = local - after ;
+    bool valid_before = offset(t_before) == before, valid_after = offset(t_after) == after ;
+
+    int64_t t ;
+    if ( valid_before && valid_after ) t = std::min(t_before, t_after) ;
+    else if ( valid_after ) t = t_after ;
+    else t = t_before ;
+
+    toLocal(t, tm) ;
+    return t ;
+}
+
+}
+}
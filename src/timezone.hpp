@@ -0,0 +1,75 @@
+#ifndef TWIG_TIMEZONE_HPP
+#define TWIG_TIMEZONE_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace twig {
+namespace detail {
+
+// Time zone of a date argument. IANA zones are read from the TZif files of the system database (TZDIR or
+// /usr/share/zoneinfo) and converted with integer arithmetic, so conversions do not touch the TZ environment
+// variable and are safe to run concurrently.
+
+class TimeZone {
+public:
+
+    // Zone by name: empty for local time, "UTC" or "GMT", a fixed offset ("+05:30", "-0800", "+5") or an IANA name
+    // ("Europe/London"). Zones are loaded on first use and kept for the lifetime of the process; null if unknown.
+    static const TimeZone *get(const std::string &name) ;
+
+    // offset from UTC in seconds at the UTC time t
+    int offset(int64_t t) const ;
+
+    // broken down local time of the UTC time t
+    void toLocal(int64_t t, std::tm &tm) const ;
+
+    // UTC time of the local time in tm, normalizing its fields like mktime; tm_isdst is ignored. Ambiguous times
+    // resolve to the earlier instant and times skipped by a transition use the offset before it.
+    int64_t fromLocal(std::tm &tm) const ;
+
+private:
+
+    TimeZone() = default ;
+
+    struct Type {
+        int32_t offset_ ;
+        bool dst_ ;
+        std::string abbrev_ ;
+    };
+
+    // POSIX TZ string of the TZif footer, used after the last transition
+    struct Rule {
+        enum Kind : uint8_t { Julian1, Julian0, MonthWeekDay } ;
+
+        struct Date {
+            Kind kind_ ;
+            int16_t day_, week_, month_ ;
+            int32_t time_ ; // local seconds after midnight
+        };
+
+        Type std_, dst_ ;
+        bool has_dst_ = false ;
+        Date start_, end_ ;
+    };
+
+    bool loadFile(const std::string &path) ;
+    bool parseRule(const std::string &s) ;
+    const Type &typeAt(int64_t t) const ;
+    const Type &ruleTypeAt(int64_t t) const ;
+    static int64_t transitionTime(int64_t y, const Rule::Date &d) ;
+
+    bool local_ = false ;
+    std::vector<int64_t> transitions_ ; // UTC, ascending
+    std::vector<uint8_t> indices_ ;     // type after each transition
+    std::vector<Type> types_ ;          // types_[0] applies before the first transition
+    Rule rule_ ;
+    bool has_rule_ = false ;
+};
+
+}
+}
+
+#endif
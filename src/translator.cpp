@@ -10,10 +10,22 @@
 
 namespace twig {
 
+// Message patterns are parsed once per translator and kept for the following calls. Patterns without ICU syntax
+// (no braces or apostrophes) are returned as they are without involving ICU.
+
 struct Translator::Impl {
     Impl(const std::string& target_locale) 
         : locale_str_(target_locale), locale_(target_locale.c_str()) {}
 
+    struct Message {
+        std::string text_ ;
+        bool plain_ ;
+    };
+
+    static bool isPlain(const std::string &pattern) {
+        return pattern.find_first_of("{}'") == std::string::npos ;
+    }
+
     bool loadTranslations(const std::string& filePath) {
         std::ifstream file(filePath);
         if (!file.is_open()) return false;
@@ -21,28 +33,73 @@ struct Translator::Impl {
         
         for (auto& [key, value] : j.toObject()) {
             if (value.isString()) {
-                translations_[key] = value.toString();
+                std::string text = value.toString() ;
+                bool plain = isPlain(text) ;
+                translations_[key] = Message{std::move(text), plain} ;
             }
         }
+
+        std::unique_lock<std::shared_mutex> lock(formats_mutex_) ;
+        formats_.clear() ;
         return true;
     }
 
+    // parsed pattern of the message, null if it is not valid; MessageFormat::format is const and safe to call
+    // concurrently
+    std::shared_ptr<const icu::MessageFormat> compileFormat(const std::string &pattern) {
+        UErrorCode status = U_ZERO_ERROR;
+        std::shared_ptr<const icu::MessageFormat> fmt =
+            std::make_shared<icu::MessageFormat>(icu::UnicodeString::fromUTF8(pattern), locale_, status) ;
+        if (U_FAILURE(status)) fmt.reset() ;
+        return fmt ;
+    }
+
+    // same as above for a translated message, which is parsed once
+    std::shared_ptr<const icu::MessageFormat> getFormat(const std::string &key, const std::string &pattern) {
+        {
+            std::shared_lock<std::shared_mutex> lock(formats_mutex_) ;
+            auto it = formats_.find(key) ;
+            if ( it != formats_.end() ) return it->second ;
+        }
+
+        std::shared_ptr<const icu::MessageFormat> fmt = compileFormat(pattern) ;
+
+        // another thread may have got there first, keep a single copy
+        std::unique_lock<std::shared_mutex> lock(formats_mutex_) ;
+        return formats_.emplace(key, fmt).first->second ;
+    }
+
     std::string translate(const std::string& key, 
                           const Variant::Object &args) {
 
-        string pattern ;
+        std::shared_ptr<const icu::MessageFormat> msgFmt ;
         auto it = translations_.find(key);
-        if (it == translations_.end()) pattern = key ;
-        else pattern = it->second ;
-
-        UErrorCode status = U_ZERO_ERROR;
-        icu::UnicodeString uc_pattern = icu::UnicodeString::fromUTF8(pattern);
-        icu::MessageFormat msgFmt(uc_pattern, locale_, status);
-        if (U_FAILURE(status)) return "Format Error";
+        if (it == translations_.end()) {
+            // untranslated keys are not cached, they may come from anywhere
+            if ( isPlain(key) ) return key ;
+            msgFmt = compileFormat(key) ;
+        } else {
+            if ( it->second.plain_ ) return it->second.text_ ;
+            msgFmt = getFormat(key, it->second.text_) ;
+        }
 
-        int argCount = args.size() ;
-        auto argumentNames = std::make_unique<icu::UnicodeString[]>(argCount);
-        auto arguments = std::make_unique<icu::Formattable[]>(argCount);
+        if ( !msgFmt ) return "Format Error";
+
+        // most messages have a few arguments
+        const size_t argCount = args.size() ;
+        icu::UnicodeString localNames[4] ;
+        icu::Formattable localArgs[4] ;
+        std::unique_ptr<icu::UnicodeString[]> heapNames ;
+        std::unique_ptr<icu::Formattable[]> heapArgs ;
+        icu::UnicodeString *argumentNames = localNames ;
+        icu::Formattable *arguments = localArgs ;
+
+        if ( argCount > 4 ) {
+            heapNames = std::make_unique<icu::UnicodeString[]>(argCount) ;
+            heapArgs = std::make_unique<icu::Formattable[]>(argCount) ;
+            argumentNames = heapNames.get() ;
+            arguments = heapArgs.get() ;
+        }
 
         int i = 0;
         for (const auto& [name, val] : args) {
@@ -56,10 +113,10 @@ struct Translator::Impl {
             i++;
         }
 
+        UErrorCode status = U_ZERO_ERROR;
         icu::UnicodeString result;
-        icu::FieldPosition pos(icu::FieldPosition::DONT_CARE);
 
-        msgFmt.format(argumentNames.get(), arguments.get(), argCount, result, status);
+        msgFmt->format(argumentNames, arguments, argCount, result, status);
 
         if (U_FAILURE(status)) {
             throw TranslationException("Evaluation Error: " + std::string(u_errorName(status)));
@@ -73,13 +130,18 @@ struct Translator::Impl {
 
     std::string locale_str_;
     icu::Locale locale_;
-    std::unordered_map<std::string, std::string> translations_;
+    std::unordered_map<std::string, Message> translations_;
+    // keyed by message key, only for keys with a translation
+    std::unordered_map<std::string, std::shared_ptr<const icu::MessageFormat>> formats_ ;
+    std::shared_mutex formats_mutex_ ;
 };
 
 Translator::Translator(const std::string &loc) {
     impl_.reset(new Impl(loc)) ;
 }
 
+Translator::~Translator() = default ;
+
 std::string Translator::getLocale() const { return impl_->locale_str_; }
 
 bool Translator::loadTranslations(const std::string& filePath) {
@@ -92,8 +154,53 @@ std::string Translator::translate(const std::string& key,
 }
 
 
+// language part of a locale name, e.g. "en" of "en_GB"
+static std::string_view language_of(std::string_view locale) {
+    return locale.substr(0, locale.find_first_of("_-.@")) ;
+}
+
+TranslationManager::TranslationManager(const std::string& default_locale)
+    : default_locale_(default_locale) {
+    auto snapshot = makeSnapshot({}) ;
+    snapshots_.push_back(snapshot) ;
+    snapshot_.store(snapshot.get(), std::memory_order_release) ;
+}
+
+std::shared_ptr<TranslationManager::Snapshot> TranslationManager::makeSnapshot(
+        std::unordered_map<std::string, std::shared_ptr<Translator>> translators) const {
+    auto snapshot = std::make_shared<Snapshot>() ;
+    snapshot->translators_ = std::move(translators) ;
+
+    // a translator for the bare language wins, then the default locale, then the first by name
+    auto rank = [this](const std::string &name) {
+        return name == language_of(name) ? 0 : name == default_locale_ ? 1 : 2 ;
+    } ;
+
+    for ( const auto &[name, translator]: snapshot->translators_ ) {
+        auto [it, inserted] = snapshot->languages_.emplace(language_of(name), translator) ;
+        if ( inserted ) continue ;
+
+        std::string current = it->second->getLocale() ;
+        if ( rank(name) < rank(current) || ( rank(name) == rank(current) && name < current ) )
+            it->second = translator ;
+    }
+
+    auto it = snapshot->translators_.find(default_locale_) ;
+    if ( it != snapshot->translators_.end() )
+        snapshot->default_ = it->second ;
+    else {
+        auto lit = snapshot->languages_.find(language_of(default_locale_)) ;
+        snapshot->default_ = lit != snapshot->languages_.end() ? lit->second : std::make_shared<Translator>(default_locale_) ;
+    }
+
+    return snapshot ;
+}
+
 void TranslationManager::loadAllFromDirectory(const std::string& dirPath) {
-    std::unique_lock<std::shared_mutex> lock(mutex);
+    std::lock_guard<std::mutex> lock(update_mutex_) ;
+
+    auto translators = snapshot_.load(std::memory_order_acquire)->translators_ ;
+
     for ( const auto& entry : std::filesystem::directory_iterator(dirPath)) {
         if ( entry.path().extension() == ".json" ) {
             std::string locale_name = entry.path().stem().string(); // e.g., "fr_FR"
@@ -101,41 +208,34 @@ void TranslationManager::loadAllFromDirectory(const std::string& dirPath) {
             auto translator = std::make_shared<Translator>(locale_name);
 
             if ( translator->loadTranslations(entry.path().string()) ) {
-                translators_[locale_name] = translator;
+                translators[locale_name] = translator;
             }
         }
     }
+
+    auto snapshot = makeSnapshot(std::move(translators)) ;
+    snapshots_.push_back(snapshot) ;
+    snapshot_.store(snapshot.get(), std::memory_order_release) ;
 }
 
 std::vector<std::string> TranslationManager::getSupportedLocales() const {
-    vector<string> res ;
-    for ( const auto &[key, _]: translators_)
+    std::vector<std::string> res ;
+    for ( const auto &[key, _]: snapshot_.load(std::memory_order_acquire)->translators_ )
         res.push_back(key) ;
     return res ;
 }
 
-    // Thread-safe lookup for a specific translator
-std::shared_ptr<Translator> TranslationManager::getTranslator(const std::string& requested_locale) {
-    std::shared_lock<std::shared_mutex> lock(mutex_);
-        
-    // 1. Match exact requested locale (e.g., "en_US")
-    auto it = translators_.find(requested_locale);
-    if ( it != translators_.end() ) return it->second;
-
-    // 2. Loose fallback fallback: Match language prefix (e.g., "en" from "en_GB")
-    if ( requested_locale.length() >= 2 ) {
-        std::string lang_prefix = requested_locale.substr(0, 2);
-        for (const auto& [name, translator] : translators_) {
-            if ( name.substr(0, 2) == lang_prefix ) return translator;
-        }
-    }
+std::shared_ptr<Translator> TranslationManager::getTranslator(const std::string& requested_locale) const {
+    const Snapshot *snapshot = snapshot_.load(std::memory_order_acquire) ;
 
-    auto fallback_it = translators_.find(default_locale_);
-    if ( fallback_it != translators_.end() ) return fallback_it->second;
+    auto it = snapshot->translators_.find(requested_locale) ;
+    if ( it != snapshot->translators_.end() ) return it->second ;
 
-        // empty translator
-    return std::make_shared<Translator>(default_locale_);
+    auto lit = snapshot->languages_.find(language_of(requested_locale)) ;
+    if ( lit != snapshot->languages_.end() ) return lit->second ;
+
+    return snapshot->default_ ;
 }
 
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,69 @@
+// Microbenchmark of the bytecode lowering of expressions. Renders expression heavy templates (arithmetic, attribute
+// access, short circuits and calls in a loop) with and without TemplateRenderer::setBytecode and checks that both
+// produce the same output. Run with an optional number of renders per measurement.
+
+#include <twig/renderer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+
+using namespace std ;
+using namespace twig ;
+
+static const map<string, string> templates = {
+    { "arith.twig", "{% for i in items %}{{ i.a * 2 + i.b - (i.a % 3) * i.b // 2 }} {{ i.a > 10 and i.b < 40 ? 'y' : 'n' }} "
+                    "{{ (i.a + 1) * (i.b - 1) >= n * 3 }}|{% endfor %}" },
+    { "attr.twig", "{% for i in items %}{{ i.user.name ~ ' ' ~ i.user.surname }} {{ i.user.age >= 18 and i.user.active ? 'adult' : 'minor' }} "
+                   "{{ i.tags[0] ?? '-' }} {{ not i.user.active or i.a == i.b }}|{% endfor %}" },
+    { "calls.twig", "{% for i in items %}{{ (i.a + i.b)|abs }} {{ cycle([i.a, i.b, n], i.a) }} {{ i.user.name|upper ~ '!' }} "
+                    "{{ [i.a, ...i.tags]|length }}|{% endfor %}" }
+};
+
+// best average time of a render in milliseconds
+static double run(TemplateRenderer &rdr, const string &name, const Variant::Object &ctx, size_t renders) {
+    double best = 1e9 ;
+    for( int rep = 0 ; rep < 7 ; rep++ ) {
+        auto start = chrono::steady_clock::now() ;
+        for( size_t r = 0 ; r < renders ; r++ )
+            rdr.render(name, ctx) ;
+        best = std::min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / renders) ;
+    }
+    return best ;
+}
+
+int main(int argc, char *argv[]) {
+    size_t renders = ( argc > 1 ) ? strtoul(argv[1], nullptr, 10) : 50 ;
+
+    Variant::Array items ;
+    for( int k = 0 ; k < 200 ; k++ ) {
+        Variant::Object user{{"name", "user" + to_string(k)}, {"surname", "x"}, {"age", k % 40}, {"active", k % 3 == 0}} ;
+        items.push_back(Variant::Object{{"a", k}, {"b", 50 - k % 50}, {"user", user}, {"tags", Variant::Array{"t" + to_string(k), "u"}}}) ;
+    }
+    Variant::Object ctx{{"items", items}, {"n", 7}} ;
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader(templates)) ;
+
+    printf("%-12s %12s %12s %8s\n", "ms/render", "tree", "bytecode", "speedup") ;
+
+    for( const auto &t: templates ) {
+        double ms[2] ;
+        string out[2] ;
+        for( int bytecode = 0 ; bytecode < 2 ; bytecode++ ) {
+            TemplateRenderer rdr(loader) ;
+            rdr.setCache(std::make_shared<Cache>()) ;
+            rdr.setBytecode(bytecode) ;
+            out[bytecode] = rdr.render(t.first, ctx) ;
+            ms[bytecode] = run(rdr, t.first, ctx, renders) ;
+        }
+
+        printf("%-12s %12.3f %12.3f %7.2fx%s\n", t.first.c_str(), ms[0], ms[1], ms[0] / ms[1],
+               out[0] == out[1] ? "" : " (output differs)") ;
+    }
+
+    return 0 ;
+}
@@ -0,0 +1,165 @@
+// Microbenchmark of the output escapers. Html and js are compared against the previous implementations (append per
+// character for html, string stream for js), the other strategies against their scalar kernels. Run with an optional
+// iteration count.
+
+#include "escape.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std ;
+using namespace twig ;
+
+static string baseline_escape_html(const string &src) {
+    string buffer ;
+    for ( char c: src ) {
+        switch(c) {
+        case '&':  buffer.append("&amp;");       break;
+        case '\"': buffer.append("&quot;");      break;
+        case '\'': buffer.append("&apos;");      break;
+        case '<':  buffer.append("&lt;");        break;
+        case '>':  buffer.append("&gt;");        break;
+        default:   buffer.push_back(c);          break;
+        }
+    }
+    return buffer ;
+}
+
+static string baseline_escape_js(const string &src) {
+    std::ostringstream escaped;
+
+    for (unsigned char c : src) {
+        switch (c) {
+            case '\\': escaped << "\\\\"; break;
+            case '"':  escaped << "\\\""; break;
+            case '\'': escaped << "\\'";  break;
+            case '\n': escaped << "\\n";  break;
+            case '\r': escaped << "\\r";  break;
+            case '\t': escaped << "\\t";  break;
+            case '\b': escaped << "\\b";  break;
+            case '\f': escaped << "\\f";  break;
+            case '/':  escaped << "\\/";  break;
+            case '\0': escaped << "\\0";  break;
+            default:
+                if (c < 0x20 || c == 0x7F) {
+                    escaped << "\\x"
+                            << "0123456789abcdef"[c >> 4]
+                            << "0123456789abcdef"[c & 0xF];
+                } else {
+                    escaped << c;
+                }
+        }
+    }
+
+    return escaped.str();
+}
+
+// text of the given length with a special character every period bytes (none if zero)
+static string make_input(size_t len, size_t period, char special) {
+    string s ;
+    for( size_t i = 0 ; i < len ; i++ )
+        s += ( period && i % period == period - 1 ) ? special : "lorem ipsum dolor sit amet "[i % 27] ;
+    return s ;
+}
+
+using Escaper = std::function<void (const string &src, string &out)> ;
+
+static double run(const Escaper &f, const vector<string> &inputs, size_t iterations) {
+    string out ;
+    size_t bytes = 0 ;
+
+    auto start = chrono::steady_clock::now() ;
+    for( size_t k = 0 ; k < iterations ; k++ ) {
+        for( const string &s: inputs ) {
+            out.clear() ;
+            f(s, out) ;
+            bytes += out.size() ;
+        }
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count() ;
+
+    size_t input_bytes = 0 ;
+    for( const string &s: inputs ) input_bytes += s.size() ;
+
+    if ( bytes == 0 && input_bytes != 0 ) printf("(no output)\n") ;
+    return ( input_bytes * iterations ) / secs / 1e6 ;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = ( argc > 1 ) ? strtoul(argv[1], nullptr, 10) : 20000 ;
+
+    struct Case {
+        const char *name_ ;
+        size_t len_, period_ ;
+    };
+
+    vector<Case> cases = {
+        { "short clean", 24, 0 },
+        { "long clean", 4096, 0 },
+        { "long sparse", 4096, 64 },
+        { "long dense", 4096, 4 }
+    };
+
+    Escaper html_baseline = [](const string &s, string &out) { out = baseline_escape_html(s) ; } ;
+    Escaper js_baseline = [](const string &s, string &out) { out = baseline_escape_js(s) ; } ;
+
+    auto scalar = [](detail::EscapeMode mode) -> Escaper {
+        return [mode](const string &s, string &out) { detail::escape_text_scalar(mode, s.data(), s.size(), out) ; } ;
+    };
+    auto simd = [](detail::EscapeMode mode) -> Escaper {
+        return [mode](const string &s, string &out) { detail::escape_text(mode, s.data(), s.size(), out) ; } ;
+    };
+
+    struct Strategy {
+        const char *name_ ;
+        detail::EscapeMode mode_ ;
+        Escaper baseline_ ;
+        char special_ ;
+    };
+
+    vector<Strategy> strategies = {
+        { "html", detail::EscapeMode::Html, html_baseline, '<' },
+        { "js", detail::EscapeMode::Js, js_baseline, '"' },
+        { "css", detail::EscapeMode::Css, nullptr, '#' },
+        { "url", detail::EscapeMode::Url, nullptr, '/' },
+        { "html_attr", detail::EscapeMode::HtmlAttr, nullptr, '"' }
+    };
+
+    // css, url and html_attr escape spaces, so "clean" text for them has none
+    auto input = [](const Case &c, const Strategy &st) {
+        string s = make_input(c.len_, c.period_, st.special_) ;
+        if ( st.mode_ == detail::EscapeMode::Css || st.mode_ == detail::EscapeMode::Url || st.mode_ == detail::EscapeMode::HtmlAttr ) {
+            for( size_t i = 0 ; i < s.size() ; i++ )
+                if ( s[i] == ' ' ) s[i] = 'x' ;
+        }
+        return s ;
+    };
+
+    printf("%-10s %-14s %12s %12s %12s\n", "MB/s", "", "baseline", "scalar", "simd") ;
+
+    size_t n = iterations / 100 + 1 ;
+
+    for( const Strategy &st: strategies ) {
+        for( const Case &c: cases ) {
+            vector<string> inputs ;
+            // same amount of text for every case
+            size_t count = 65536 / c.len_ ;
+            for( size_t i = 0 ; i < count ; i++ )
+                inputs.push_back(input(c, st)) ;
+
+            if ( st.baseline_ )
+                printf("%-10s %-14s %12.0f", st.name_, c.name_, run(st.baseline_, inputs, n)) ;
+            else
+                printf("%-10s %-14s %12s", st.name_, c.name_, "-") ;
+
+            printf(" %12.0f %12.0f\n", run(scalar(st.mode_), inputs, n), run(simd(st.mode_), inputs, n)) ;
+        }
+    }
+
+    return 0 ;
+}
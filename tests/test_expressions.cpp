@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
 #include <variant/variant.hpp>
 #include <twig/renderer.hpp>
+#include <twig/regex.hpp>
+
+#include <regex>
+#include <thread>
+#include <atomic>
 
 using namespace twig;
 using namespace std ;
@@ -51,6 +56,32 @@ TEST_F(ExpressiongTest, TernaryOperator) {
    
 }
 
+TEST_F(ExpressiongTest, IntegerArithmetic) {
+    TemplateRenderer rdr(nullptr) ;
+
+    vector<pair<string, string>> exprs{
+        { R"({{ 6 / 2 }})", "3" },
+        { R"({{ 7 / 2 }})", "3.5" },
+        { R"({{ 1 - 8 // 2 }})", "-3" },
+        { R"({{ (1 - 8) // 2 }})", "-4" },
+        { R"({{ (1 - 8) % 3 }})", "-1" },
+        { R"({{ 2 ** 62 }})", "4611686018427387904" },
+        { R"({{ 123456789 * 1000 + 7 }})", "123456789007" },
+        { R"({{ n * 3 - 1 }})", "29999999999" }
+    };
+
+    Variant::Object ctx{{"n", (int64_t)10000000000}} ;
+
+    try {
+        for ( auto &&expr: exprs ) {
+            string output =  rdr.renderString(expr.first, ctx) ;
+            EXPECT_STREQ(output.c_str(), expr.second.c_str()) ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+}
+
 TEST_F(ExpressiongTest, Arithmetic) {
   TemplateRenderer rdr(nullptr) ;
 
@@ -274,4 +305,127 @@ TEST_F(ExpressiongTest, Spread) {
     } catch ( std::exception &e ) {
         FAIL() << "Compilation failed: " << e.what() ;
     }
-}
\ No newline at end of file
+}
+
+TEST_F(ExpressiongTest, Bytecode) {
+    TemplateRenderer rdr(nullptr) ;
+    TemplateRenderer brdr(nullptr) ;
+    brdr.setBytecode() ;
+
+    Variant::Object ctx ;
+    ctx["a"] = Variant::Array{10, 20, Variant::Array{30, 35, 38}, 40, 42} ;
+    ctx["b"] = Variant::Object{{"name", "John"}, {"surname", "Miles"}, {"telephone", Variant::Array{"1234", "456"}}};
+    ctx["n"] = 7 ;
+    ctx["x"] = 2.5 ;
+
+    vector<string> exprs{
+        R"({{ 2 + (3 - 4)/3 }}{{ n * 2 - 1 }}{{ n // 2 }}{{ n % 3 }}{{ 2 ** n }}{{ -n + x }})",
+        R"({{ n > 5 and x < 3 ? 'yes' : 'no' }}{{ n > 5 and x > 3 ? 'yes' : 'no' }}{{ not (n > 5) or x == 2.5 }})",
+        R"({{ missing ?: 'def' }}{{ n ?: 'def' }}{{ missing ?? n }}{{ null ?? 'null' }}{{ false ? 1 }})",
+        R"({{ a[0+2][1] }}{{ b.name ~ ' ' ~ b.surname }}{{ b['telephone'][n - 6] }}{{ (b?.data) ?? "ok" }}{{ b.missing.key }})",
+        R"({{ 3 in [1, 2, n - 4] }}{{ 'oh' in 'John' }}{{ b.name starts with 'J' }}{{ "hello" matches "/^h.*o$/" }})",
+        R"({{ [n, x, ...[1, 2]] | join(',') }}{{ (n + 1) | abs }}{{ [10, 2, 40, 42]|filter(v => v > n * 5)|join(', ') }})",
+        R"({% for i in 1..n if i % 2 == 0 %}{{ i * loop.index }}{% if loop.last %}!{% elif i > 2 %},{% endif %}{% endfor %})",
+        R"({% set total = n * 3 %}{% set t2 = total + x %}{{ total }}-{{ t2 }}{{ (c = n + 1) }}{{ c }})",
+        R"({{ n is even ? 'even' : 'odd' }}{{ ( [34, 36, 38] has some v => v > n * 5 ) ? 'y' : 'n' }}{{ n == '7' }}{{ n === '7' }})",
+    };
+
+    try {
+        for ( auto &&expr: exprs ) {
+            string expected = rdr.renderString(expr, ctx) ;
+            string output = brdr.renderString(expr, ctx) ;
+            EXPECT_EQ(output, expected) << expr ;
+        }
+    } catch ( std::exception &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+}
+
+TEST_F(ExpressiongTest, Regex) {
+    vector<string> patterns{
+        "abc", "^abc$", "a.c", "^h.*o$", "a*", "a+b", "ab?c", "(ab)+", "(?:ab|cd)*e", "a|b|", "^$", "a{2}", "a{2,}",
+        "a{1,3}b", "x{0,2}y", "[a-c]+", "[^a-c]", "[-a]", "[a-]", "\\d+", "\\D", "\\w+@\\w+\\.com", "\\s", "[\\d.]+",
+        "[^\\s]+$", "\\.", "\\x41", "\\u0041", "a*?b", "(a|ab)(c|bcd)(d*)", "^(-?(?:0|[1-9]\\d*))(\\.\\d+)?",
+        "(a*)*b", "(a+)+$", "^[A-Z][a-z]*", "colou?r", "$a", "a^", "(^a|b)c", "c(a$|b)", "[\\]]", "\\t|\\n",
+        "[\\x30-\\x39]{3}", "(((a)))", "()x", "(|a)b", "$^", "a|^"
+    };
+    vector<string> inputs{
+        "", "a", "abc", "xabcx", "hello", "hallo", "aaab", "ababab", "abcde", "cdabe", "aa", "aaaa", "axy", "xxy",
+        "1.25", "-0.5e3", "01", "foo@bar.com", "foo@bar.org", "a b", "ABC", "Hello", "color", "colour", "]", "a\tb",
+        "\xc3\xa9t\xc3\xa9", "x\ny", "abcd", "abbcd", "aaaaaaaaaaaac", "123", "a1b2c3"
+    };
+
+    // the automaton agrees with std::regex
+    for ( bool icase: { false, true } ) {
+        for( const string &p: patterns ) {
+            auto automaton = AutomatonRegexEngine().compile(p, icase) ;
+            ASSERT_TRUE(automaton) << p ;
+            auto reference = StdRegexEngine().compile(p, icase) ;
+            for( const string &s: inputs ) {
+                EXPECT_EQ(automaton->search(s), reference->search(s)) << p << " search " << s << " icase " << icase ;
+                EXPECT_EQ(automaton->match(s), reference->match(s)) << p << " match " << s << " icase " << icase ;
+            }
+        }
+    }
+
+    // no backtracking blow up
+    Regex nested("(a+)+b") ;
+    EXPECT_FALSE(nested.search(string(10000, 'a'))) ;
+    EXPECT_TRUE(nested.match(string(10000, 'a') + "b")) ;
+
+    // large automata are simulated
+    Regex large("[ab]*a[ab]{12}c") ;
+    EXPECT_TRUE(large.search("xxba" + string(12, 'b') + "c")) ;
+    EXPECT_FALSE(large.search("xxba" + string(11, 'b') + "c")) ;
+
+    // the automata are built on first use, also when threads sharing the pattern race for it
+    auto shared = AutomatonRegexEngine().compile("-?(?:0|[1-9]\\d*)(\\.\\d+)?", false) ;
+    vector<std::thread> threads ;
+    std::atomic<int> failures{0} ;
+    for( int t = 0 ; t < 4 ; t++ ) {
+        threads.emplace_back([&] {
+            for( int k = 0 ; k < 100 ; k++ ) {
+                if ( !shared->search("x -0.5") || shared->search("x") ) failures++ ;
+                if ( !shared->match("-0.5") || shared->match("-0.5x") ) failures++ ;
+            }
+        }) ;
+    }
+    for( auto &t: threads ) t.join() ;
+    EXPECT_EQ(failures, 0) ;
+
+    // features left to std::regex
+    for( const string &p: { "(a)\\1", "a(?=b)", "\\bfoo\\b", "[[:digit:]]" } )
+        EXPECT_FALSE(AutomatonRegexEngine().compile(p, false)) << p ;
+    EXPECT_TRUE(Regex("(a)\\1").search("xaa")) ;
+    EXPECT_FALSE(Regex("(a)\\1").search("xab")) ;
+    EXPECT_TRUE(Regex("\\bfoo\\b").search("a foo b")) ;
+    EXPECT_FALSE(Regex("\\bfoo\\b").search("afoob")) ;
+
+    EXPECT_THROW(Regex("(ab"), std::regex_error) ;
+    EXPECT_THROW(Regex("a{2,1}"), std::regex_error) ;
+    EXPECT_THROW(Regex("[b-a]"), std::regex_error) ;
+
+    // a custom engine is tried first
+    struct PrefixEngine: public RegexEngine {
+        struct Matcher: public RegexMatcher {
+            Matcher(const string &p): prefix_(p) {}
+            bool search(string_view s) const override { return s.substr(0, prefix_.size()) == prefix_ ; }
+            bool match(string_view s) const override { return s == prefix_ ; }
+            string prefix_ ;
+        };
+        shared_ptr<const RegexMatcher> compile(const string &pattern, bool) const override {
+            if ( pattern.empty() || pattern[0] != '=' ) return nullptr ;
+            return make_shared<Matcher>(pattern.substr(1)) ;
+        }
+    };
+
+    Regex::setEngine(make_shared<PrefixEngine>()) ;
+    EXPECT_TRUE(Regex("=a.").search("a.b")) ;
+    EXPECT_FALSE(Regex("=a.").search("abc")) ;
+    EXPECT_TRUE(Regex("a.").search("abc")) ;
+    Regex::setEngine(nullptr) ;
+    EXPECT_FALSE(Regex("=a.").search("a.b")) ;
+
+    TemplateRenderer rdr(nullptr) ;
+    EXPECT_EQ(rdr.renderString(R"({{ "Hello" matches "/^h.*O$/i" ? 'y' : 'n' }}{{ "x12" matches "#\d{2}$#" ? 'y' : 'n' }})", {}), "yy") ;
+}
@@ -2,6 +2,8 @@
 #include <variant/variant.hpp>
 #include <twig/renderer.hpp>
 #include <ctime>
+#include <atomic>
+#include <thread>
 
 using namespace twig;
 using namespace std ;
@@ -46,6 +48,78 @@ TEST_F(FunctionTest, DateFilterStatic) {
     }
 }
 
+TEST_F(FunctionTest, DateTimeZones) {
+    TemplateRenderer rdr(nullptr) ;
+
+    // the offset in effect at the date, not the current one
+    EXPECT_EQ(rdr.renderString("{{ 1716215640|date('Y-m-d H:i', 'Europe/London') }}", {}), "2024-05-20 15:34") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704067200|date('Y-m-d H:i', 'Europe/London') }}", {}), "2024-01-01 00:00") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704067200|date('Y-m-d H:i', 'America/New_York') }}", {}), "2023-12-31 19:00") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704067200|date('Y-m-d H:i', 'Australia/Sydney') }}", {}), "2024-01-01 11:00") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704067200|date('Y-m-d H:i', '+05:30') }}", {}), "2024-01-01 05:30") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704067200|date('Y-m-d H:i', 'UTC') }}", {}), "2024-01-01 00:00") ;
+
+    // past the last transition of the file, from the POSIX rule
+    EXPECT_EQ(rdr.renderString("{{ 4118126400|date('Y-m-d H:i', 'Europe/London') }}", {}), "2100-07-01 13:00") ;
+
+    EXPECT_EQ(rdr.renderString("{{ date('2024-07-01 12:00', 'America/New_York') }}", {}), "1719849600") ;
+    EXPECT_EQ(rdr.renderString("{{ date('2024-07-01 12:00', '-04:00') }}", {}), "1719849600") ;
+    // skipped by the spring transition: the offset before it applies
+    EXPECT_EQ(rdr.renderString("{{ '2024-03-31 01:30'|date('H:i', 'Europe/London') }}", {}), "02:30") ;
+    // repeated by the autumn transition: the earlier instant
+    EXPECT_EQ(rdr.renderString("{{ date('2024-10-27 01:30', 'Europe/London') }}", {}), "1729989000") ;
+
+    EXPECT_THROW(rdr.renderString("{{ date('2024-01-01', 'Nowhere/Zone') }}", {}), TemplateRuntimeException) ;
+    EXPECT_THROW(rdr.renderString("{{ date('2024-01-01', '../../etc/passwd') }}", {}), TemplateRuntimeException) ;
+
+    // concurrent renders in different zones
+    vector<thread> threads ;
+    atomic<int> errors{0} ;
+    const vector<pair<string, string>> zones = { { "Europe/London", "01:00" }, { "America/New_York", "20:00" },
+                                                 { "Asia/Tokyo", "09:00" }, { "+02:00", "02:00" } } ;
+    for( const auto &[zone, expected]: zones ) {
+        threads.emplace_back([&, zone = zone, expected = expected]() {
+            TemplateRenderer r(nullptr) ;
+            for( int i = 0 ; i < 200 ; i++ ) {
+                if ( r.renderString("{{ 1719792000|date('H:i', z) }}", Variant::Object{{"z", zone}}) != expected ) ++errors ;
+            }
+        }) ;
+    }
+    for( auto &t: threads ) t.join() ;
+    EXPECT_EQ(errors, 0) ;
+}
+
+TEST_F(FunctionTest, DateFormats) {
+    TemplateRenderer rdr(nullptr) ;
+
+    // Monday 2024-05-20 14:34:05 UTC
+    Variant::Object data{{"t", 1716215645}} ;
+    auto fmt = [&](const string &f, const string &tz = "UTC") {
+        return rdr.renderString("{{ t|date(f, tz) }}", Variant::Object{{"t", 1716215645}, {"f", f}, {"tz", tz}}) ;
+    } ;
+
+    EXPECT_EQ(fmt("Y-m-d H:i:s"), "2024-05-20 14:34:05") ;
+    EXPECT_EQ(fmt("d D j l N S w z"), "20 Mon 20 Monday 1 th 1 140") ;
+    EXPECT_EQ(fmt("F m M n t L y"), "May 05 May 5 31 1 24") ;
+    EXPECT_EQ(fmt("a A g G h H i s"), "pm PM 2 14 02 14 34 05") ;
+    EXPECT_EQ(fmt("U"), "1716215645") ;
+    EXPECT_EQ(fmt("c"), "2024-05-20T14:34:05+00:00") ;
+    EXPECT_EQ(fmt("r", "Europe/London"), "Mon, 20 May 2024 15:34:05 +0100") ;
+    EXPECT_EQ(fmt("O P T", "America/New_York"), "-0400 -04:00 EDT") ;
+    EXPECT_EQ(fmt("\\Y\\e\\a\\r: Y, \\d\\a\\y: jS"), "Year: 2024, day: 20th") ;
+    EXPECT_EQ(fmt(""), "") ;
+    EXPECT_EQ(rdr.renderString("{{ t|date }}", data).substr(0, 6), "May 20") ;
+
+    EXPECT_EQ(rdr.renderString("{{ 1706745600|date('jS F', 'UTC') }}", {}), "1st February") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704153600|date('jS, g a', 'UTC') }}", {}), "2nd, 12 am") ;
+    EXPECT_EQ(rdr.renderString("{{ 1704326400|date('jS', 'UTC') }}", {}), "4th") ;
+
+    // ISO dates with and without time
+    EXPECT_EQ(rdr.renderString("{{ '2024-02-29'|date('Y-m-d H:i', 'UTC') }}", {}), "2024-02-29 00:00") ;
+    EXPECT_EQ(rdr.renderString("{{ '2024-02-29T08:15'|date('Y-m-d H:i', 'UTC') }}", {}), "2024-02-29 08:15") ;
+    EXPECT_EQ(rdr.renderString("{{ '29.02.2024 08:15'|date('Y-m-d H:i', 'UTC') }}", {}), "2024-02-29 08:15") ;
+}
+
 
 // Test Variant construction and type detection
 TEST_F(FunctionTest, Cycle) {
@@ -207,3 +281,262 @@ TEST_F(FunctionTest, Slice) {
         FAIL() << "Compilation failed: " << e.what() ;
     }
 }
+
+TEST_F(FunctionTest, PureFunctions) {
+    static int pure_calls = 0, impure_calls = 0 ;
+
+    FunctionFactory &ff = FunctionFactory::instance() ;
+    ff.registerFilter("test_pure", [](const Variant &target, const Variant &, Context &) -> Variant {
+        ++pure_calls ;
+        return target.toString() + "!" ;
+    }, Pure) ;
+    ff.registerFilter("test_impure", [](const Variant &target, const Variant &, Context &) -> Variant {
+        ++impure_calls ;
+        return target.toString() + "?" ;
+    }) ;
+
+    EXPECT_TRUE(FunctionFactory::hasFlags(ff.filterFlags("upper"), Pure)) ;
+    EXPECT_TRUE(FunctionFactory::hasFlags(ff.filterFlags("escape"), Pure | OutputSafe)) ;
+    EXPECT_FALSE(FunctionFactory::hasFlags(ff.functionFlags("date"), Deterministic)) ;
+    EXPECT_TRUE(FunctionFactory::hasFlags(ff.filterFlags("trans"), ContextDependent)) ;
+    EXPECT_FALSE(FunctionFactory::hasFlags(ff.filterFlags("map"), Pure)) ;
+    EXPECT_TRUE(FunctionFactory::hasFlags(ff.filterFlags("reduce"), ContextDependent)) ;
+    EXPECT_FALSE(FunctionFactory::hasFlags(ff.functionFlags("cycle"), Pure)) ;
+    EXPECT_EQ(ff.filterFlags("test_impure"), NoFlags) ;
+    EXPECT_EQ(ff.functionFlags("no_such_function"), NoFlags) ;
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"pure.twig", R"({{ 'a'|test_pure|upper }}{{ 'b'|test_impure }}{{ range(1, 3)|join(',') }}{{ x|test_pure }})"},
+        {"other.twig", ""}
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    rdr.setCache(std::make_shared<Cache>()) ;
+
+    try {
+        for( int i = 0 ; i < 3 ; i++ ) {
+            string output = rdr.render("pure.twig", {{"x", "c"}}) ;
+            EXPECT_EQ(output, "A!b?1,2,3c!") ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+
+    // the constant call is evaluated once when compiling, the one on a variable on every render
+    EXPECT_EQ(pure_calls, 1 + 3) ;
+    EXPECT_EQ(impure_calls, 3) ;
+}
+
+TEST_F(FunctionTest, BoundFilters) {
+    TemplateRenderer rdr(nullptr) ;
+
+    // unknown names are reported when compiling, even in code that is never executed
+    EXPECT_THROW(rdr.renderString(R"({% if false %}{{ x|no_such_filter }}{% endif %})", {}), TemplateCompileException) ;
+    EXPECT_THROW(rdr.renderString(R"({% apply no_such_filter %}x{% endapply %})", {}), TemplateCompileException) ;
+    EXPECT_THROW(rdr.renderString(R"({{ x is no_such_test }})", {}), TemplateCompileException) ;
+
+    // templates keep a handle to the registration, registering again replaces the callable
+    FunctionFactory &ff = FunctionFactory::instance() ;
+    ff.registerFilter("test_rebind", [](const Variant &target, const Variant &, Context &) -> Variant { return "one" ; }) ;
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"rebind.twig", R"({{ x|test_rebind }})"},
+        {"other.twig", ""}
+    })) ;
+    TemplateRenderer cached(loader) ;
+    cached.setCache(std::make_shared<Cache>()) ;
+
+    EXPECT_EQ(cached.render("rebind.twig", {{"x", 1}}), "one") ;
+    ff.registerFilter("test_rebind", [](const Variant &target, const Variant &, Context &) -> Variant { return "two" ; }) ;
+    EXPECT_EQ(cached.render("rebind.twig", {{"x", 1}}), "two") ;
+}
+
+TEST_F(FunctionTest, ArgumentPassing) {
+    FunctionFactory &ff = FunctionFactory::instance() ;
+
+    // parameters bound by position or by name
+    ff.registerFilter("test_wrap", [](const Variant &target, const Arguments &args, Context &) -> Variant {
+        const Variant &left = args.required(0, "left") ;
+        const Variant &right = args.get(1, "right") ;
+        return left.toString() + target.toString() + ( right.isUndefined() ? left.toString() : right.toString() ) ;
+    }) ;
+    ff.registerFunction("test_count", [](const Arguments &args, Context &) -> Variant {
+        return to_string(args.size()) + "/" + to_string(args.keywords()) ;
+    }) ;
+    // callables taking packed arguments still work
+    ff.registerFunction("test_packed", [](const Variant &args, Context &) -> Variant {
+        return args["args"].length() + args["kw"]["n"].toInteger() ;
+    }) ;
+
+    TemplateRenderer rdr(nullptr) ;
+
+    vector<pair<string, string>> tmpl = {
+        { R"({{ 'a'|test_wrap('[', ']') }})", "[a]" },
+        { R"({{ 'a'|test_wrap('*') }})", "*a*" },
+        { R"({{ 'a'|test_wrap(right: '>', left: '<') }})", "<a>" },
+        { R"({{ test_count(1, 2, 3, 4, 5, 6, x: 1) }})", "6/1" },
+        { R"({{ test_count(...[1, 2, 3, 4], 5, ...[6, 7]) }})", "7/0" },
+        { R"({{ test_packed(1, 2, n: 10) }})", "12" },
+        { R"({{ [1, 2, 3, 4, 5, 6]|slice(length: 2, start: 1)|join(',') }})", "2,3" }
+    };
+
+    try {
+        for( const auto &t: tmpl) {
+            string output = rdr.renderString(t.first, Variant::Object()) ;
+            EXPECT_EQ(output, t.second) << t.first ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+
+    EXPECT_THROW(rdr.renderString(R"({{ 'a'|test_wrap }})", {}), TemplateRuntimeException) ;
+}
+
+static string reference_escape_html(const string &src) {
+    string res ;
+    for( char c: src ) {
+        switch ( c ) {
+        case '&':  res += "&amp;" ; break ;
+        case '"':  res += "&quot;" ; break ;
+        case '\'': res += "&apos;" ; break ;
+        case '<':  res += "&lt;" ; break ;
+        case '>':  res += "&gt;" ; break ;
+        default:   res += c ;
+        }
+    }
+    return res ;
+}
+
+static string reference_escape_js(const string &src) {
+    string res ;
+    for( unsigned char c: src ) {
+        switch ( c ) {
+        case '\\': res += "\\\\" ; break ;
+        case '"':  res += "\\\"" ; break ;
+        case '\'': res += "\\'" ; break ;
+        case '\n': res += "\\n" ; break ;
+        case '\r': res += "\\r" ; break ;
+        case '\t': res += "\\t" ; break ;
+        case '\b': res += "\\b" ; break ;
+        case '\f': res += "\\f" ; break ;
+        case '/':  res += "\\/" ; break ;
+        case '\0': res += "\\0" ; break ;
+        default:
+            if ( c < 0x20 || c == 0x7f ) {
+                res += "\\x" ;
+                res += "0123456789abcdef"[c >> 4] ;
+                res += "0123456789abcdef"[c & 0xf] ;
+            } else
+                res += c ;
+        }
+    }
+    return res ;
+}
+
+TEST_F(FunctionTest, EscapeKernels) {
+    TemplateRenderer rdr(nullptr) ;
+
+    // special characters at every offset around the 16 and 32 byte blocks of the vectorized scanners
+    const string specials("&\"'<>\\/\n\t\x01\x7f\xe2\x80\xa8\0", 15) ;
+    const string filler = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" ;
+
+    for( size_t len : { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65 } ) {
+        for( size_t pos = 0 ; pos <= len ; pos += 3 ) {
+            for( char c: specials ) {
+                string s = filler.substr(0, len) ;
+                if ( pos < len ) s[pos] = c ;
+                if ( len > 1 ) s[len - 1] = specials[pos % specials.size()] ;
+
+                Variant::Object data{{"s", s}} ;
+                EXPECT_EQ(rdr.renderString("{{ s|e }}", data), reference_escape_html(s)) ;
+                EXPECT_EQ(rdr.renderString("{{ s|e('js') }}", data), reference_escape_js(s)) ;
+            }
+        }
+    }
+}
+
+// code points of valid UTF-8 text
+static vector<uint32_t> reference_decode(const string &src) {
+    vector<uint32_t> res ;
+    for( size_t i = 0 ; i < src.size() ; ) {
+        unsigned char c = src[i] ;
+        int n = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4 ;
+        uint32_t cp = n == 1 ? c : c & ( 0x3F >> ( n - 1 ) ) ;
+        for( int k = 1 ; k < n ; k++ ) cp = ( cp << 6 ) | ( src[i + k] & 0x3F ) ;
+        res.push_back(cp) ;
+        i += n ;
+    }
+    return res ;
+}
+
+static string hex(uint32_t v, int digits) {
+    char buf[16] ;
+    snprintf(buf, sizeof(buf), "%0*X", digits, v) ;
+    return buf ;
+}
+
+static string reference_escape_css(const string &src) {
+    string res ;
+    for( uint32_t cp: reference_decode(src) ) {
+        if ( cp < 0x80 && isalnum(cp) ) res += (char)cp ;
+        else res += "\\" + hex(cp, 1) + " " ;
+    }
+    return res ;
+}
+
+static string reference_escape_url(const string &src) {
+    string res ;
+    for( unsigned char c: src ) {
+        if ( isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ) res += c ;
+        else res += "%" + hex(c, 2) ;
+    }
+    return res ;
+}
+
+static string reference_escape_html_attr(const string &src) {
+    string res ;
+    for( uint32_t cp: reference_decode(src) ) {
+        if ( cp < 0x80 && ( isalnum(cp) || cp == ',' || cp == '-' || cp == '.' || cp == '_' ) ) res += (char)cp ;
+        else if ( cp == '&' ) res += "&amp;" ;
+        else if ( cp == '"' ) res += "&quot;" ;
+        else if ( cp == '<' ) res += "&lt;" ;
+        else if ( cp == '>' ) res += "&gt;" ;
+        else {
+            if ( ( cp < 0x20 && cp != '\t' && cp != '\n' && cp != '\r' ) || ( cp >= 0x7f && cp <= 0x9f ) ) cp = 0xFFFD ;
+            res += "&#x" + hex(cp, cp < 0x100 ? 2 : 4) + ";" ;
+        }
+    }
+    return res ;
+}
+
+TEST_F(FunctionTest, EscapeStrategies) {
+    TemplateRenderer rdr(nullptr) ;
+
+    Variant::Object data{{"s", "a b\"<&/\xc3\xa9\xe2\x82\xac"}} ;
+    EXPECT_EQ(rdr.renderString("{{ s|e('css') }}", data), "a\\20 b\\22 \\3C \\26 \\2F \\E9 \\20AC ") ;
+    EXPECT_EQ(rdr.renderString("{{ s|e('url') }}", data), "a%20b%22%3C%26%2F%C3%A9%E2%82%AC") ;
+    EXPECT_EQ(rdr.renderString("{{ s|e('html_attr') }}", data), "a&#x20;b&quot;&lt;&amp;&#x2F;&#xE9;&#x20AC;") ;
+    EXPECT_EQ(rdr.renderString("{{ '\x01\x7f'|e('html_attr') }}", {}), "&#xFFFD;&#xFFFD;") ;
+    EXPECT_EQ(rdr.renderString("{% autoescape 'url' %}{{ s }}{% endautoescape %}", data), "a%20b%22%3C%26%2F%C3%A9%E2%82%AC") ;
+    EXPECT_EQ(rdr.renderString("{% autoescape 'css' %}{{ 'x-1' }}{% endautoescape %}", {}), "x\\2D 1") ;
+    EXPECT_EQ(rdr.renderString("{{ s|e(false) }}", {{"s", "<"}}), "<") ;
+    EXPECT_THROW(rdr.renderString("{{ s|escape('htm') }}", data), TemplateRuntimeException) ;
+    EXPECT_THROW(rdr.renderString("{{ '<'|e(mode) }}", {{"mode", "none"}}), TemplateRuntimeException) ;
+
+    // multibyte sequences straddling the 16 and 32 byte blocks of the vectorized scanners
+    const vector<string> specials = { " ", "\"", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "-", "~", "," } ;
+    const string filler = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" ;
+
+    for( size_t len : { 0, 1, 15, 16, 17, 31, 32, 33, 47, 62 } ) {
+        for( size_t pos = 0 ; pos <= len ; pos++ ) {
+            for( const string &c: specials ) {
+                string s = filler.substr(0, len) ;
+                s.insert(pos, c) ;
+
+                Variant::Object data{{"s", s}} ;
+                EXPECT_EQ(rdr.renderString("{{ s|e('css') }}", data), reference_escape_css(s)) ;
+                EXPECT_EQ(rdr.renderString("{{ s|e('url') }}", data), reference_escape_url(s)) ;
+                EXPECT_EQ(rdr.renderString("{{ s|e('html_attr') }}", data), reference_escape_html_attr(s)) ;
+            }
+        }
+    }
+}
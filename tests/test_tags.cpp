@@ -2,6 +2,11 @@
 #include <variant/variant.hpp>
 #include <twig/renderer.hpp>
 
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <set>
+
 using namespace twig;
 using namespace std ;
 
@@ -50,6 +55,8 @@ TEST_F(TagTest, Filter) {
     try {
         string output =  rdr.renderString(code, {}) ;
         EXPECT_STREQ(output.c_str(), "TEXT") ;
+        EXPECT_EQ(rdr.renderString(R"({% filter format(name) %}Hello %s{% endfilter %})", {{"name", "Fabien"}}), "Hello Fabien") ;
+        EXPECT_THROW(rdr.renderString(R"({% filter nope %}text{% endfilter %})", {}), TemplateCompileException) ;
       
 //        output =  rdr.renderString(loop1, {}) ;
  //       EXPECT_STREQ(output.c_str(), "No users have been found.") ;
@@ -121,6 +128,81 @@ TEST_F(TagTest, ForBlockSequence) {
     }
 };
 
+TEST_F(TagTest, ForBlockLazyRange) {
+    TemplateRenderer rdr(nullptr), brdr(nullptr) ;
+    brdr.setBytecode() ;
+
+    Variant::Object ctx{{"n", 100000}, {"m", 6}} ;
+
+    vector<pair<string, string>> exprs{
+        { R"({% for i in 1..n %}{% if loop.last %}{{ i }} {{ loop.index0 }} {{ loop.length }}{% endif %}{% endfor %})", "100000 99999 100000" },
+        { R"({% for i in 1..m if i is odd %}{{ i }}{{ loop.revindex }},{% endfor %})", "16,34,52," },
+        { R"({% for k, v in 'a'..'c' %}{{ k }}{{ v }}{% endfor %})", "0a1b2c" },
+        { R"({% for i in m..1 %}{{ i }}{% else %}empty{% endfor %})", "empty" },
+        { R"({% for i in range(m, 0, -2) %}{{ i }}{% endfor %})", "6420" },
+        { R"({% for i in range(1, n)|slice(-3) %}{{ i }},{% endfor %})", "99998,99999,100000," },
+        { R"({{ (1..n)|length }} {{ (1..n)|first }} {{ (1..n)|last }} {{ range(0, n, 7)|last }})", "100000 1 100000 99995" },
+        { R"({{ (1..n)|slice(10, 3)|join(',') }} {{ (1..n)|slice(-5, -2)|length }} {{ range(0, n, 10)|slice(2)|first }})", "11,12,13 3 20" },
+        { R"({{ ('a'..'z')|slice(23)|join }}{{ (m..1)|first }}{{ (1..m)|slice(m)|length }})", "xyz0" },
+        { R"({% set r = 1..m %}{{ r|join(',') }} {{ (1..m)|slice(1, 2, true)|join(',') }})", "1,2,3,4,5,6 2,3" },
+        { R"({{ (1..m)|map(i => i * i)|join(',') }} {{ 3 in 1..m }})", "1,4,9,16,25,36 1" },
+    };
+
+    for ( auto &&e: exprs ) {
+        try {
+            EXPECT_EQ(rdr.renderString(e.first, ctx), e.second) << e.first ;
+            EXPECT_EQ(brdr.renderString(e.first, ctx), e.second) << e.first ;
+        } catch ( std::exception &ex ) {
+            ADD_FAILURE() << e.first << ": " << ex.what() ;
+        }
+    }
+}
+
+TEST_F(TagTest, ForBlockLoopVariable) {
+    TemplateRenderer rdr(nullptr), brdr(nullptr) ;
+    brdr.setBytecode() ;
+
+    Variant::Object ctx{{"items", Variant::Array{"a", "b", "c"}}} ;
+
+    vector<pair<string, string>> exprs{
+        { R"({% for x in items %}{{ x }}{% endfor %})", "abc" },
+        { R"({% for x in items %}{{ loop.index }}{{ loop.index0 }}{{ loop.revindex }}{{ loop.revindex0 }}{{ loop.length }}{% if loop.first %}F{% elif loop.last %}L{% endif %},{% endfor %})",
+          "10323F,21213,32103L," },
+        { R"({% for i in 1..2 %}{% for j in 1..loop.index %}{{ loop.index }}{% endfor %}|{% endfor %})", "1|12|" },
+        { R"({% for i in 1..2 %}{% for j in [] %}{% else %}{{ loop.index }}{% endfor %}{% endfor %})", "12" },
+        { R"({% for x in items %}{{ [1, 2]|map(v => v * loop.index)|join(',') }};{% endfor %})", "1,2;2,4;3,6;" },
+        { R"({% for x in items %}{% set l = loop %}{{ l.index }}{{ loop.last ? '.' }}{% endfor %})", "123." },
+        { R"({% for x in items %}{{ loop.missing ?? '-' }}{% endfor %})", "---" },
+        { R"({% for x in items %}{% set loop = {index: 'x'} %}{{ loop.index }}{% endfor %})", "xxx" },
+        { R"({% for x in items if loop.index is odd %}{{ x }}{% endfor %})", "ac" },
+    };
+
+    for ( auto &&e: exprs ) {
+        try {
+            EXPECT_EQ(rdr.renderString(e.first, ctx), e.second) << e.first ;
+            EXPECT_EQ(brdr.renderString(e.first, ctx), e.second) << e.first ;
+        } catch ( std::exception &ex ) {
+            ADD_FAILURE() << e.first << ": " << ex.what() ;
+        }
+    }
+
+    // other templates see the loop variable through the context
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"row.twig", R"({{ loop.index }}{{ x }})"},
+        {"list.twig", R"({% for x in items %}{% include 'row.twig' %}{% endfor %})"},
+        {"base.twig", R"({% for x in items %}{% block item %}{{ x }}{% endblock %}{% endfor %})"},
+        {"child.twig", R"({% extends 'base.twig' %}{% block item %}{{ loop.revindex }}{% endblock %})"},
+        {"macros.twig", R"({% macro m(v) %}{{ loop.index ?? v }}{% endmacro %})"},
+        {"macro.twig", R"({% import "macros.twig" as util %}{% for x in items %}{{ util.m('-') }}{% endfor %})"}
+    })) ;
+    TemplateRenderer lrdr(loader) ;
+    EXPECT_EQ(lrdr.render("list.twig", ctx), "1a2b3c") ;
+    EXPECT_EQ(lrdr.render("child.twig", ctx), "321") ;
+
+    // but not macros
+    EXPECT_EQ(lrdr.render("macro.twig", ctx), "---") ;
+}
+
 TEST_F(TagTest, SetBlock) {
     TemplateRenderer rdr(nullptr) ;
 
@@ -131,7 +213,9 @@ TEST_F(TagTest, SetBlock) {
     { R"({% set map = {'city': 'Paris'} %}{% set map = map|merge({country: 'France'}) %}{{ map.city }} {{ map.country }})", "Paris France" },
     { R"({% for item in items %}{% set value = item %}{% endfor %}{{value}})", "" },
     { R"({% set a, b = 1, 3+4 %}{{ a+b }})", "8" },
-    { R"({% set a%}Hello World {{items[1]}}{% endset %}{{a}})", "Hello World 2" }
+    { R"({% set a%}Hello World {{items[1]}}{% endset %}{{a}})", "Hello World 2" },
+    { R"({% set a = 1 %}{{ a }}{% set a = 2 %}{{ a }})", "12" },
+    { R"({% set a = 1 %}{{ b ?? '-' }}{% set b = a + 1 %}{{ b }})", "-2" }
     };
 
     Variant::Object ctx{{"items", Variant::Array{1, 2, 3}}};
@@ -184,6 +268,40 @@ TEST_F(TagTest, VerbatimBlock) {
     }
 };
 
+TEST_F(TagTest, AutoEscapeBlock) {
+    TemplateRenderer rdr(nullptr) ;
+
+    vector<pair<string, string>> exprs{
+        { R"({{ x }}{% autoescape %}{{ x }}{% endautoescape %})", "<a href='b'>&lt;a href=&apos;b&apos;&gt;" },
+        { R"({% autoescape 'html' %}{{ x }}{% autoescape false %}{{ x }}{% endautoescape %}{{ x|raw }}{% endautoescape %})", "&lt;a href=&apos;b&apos;&gt;<a href='b'><a href='b'>" },
+        { R"({% autoescape 'js' %}{{ x }}{% autoescape 'html' %}{{ '"' }}{% endautoescape %}{{ '"' }}{% endautoescape %})", "<a href=\\'b\\'>&quot;\\\"" }
+    };
+
+    Variant::Object ctx{{"x", "<a href='b'>"}} ;
+
+    try {
+        for ( auto &&expr: exprs ) {
+            string output =  rdr.renderString(expr.first, ctx) ;
+            EXPECT_EQ(output, expr.second) << expr.first ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+
+    // the strategy of an autoescape block applies to its own substitutions only
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"partial.twig", R"({{ x }})"},
+        {"page.twig", R"({% autoescape %}{{ x }}|{% include 'partial.twig' %}{% endautoescape %})"},
+        {"macros.twig", R"({% macro m(v) %}{{ v }}{% endmacro %})"},
+        {"caller.twig", R"({% import "macros.twig" as util %}{% autoescape %}{{ util.m(x) }}|{{ x }}{% endautoescape %})"}
+    })) ;
+    TemplateRenderer lrdr(loader) ;
+    EXPECT_EQ(lrdr.render("page.twig", ctx), "&lt;a href=&apos;b&apos;&gt;|<a href='b'>") ;
+    EXPECT_EQ(lrdr.render("caller.twig", ctx), "<a href='b'>|&lt;a href=&apos;b&apos;&gt;") ;
+
+    EXPECT_THROW(rdr.renderString(R"({% autoescape 'rot13' %}{{ x }}{% endautoescape %})", ctx), TemplateCompileException) ;
+};
+
 TEST_F(TagTest, ExtendsBlock) {
 
     std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
@@ -244,6 +362,7 @@ TEST_F(TagTest, IncludeBlock) {
         {"child1.html.twig", R"(Hello {% include 'base.html.twig' with {'name': 'Fabien'} %})"},
         {"child2.html.twig", R"(Hello {% include 'base.html.twig' only %})"},
         {"child3.html.twig", R"({%set name='Fabien'%}{{include("base.html.twig", ignore_missing:true)}})"},
+        {"child4.html.twig", R"({% for name in ['A', 'B'] %}{% include 'base.html.twig' %}{% endfor %})"},
     })) ;
     TemplateRenderer rdr(loader) ;
 
@@ -257,6 +376,9 @@ TEST_F(TagTest, IncludeBlock) {
         output = rdr.render("child3.html.twig", {});
         EXPECT_STREQ(output.c_str(), "Fabien") ;
 
+        output = rdr.render("child4.html.twig", {});
+        EXPECT_STREQ(output.c_str(), "AB") ;
+
           
     } catch ( TemplateCompileException &e ) {
         FAIL() << "Compilation failed: " << e.what() ;
@@ -297,3 +419,351 @@ TEST_F(TagTest, EmbedBlock) {
         FAIL() << "Compilation failed: " << e.what() ;
     }
 };
+
+TEST_F(TagTest, NestedScopes) {
+    TemplateRenderer rdr(nullptr) ;
+
+    vector<pair<string, string>> exprs{
+        { R"({% for i in [1, 2] %}{% for i in ['a'] %}{{ i }}{{ loop.length }}{% endfor %}{{ i }}{{ loop.length }}{% endfor %})", "a112a122" },
+        { R"({% for item in items %}{{ name }}{{ item }}{% endfor %}{{ item }})", "Fabien1Fabien2" },
+        { R"({% for item in items %}{% set name = 'John' %}{% endfor %}{{ name }})", "Fabien" },
+        { R"({% for name in items %}{{ name }}{% endfor %}{{ name }})", "12Fabien" },
+        { R"({% for k, v in {a: {b: 1}, c: {b: 2}} %}{{ k }}{{ v.b }}{% endfor %})", "a1c2" },
+        { R"({% for item in items %}{% set item = item * 10 %}{{ item }}{% endfor %})", "1020" },
+        { R"({% set x = 2 %}{{ items|map(name => name * x)|join(',') }}{{ name }})", "2,4Fabien" },
+    };
+
+    Variant::Object ctx{{"name", "Fabien"}, {"items", Variant::Array{1, 2}}};
+
+    try {
+        for ( auto &&expr: exprs ) {
+            string output =  rdr.renderString(expr.first, ctx) ;
+            EXPECT_STREQ(output.c_str(), expr.second.c_str()) ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+};
+
+TEST_F(TagTest, ConstantFolding) {
+    TemplateRenderer rdr(nullptr) ;
+
+    vector<pair<string, string>> exprs{
+        { R"(a{{ 'b' ~ 'c' }}d{{ 1 + 2 * 3 }})", "abcd7" },
+        { R"({% if flag %}a{{ 'b' }}c{% elif x %}{{ 'x' }}{% else %}d{{ 1 + 2 }}e{% endif %}f)", "abcf" },
+        { R"({% if not flag %}a{{ 'b' }}c{% else %}d{{ 1 + 2 }}e{% endif %}f)", "d3ef" },
+        { R"({% for i in [] %}x{{ 'y' }}{% else %}{{ 'y' }}z{% endfor %})", "yz" },
+        { R"({% for i in 1..3 %}{{ i }}{{ ',' }}{% endfor %})", "1,2,3," },
+        { R"({{ [1, 2, 3][1] + {a: 4}.a }}{{ true ? 'yes' : 'no' }}{{ ('a' in ['a', 'b']) ? 1 : 0 }})", "6yes1" },
+        { R"({% autoescape %}{{ '<b>' ~ 'x' }}{{ 'a b' }}{% endautoescape %})", "&lt;b&gt;xa b" }
+    };
+
+    Variant::Object ctx{{"flag", true}} ;
+
+    try {
+        for ( auto &&expr: exprs ) {
+            string output =  rdr.renderString(expr.first, ctx) ;
+            EXPECT_STREQ(output.c_str(), expr.second.c_str()) ;
+        }
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+};
+
+TEST_F(TagTest, SharedTemplates) {
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"card.twig", R"(<div>{% block body %}body{% endblock %}</div>)"},
+        {"page1.twig", R"({% embed "card.twig" %}{% block body %}one{% endblock %}{% endembed %})"},
+        {"page2.twig", R"({% embed "card.twig" %}{% block body %}two-{{ parent() }}{% endblock %}{% endembed %}{% include "card.twig" %})"},
+        {"layout_a.twig", R"(A:{% block content %}{% endblock %})"},
+        {"layout_b.twig", R"(B:{% block content %}{% endblock %})"},
+        {"child.twig", R"({% extends layout %}{% block content %}{{ name }}{% endblock %})"},
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    rdr.setCache(std::make_shared<Cache>()) ;
+
+    try {
+        // the same compiled templates are reused by different inheritance chains
+        for( int i=0 ; i<2 ; i++ ) {
+            EXPECT_EQ(rdr.render("page1.twig", {}), "<div>one</div>") ;
+            EXPECT_EQ(rdr.render("page2.twig", {}), "<div>two-body</div><div>body</div>") ;
+            EXPECT_EQ(rdr.render("child.twig", {{"layout", "layout_a.twig"}, {"name", "x"}}), "A:x") ;
+            EXPECT_EQ(rdr.render("child.twig", {{"layout", "layout_b.twig"}, {"name", "y"}}), "B:y") ;
+        }
+
+        // concurrent renders of cached templates
+        vector<std::thread> workers ;
+        std::atomic<int> failures{0} ;
+        for( int t=0 ; t<4 ; t++ ) {
+            workers.emplace_back([&, t]() {
+                for( int i=0 ; i<200 ; i++ ) {
+                    string layout = ( (t + i) % 2 ) ? "layout_a.twig" : "layout_b.twig" ;
+                    string expected = ( (t + i) % 2 ) ? "A:" : "B:" ;
+                    if ( rdr.render("child.twig", {{"layout", layout}, {"name", i}}) != expected + std::to_string(i) ) failures++ ;
+                    if ( rdr.render("page2.twig", {}) != "<div>two-body</div><div>body</div>" ) failures++ ;
+                }
+            }) ;
+        }
+        for( auto &w: workers ) w.join() ;
+        EXPECT_EQ(failures, 0) ;
+
+    } catch ( TemplateCompileException &e ) {
+        FAIL() << "Compilation failed: " << e.what() ;
+    }
+};
+
+TEST_F(TagTest, CacheEviction) {
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"a.twig", "a"}, {"b.twig", "b"}, {"c.twig", "c"}
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    auto cache = std::make_shared<Cache>(2, 0, 1) ;
+    rdr.setCache(cache) ;
+
+    rdr.render("a.twig", {}) ;
+    rdr.render("b.twig", {}) ;
+    rdr.render("a.twig", {}) ; // b is now the least recently used
+    rdr.render("c.twig", {}) ;
+    rdr.render("a.twig", {}) ;
+    rdr.render("b.twig", {}) ;
+
+    Cache::Stats st = cache->stats() ;
+    EXPECT_EQ(st.hits_, 2) ;
+    EXPECT_EQ(st.misses_, 4) ;
+    EXPECT_EQ(st.evictions_, 2) ;
+    EXPECT_EQ(st.entries_, 2) ;
+    EXPECT_EQ(st.size_, 2) ;
+};
+
+class CountingLoader: public TemplateLoader {
+public:
+    std::string load(const std::string &src) override {
+        loads_++ ;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)) ;
+        if ( src == "self.twig" ) return R"({% extends "self.twig" %})" ;
+        return "Hello {{ name }}" ;
+    }
+
+    std::atomic<int> loads_{0} ;
+};
+
+TEST_F(TagTest, SingleFlightCompile) {
+
+    auto loader = std::make_shared<CountingLoader>() ;
+    TemplateRenderer rdr(loader) ;
+    rdr.setCache(std::make_shared<Cache>()) ;
+
+    vector<std::thread> workers ;
+    std::atomic<int> failures{0} ;
+    for( int t=0 ; t<8 ; t++ ) {
+        workers.emplace_back([&]() {
+            if ( rdr.render("hello.twig", {{"name", "Fabien"}}) != "Hello Fabien" ) failures++ ;
+        }) ;
+    }
+    for( auto &w: workers ) w.join() ;
+
+    EXPECT_EQ(failures, 0) ;
+    EXPECT_EQ(loader->loads_, 1) ;
+
+    EXPECT_THROW(rdr.render("self.twig", {}), TemplateCompileException) ;
+};
+
+// templates extending each other, slow enough for two threads to start compiling one each
+class CycleLoader: public TemplateLoader {
+public:
+    std::string load(const std::string &src) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)) ;
+        return src == "a.twig" ? R"({% extends "b.twig" %})" : R"({% extends "a.twig" %})" ;
+    }
+};
+
+TEST_F(TagTest, CircularReferenceAcrossThreads) {
+
+    TemplateRenderer rdr(std::make_shared<CycleLoader>()) ;
+    rdr.setCache(std::make_shared<Cache>()) ;
+
+    std::atomic<int> failures{0} ;
+    vector<std::thread> workers ;
+    for( string key: { "a.twig", "b.twig" } ) {
+        workers.emplace_back([&, key]() {
+            try {
+                rdr.render(key, {}) ;
+            } catch ( TemplateCompileException & ) {
+                failures++ ;
+            }
+        }) ;
+    }
+    for( auto &w: workers ) w.join() ;
+
+    EXPECT_EQ(failures, 2) ;
+    EXPECT_THROW(rdr.render("a.twig", {}), TemplateCompileException) ;
+};
+
+TEST_F(TagTest, CacheRevalidation) {
+
+    string dir = ::testing::TempDir() ;
+    string path = dir + "/revalidate.twig" ;
+
+    ofstream(path) << "first {{ name }}" ;
+
+    std::shared_ptr<TemplateLoader> loader(new FileSystemTemplateLoader({dir})) ;
+    TemplateRenderer rdr(loader) ;
+    auto cache = std::make_shared<Cache>() ;
+    cache->setCheckInterval(std::chrono::milliseconds(1)) ;
+    rdr.setCache(cache) ;
+
+    EXPECT_EQ(rdr.render("revalidate", {{"name", "Fabien"}}), "first Fabien") ;
+    EXPECT_EQ(rdr.render("revalidate", {{"name", "Fabien"}}), "first Fabien") ;
+
+    ofstream(path) << "modified {{ name }}" ;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10)) ;
+
+    EXPECT_EQ(rdr.render("revalidate", {{"name", "Fabien"}}), "modified Fabien") ;
+    EXPECT_EQ(cache->stats().invalidations_, 1) ;
+
+    std::remove(path.c_str()) ;
+};
+
+TEST_F(TagTest, CacheRevalidationEvictedParent) {
+
+    string dir = ::testing::TempDir() ;
+    string base = dir + "/evicted_base.twig", child = dir + "/evicted_child.twig" ;
+
+    ofstream(base) << "BASE1 {% block content %}{% endblock %}" ;
+    ofstream(child) << R"({% extends "evicted_base" %}{% block content %}child{% endblock %})" ;
+
+    std::shared_ptr<TemplateLoader> loader(new FileSystemTemplateLoader({dir})) ;
+    TemplateRenderer rdr(loader) ;
+    auto cache = std::make_shared<Cache>(1, 0, 1) ; // the base is evicted as soon as the child is added
+    cache->setCheckInterval(std::chrono::milliseconds(1)) ;
+    rdr.setCache(cache) ;
+
+    EXPECT_EQ(rdr.render("evicted_child", {}), "BASE1 child") ;
+    EXPECT_EQ(cache->stats().entries_, 1) ;
+
+    ofstream(base) << "BASE2-changed {% block content %}{% endblock %}" ;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10)) ;
+
+    EXPECT_EQ(rdr.render("evicted_child", {}), "BASE2-changed child") ;
+
+    // replacing a cached template evicts the templates compiled against it
+    auto unbounded = std::make_shared<Cache>() ;
+    rdr.setCache(unbounded) ;
+    rdr.render("evicted_child", {}) ;
+    unbounded->add("evicted_base", unbounded->fetch("evicted_base")) ;
+    EXPECT_EQ(unbounded->stats().entries_, 1) ;
+    EXPECT_EQ(unbounded->dependents("evicted_base").size(), 0) ;
+
+    std::remove(base.c_str()) ;
+    std::remove(child.c_str()) ;
+};
+
+// serves a single template and only overrides load(src)
+class SingleTemplateLoader: public TemplateLoader {
+public:
+    std::string load(const std::string &src) override {
+        if ( src != "custom" ) throw TemplateLoadException("Cannot find template: " + src) ;
+        return "custom" ;
+    }
+};
+
+TEST_F(TagTest, CacheRevalidationChoiceLoader) {
+
+    string dir = ::testing::TempDir() ;
+    string path = dir + "/choice_fs.twig" ;
+
+    ofstream(path) << "fs {{ name }}" ;
+
+    std::shared_ptr<TemplateLoader> loader(new ChoiceTemplateLoader({
+        std::make_shared<SingleTemplateLoader>(), std::make_shared<FileSystemTemplateLoader>(std::initializer_list<string>{dir})
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    auto cache = std::make_shared<Cache>() ;
+    cache->setCheckInterval(std::chrono::milliseconds(1)) ;
+    rdr.setCache(cache) ;
+
+    // the custom loader does not have the template, so it must not report a version for it
+    for( int i = 0 ; i < 3 ; i++ ) {
+        EXPECT_EQ(rdr.render("choice_fs", {{"name", "Fabien"}}), "fs Fabien") ;
+        EXPECT_EQ(rdr.render("custom", {}), "custom") ;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5)) ;
+    }
+
+    EXPECT_EQ(cache->stats().invalidations_, 0) ;
+    EXPECT_EQ(cache->stats().misses_, 2) ;
+
+    std::remove(path.c_str()) ;
+};
+
+TEST_F(TagTest, DependencyInvalidation) {
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"base.twig", R"({% block content %}{% endblock %})"},
+        {"macros.twig", R"({% macro m() %}m{% endmacro %})"},
+        {"child.twig", R"({% extends "base.twig" %}{% import "macros.twig" as util %}{% block content %}{% include "part.twig" %}{% endblock %})"},
+        {"grandchild.twig", R"({% extends "child.twig" %})"},
+        {"part.twig", R"(part)"},
+        {"other.twig", R"(other)"},
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    auto cache = std::make_shared<Cache>() ;
+    rdr.setCache(cache) ;
+
+    EXPECT_EQ(rdr.getDependencies("child.twig"), (std::set<string>{"base.twig", "macros.twig", "part.twig"})) ;
+
+    EXPECT_EQ(rdr.render("grandchild.twig", {}), "part") ;
+    rdr.render("other.twig", {}) ;
+    EXPECT_EQ(cache->stats().entries_, 5) ;
+
+    EXPECT_EQ(cache->dependents("base.twig"), (std::set<string>{"child.twig", "grandchild.twig"})) ;
+
+    rdr.invalidate("base.twig") ;
+    EXPECT_EQ(cache->stats().entries_, 2) ; // part.twig and other.twig
+    EXPECT_EQ(cache->stats().invalidations_, 3) ;
+    EXPECT_EQ(rdr.render("grandchild.twig", {}), "part") ;
+};
+
+TEST_F(TagTest, StreamingRender) {
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"base.twig", R"(<ul>{% block items %}{% endblock %}</ul>)"},
+        {"list.twig", R"({% extends "base.twig" %}{% block items %}{% for i in 1..100 %}<li>{{ i }}</li>{% endfor %}{% endblock %})"},
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    rdr.setFlushThreshold(64) ;
+
+    vector<string> chunks ;
+    CallbackSink sink([&](const char *data, size_t len) { chunks.emplace_back(data, len) ; }) ;
+    rdr.render("list.twig", {}, sink) ;
+
+    string streamed ;
+    for( const auto &c: chunks ) {
+        EXPECT_LT(c.size(), 128) ;
+        streamed += c ;
+    }
+
+    EXPECT_GT(chunks.size(), 10) ;
+    EXPECT_EQ(streamed, rdr.render("list.twig", {})) ;
+};
+
+TEST_F(TagTest, OutputEstimate) {
+
+    std::shared_ptr<TemplateLoader> loader(new DictTemplateLoader({
+        {"list.twig", R"({% for i in 1..n %}0123456789{% endfor %})"},
+        {"empty.twig", ""},
+    })) ;
+    TemplateRenderer rdr(loader) ;
+    rdr.setCache(std::make_shared<Cache>()) ;
+
+    EXPECT_EQ(rdr.getOutputEstimate("list.twig"), 0) ;
+
+    rdr.render("list.twig", {{"n", 100}}) ;
+    EXPECT_EQ(rdr.getOutputEstimate("list.twig"), 1000) ;
+
+    for( int i=0 ; i<50 ; i++ )
+        rdr.render("list.twig", {{"n", 200}}) ;
+
+    EXPECT_NEAR(rdr.getOutputEstimate("list.twig"), 2000, 20) ;
+};
@@ -3,6 +3,9 @@
 #include <twig/renderer.hpp>
 #include <twig/translator.hpp>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 using namespace twig;
 using namespace std ;
@@ -54,6 +57,86 @@ TEST_F(TranslationTest, TransFilter) {
 }
 
 
+TEST_F(TranslationTest, CachedFormats) {
+    Translator tr("en_US") ;
+    ASSERT_TRUE(tr.loadTranslations(std::string(DATA_DIR) + "translations/en_US.json")) ;
+
+    // the parsed pattern is reused with different arguments
+    for( int i = 0 ; i < 3 ; i++ ) {
+        EXPECT_EQ(tr.translate("welcome", Variant::Object{{"name", "John"}}), "Welcome John") ;
+        EXPECT_EQ(tr.translate("welcome", Variant::Object{{"name", "Mary"}}), "Welcome Mary") ;
+        EXPECT_EQ(tr.translate("results", Variant::Object{{"count", 1}}), "There is 1 result.") ;
+    }
+
+    // plain text and untranslated keys, with or without ICU syntax
+    EXPECT_EQ(tr.translate("name"), "Name") ;
+    EXPECT_EQ(tr.translate("missing key"), "missing key") ;
+    EXPECT_EQ(tr.translate("Hello {who}", Variant::Object{{"who", "world"}}), "Hello world") ;
+    EXPECT_EQ(tr.translate("It''s {n} o''clock", Variant::Object{{"n", 5}}), "It's 5 o'clock") ;
+    EXPECT_EQ(tr.translate("{a}{b}{c}{d}{e}", Variant::Object{{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}, {"e", 5}}), "12345") ;
+    EXPECT_EQ(tr.translate("{broken"), "Format Error") ;
+    EXPECT_EQ(tr.translate("{broken"), "Format Error") ;
+
+    // concurrent use of a shared translator
+    vector<thread> threads ;
+    atomic<int> errors{0} ;
+    for( int t = 0 ; t < 4 ; t++ ) {
+        threads.emplace_back([&, t]() {
+            for( int i = 0 ; i < 200 ; i++ ) {
+                string count = std::to_string(t * 200 + i + 2) ;
+                if ( tr.translate("results", Variant::Object{{"count", t * 200 + i + 2}}) != "There are " + count + " results." ) ++errors ;
+                if ( tr.translate("key " + std::to_string(i % 10) + " {x}", Variant::Object{{"x", t}}) != "key " + std::to_string(i % 10) + " " + std::to_string(t) ) ++errors ;
+            }
+        }) ;
+    }
+    for( auto &t: threads ) t.join() ;
+    EXPECT_EQ(errors, 0) ;
+}
+
+
+TEST_F(TranslationTest, LocaleFallback) {
+    TranslationManager mgr ;
+    const string dir = std::string(DATA_DIR) + "translations/" ;
+
+    // nothing loaded: an empty translator of the default locale, the same for every lookup
+    auto empty = mgr.getTranslator("fr_FR") ;
+    EXPECT_EQ(empty->getLocale(), "en_US") ;
+    EXPECT_EQ(empty.get(), mgr.getTranslator("de").get()) ;
+    EXPECT_EQ(mgr.translate("name", "fr_FR"), "name") ;
+
+    mgr.loadAllFromDirectory(dir) ;
+
+    EXPECT_EQ(mgr.getTranslator("el_EL")->getLocale(), "el_EL") ;
+    EXPECT_EQ(mgr.getTranslator("el")->getLocale(), "el_EL") ;       // language
+    EXPECT_EQ(mgr.getTranslator("en_GB")->getLocale(), "en_US") ;    // language
+    EXPECT_EQ(mgr.getTranslator("el-CY")->getLocale(), "el_EL") ;
+    EXPECT_EQ(mgr.getTranslator("fr_FR")->getLocale(), "en_US") ;    // default
+    EXPECT_EQ(mgr.translate("name", "en_GB"), "Name") ;
+
+    auto locales = mgr.getSupportedLocales() ;
+    std::sort(locales.begin(), locales.end()) ;
+    EXPECT_EQ(locales, (vector<string>{"el_EL", "en_US"})) ;
+
+    // lookups while the translations are reloaded
+    atomic<bool> done{false} ;
+    atomic<int> errors{0} ;
+    thread reader([&]() {
+        while ( !done ) {
+            if ( mgr.translate("name", "el") != "Όνομα" ) ++errors ;
+            if ( mgr.getTranslator("en_GB")->getLocale() != "en_US" ) ++errors ;
+        }
+    }) ;
+    for( int i = 0 ; i < 20 ; i++ ) mgr.loadAllFromDirectory(dir) ;
+    done = true ;
+    reader.join() ;
+    EXPECT_EQ(errors, 0) ;
+
+    TranslationManager greek("el_EL") ;
+    greek.loadAllFromDirectory(dir) ;
+    EXPECT_EQ(greek.translate("name", "fr"), "Όνομα") ;
+}
+
+
 #if 0
 TEST_F(FunctionTest, DateFilterStatic) {
     TemplateRenderer rdr(nullptr) ;